@@ -0,0 +1,404 @@
+#include "bot.h"
+#include "client.h"
+#include "fake.h"
+#include "fake_data.h"
+#include "rate_limiter.h"
+#include "text_scan.h"
+#include "transport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// bot-bench: микробенчмарки горячих путей и end-to-end прогон бота против
+// нагрузочного сценария FakeServer ("Benchmark")
+// формат вывода как у google benchmark: имя, время на итерацию, число
+// итераций и пропускная способность
+// EndToEnd/Loopback - тот же прогон через LoopbackTransport, без сокетов:
+// видно, сколько стоят разбор, диспетчеризация и обработчики сами по себе
+// bot-bench [--filter substring] [--min-time seconds] [--e2e-updates N]
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+class State {
+public:
+  explicit State(uint64_t iterations) : iterations_(iterations) {}
+
+  uint64_t Iterations() const { return iterations_; }
+  void SetItemsProcessed(uint64_t items) { items_ = items; }
+  void SetBytesProcessed(uint64_t bytes) { bytes_ = bytes; }
+  uint64_t Items() const { return items_; }
+  uint64_t Bytes() const { return bytes_; }
+
+private:
+  uint64_t iterations_;
+  uint64_t items_ = 0;
+  uint64_t bytes_ = 0;
+};
+
+// не даём компилятору выбросить вычисление
+template <class T> void DoNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Benchmark {
+  std::string name;
+  std::function<void(State &)> body;
+};
+
+std::vector<Benchmark> &Registry() {
+  static std::vector<Benchmark> benchmarks;
+  return benchmarks;
+}
+
+void Register(std::string name, std::function<void(State &)> body) {
+  Registry().push_back(Benchmark{std::move(name), std::move(body)});
+}
+
+std::string Rate(double per_second, const char *unit) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(2);
+  if (per_second >= 1e9) {
+    out << per_second / 1e9 << "G";
+  } else if (per_second >= 1e6) {
+    out << per_second / 1e6 << "M";
+  } else if (per_second >= 1e3) {
+    out << per_second / 1e3 << "k";
+  } else {
+    out << per_second;
+  }
+  out << unit;
+  return out.str();
+}
+
+// увеличиваем число итераций, пока прогон не займёт min_time
+void Run(const Benchmark &benchmark, double min_time) {
+  uint64_t iterations = 1;
+  while (true) {
+    State state(iterations);
+    auto start = Clock::now();
+    benchmark.body(state);
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (elapsed >= min_time || iterations >= (uint64_t(1) << 40)) {
+      std::cout << std::left << std::setw(40) << benchmark.name << std::right
+                << std::setw(14) << std::fixed << std::setprecision(1)
+                << elapsed * 1e9 / iterations << " ns" << std::setw(12)
+                << iterations;
+      if (state.Items() != 0) {
+        std::cout << "  items/s=" << Rate(state.Items() / elapsed, "");
+      }
+      if (state.Bytes() != 0) {
+        std::cout << "  bytes/s=" << Rate(state.Bytes() / elapsed, "B");
+      }
+      std::cout << std::endl;
+      return;
+    }
+    double scale = elapsed > 0 ? min_time * 1.4 / elapsed : 10;
+    iterations = std::max(iterations + 1,
+                          static_cast<uint64_t>(iterations *
+                                                std::min(scale, 10.0)));
+  }
+}
+
+// GetUpdatesFourMessagesJson, размноженный до updates апдейтов
+std::string ScaledUpdatesJson(size_t updates) {
+  const std::string &json = FakeData::GetUpdatesFourMessagesJson;
+  size_t open = json.find('[');
+  size_t close = json.rfind(']');
+  std::string items = json.substr(open + 1, close - open - 1);
+  std::string body = json.substr(0, open + 1);
+  for (size_t idx = 0; idx < (updates + 3) / 4; ++idx) {
+    if (idx != 0) {
+      body += ',';
+    }
+    body += items;
+  }
+  return body + json.substr(close);
+}
+
+void BenchDecodeUpdates(State &state, size_t updates) {
+  std::string json = ScaledUpdatesJson(updates);
+  UpdateDecoder decoder;
+  size_t decoded = 0;
+  for (uint64_t it = 0; it < state.Iterations(); ++it) {
+    // то же, что FormCppStructFromJson: потоковый разбор прямо в арену
+    UpdateBatch batch;
+    std::istringstream input(json);
+    decoder.Decode(input,
+                   [&](const DecodedUpdate &update) { batch.Add(update); });
+    decoded += batch.Size();
+    DoNotOptimize(batch.Size());
+  }
+  state.SetItemsProcessed(decoded);
+  state.SetBytesProcessed(json.size() * state.Iterations());
+}
+
+std::string BenchOffsetFile() { return "bot-bench.offset"; }
+
+void BenchDispatch(State &state) {
+  TelegramBot::Options options;
+  options.offset_file_name = BenchOffsetFile();
+  TelegramBot bot("bench", "http://localhost/", options);
+  ClientTelegramBotAPI::Options client_options;
+  client_options.offset_file_name = BenchOffsetFile();
+  ClientTelegramBotAPI client("bench", "http://localhost/", client_options);
+
+  // встроенные команды отвечают в сеть, поэтому подменяем их счётчиками
+  uint64_t handled = 0;
+  const std::vector<std::string> commands = {"/random", "/weather",
+                                             "/styleguide", "/unknown",
+                                             "/random@other_bot"};
+  for (const char *command : {"/random", "/weather", "/styleguide"}) {
+    bot.Router().Register(command,
+                          [&handled](const CommandContext &) { ++handled; });
+  }
+  for (int idx = 0; idx < 50; ++idx) {
+    bot.Router().Register("/extra" + std::to_string(idx),
+                          [&handled](const CommandContext &) { ++handled; });
+  }
+  bot.Router().SetBotName("bench_bot");
+
+  NewMessage message(1, 1, 1, "/random", {});
+  for (uint64_t it = 0; it < state.Iterations(); ++it) {
+    const std::string &command = commands[it % commands.size()];
+    DoNotOptimize(
+        bot.Router().Dispatch(CommandContext{client, message, command}));
+  }
+  DoNotOptimize(handled);
+  state.SetItemsProcessed(state.Iterations());
+}
+
+void BenchSendMessageJson(State &state, const std::string &text) {
+  uint64_t bytes = 0;
+  for (uint64_t it = 0; it < state.Iterations(); ++it) {
+    std::string body = ClientTelegramBotAPI::FormSendMessageJson(
+        104519755, text, it % 2 == 0 ? -1 : 2);
+    bytes += body.size();
+    DoNotOptimize(body.data());
+  }
+  state.SetItemsProcessed(state.Iterations());
+  state.SetBytesProcessed(bytes);
+}
+
+// команда в конце длинного русского текста: offset сущности в utf-16
+void BenchUtf16Offsets(State &state, size_t letters) {
+  std::string text;
+  for (size_t idx = 0; idx < letters; ++idx) {
+    text += idx % 8 == 7 ? " " : "ж";
+  }
+  size_t offset = Utf16Length(text);
+  text += " /weather";
+  for (uint64_t it = 0; it < state.Iterations(); ++it) {
+    Utf16Cursor cursor(text);
+    DoNotOptimize(cursor.Slice(offset + 1, 8).data());
+  }
+  state.SetBytesProcessed(text.size() * state.Iterations());
+}
+
+// бот целиком: long-poll, разбор, воркеры, sendMessage по keep-alive
+// против FakeServer на localhost; лимиты telegram отключены
+void RunEndToEnd(int64_t total_updates) {
+  telegram::FakeOptions fake_options;
+  fake_options.Port = 0;
+  fake_options.BatchSize = 100;
+  fake_options.TotalUpdates = total_updates;
+  fake_options.Chats = 1000;
+  fake_options.Threads = 32;
+  telegram::FakeServer fake("Benchmark", fake_options);
+  fake.Start();
+
+  RateLimiter::Options unlimited;
+  unlimited.global_rate = unlimited.global_burst = 1e9;
+  unlimited.chat_rate = unlimited.chat_burst = 1e9;
+  TelegramBot::Options options;
+  options.workers = 8;
+  options.offset_file_name = BenchOffsetFile();
+  options.rate_limiter = std::make_shared<RateLimiter>(unlimited);
+  options.poll.idle_timeout = 1;
+  // фейк держит пустой long-poll до timeout, а Stop его дожидается
+  std::remove(BenchOffsetFile().c_str());
+  TelegramBot bot("bench", fake.GetUrl(), options);
+
+  auto start = Clock::now();
+  std::thread runner([&bot] { bot.Start(); });
+  auto deadline = start + std::chrono::minutes(5);
+  telegram::BenchmarkStats stats;
+  while (Clock::now() < deadline) {
+    stats = fake.Stats();
+    if (stats.UpdatesServed >= static_cast<uint64_t>(total_updates) &&
+        stats.RepliesReceived >= stats.CommandsServed) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  bot.Stop();
+  runner.join();
+  fake.Stop();
+  std::remove(BenchOffsetFile().c_str());
+
+  std::cout << std::left << std::setw(40) << "EndToEnd/FakeServer" << std::right
+            << " updates=" << stats.UpdatesServed
+            << " replies=" << stats.RepliesReceived
+            << " msgs/s=" << Rate(stats.RepliesReceived / elapsed, "")
+            << " reaction_us p50=" << stats.ReactionP50Us
+            << " p99=" << stats.ReactionP99Us
+            << " max=" << stats.ReactionMaxUs << std::endl;
+}
+
+// Bot API для EndToEnd/Loopback: getUpdates отдаёт батчи по 100 апдейтов,
+// каждый четвёртый - команда /weather, sendMessage считает ответы
+class LoopbackApi {
+public:
+  explicit LoopbackApi(int64_t total_updates) : total_(total_updates) {}
+
+  int Handle(const TransportRequest &request, std::string &body) {
+    if (request.path.find("/sendMessage") != std::string::npos) {
+      ++replies_;
+      body = FakeData::SendMessageReplyJson;
+      return 200;
+    }
+    if (request.path.find("/getUpdates") == std::string::npos) {
+      body = FakeData::GetMeJson;
+      return 200;
+    }
+    int64_t first = served_.load();
+    int64_t count = std::min<int64_t>(100, total_ - first);
+    if (count <= 0) {
+      // всё роздано - как long-poll без апдейтов, только быстрее
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      body = "{\"ok\":true,\"result\":[]}";
+      return 200;
+    }
+    body = "{\"ok\":true,\"result\":[";
+    for (int64_t id = first + 1; id <= first + count; ++id) {
+      bool command = id % 4 == 0;
+      if (id != first + 1) {
+        body += ',';
+      }
+      body += "{\"update_id\":" + std::to_string(id) +
+              ",\"message\":{\"message_id\":" + std::to_string(id) +
+              ",\"chat\":{\"id\":" + std::to_string(1 + id % 1000) +
+              "},\"text\":\"" + (command ? "/weather" : "just a message") +
+              "\"";
+      if (command) {
+        body += ",\"entities\":[{\"offset\":0,\"length\":8,"
+                "\"type\":\"bot_command\"}]";
+      }
+      body += "}}";
+    }
+    body += "]}";
+    served_ += count;
+    return 200;
+  }
+
+  int64_t Served() const { return served_; }
+  int64_t Replies() const { return replies_; }
+
+private:
+  const int64_t total_;
+  std::atomic<int64_t> served_{0};
+  std::atomic<int64_t> replies_{0};
+};
+
+void RunLoopback(int64_t total_updates) {
+  LoopbackApi api(total_updates);
+  RateLimiter::Options unlimited;
+  unlimited.global_rate = unlimited.global_burst = 1e9;
+  unlimited.chat_rate = unlimited.chat_burst = 1e9;
+  TelegramBot::Options options;
+  options.workers = 8;
+  options.offset_file_name = BenchOffsetFile();
+  options.rate_limiter = std::make_shared<RateLimiter>(unlimited);
+  options.dedup_updates = false;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&api](const TransportRequest &request, std::string &body) {
+        return api.Handle(request, body);
+      });
+  std::remove(BenchOffsetFile().c_str());
+  TelegramBot bot("bench", "http://loopback/", options);
+
+  auto start = Clock::now();
+  std::thread runner([&bot] { bot.Start(); });
+  int64_t commands = total_updates / 4;
+  auto deadline = start + std::chrono::minutes(5);
+  while (Clock::now() < deadline &&
+         (api.Served() < total_updates || api.Replies() < commands)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  bot.Stop();
+  runner.join();
+  std::remove(BenchOffsetFile().c_str());
+
+  std::cout << std::left << std::setw(40) << "EndToEnd/Loopback" << std::right
+            << " updates=" << api.Served() << " replies=" << api.Replies()
+            << " updates/s=" << Rate(api.Served() / elapsed, "")
+            << " msgs/s=" << Rate(api.Replies() / elapsed, "") << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string filter;
+  double min_time = 0.5;
+  int64_t e2e_updates = 20000;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string key = argv[i];
+    if (key == "--filter") {
+      filter = argv[i + 1];
+    } else if (key == "--min-time") {
+      min_time = std::stod(argv[i + 1]);
+    } else if (key == "--e2e-updates") {
+      e2e_updates = std::stoll(argv[i + 1]);
+    } else {
+      std::cerr << "unknown option " << key << std::endl;
+      return 1;
+    }
+  }
+
+  for (size_t updates : {4, 100}) {
+    Register("DecodeUpdates/" + std::to_string(updates),
+             [updates](State &state) { BenchDecodeUpdates(state, updates); });
+  }
+  Register("RouterDispatch", BenchDispatch);
+  Register("SendMessageJson/short",
+           [](State &state) { BenchSendMessageJson(state, "Reply"); });
+  Register("SendMessageJson/escaped", [](State &state) {
+    BenchSendMessageJson(state, "line \"one\"\nline two\tпривет");
+  });
+  Register("SendMessageJson/4096", [](State &state) {
+    BenchSendMessageJson(state, std::string(4096, 'x'));
+  });
+  for (size_t letters : {64, 2048}) {
+    Register("Utf16Offsets/" + std::to_string(letters),
+             [letters](State &state) { BenchUtf16Offsets(state, letters); });
+  }
+
+  for (const Benchmark &benchmark : Registry()) {
+    if (benchmark.name.find(filter) != std::string::npos) {
+      Run(benchmark, min_time);
+    }
+  }
+  if (e2e_updates > 0 &&
+      std::string("EndToEnd/FakeServer").find(filter) != std::string::npos) {
+    RunEndToEnd(e2e_updates);
+  }
+  if (e2e_updates > 0 &&
+      std::string("EndToEnd/Loopback").find(filter) != std::string::npos) {
+    RunLoopback(e2e_updates);
+  }
+  std::remove(BenchOffsetFile().c_str());
+  return 0;
+}
@@ -1,51 +1,556 @@
 #include "bot.h"
 #include "client.h"
+#include "metrics.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
 #include <variant>
 
+namespace {
+
+ClientTelegramBotAPI::Options
+MakeClientOptions(const TelegramBot::Options &options,
+                  std::shared_ptr<PollAbort> poll_abort) {
+  ClientTelegramBotAPI::Options client_options;
+  client_options.session_pool = options.session_pool;
+  client_options.transport = options.transport;
+  client_options.rate_limiter = options.rate_limiter;
+  client_options.offset_file_name = options.offset_file_name;
+  client_options.updates_limit = options.updates_limit;
+  client_options.batch_bytes = options.batch_bytes;
+  client_options.journal = options.journal;
+  client_options.poll_abort = std::move(poll_abort);
+  return client_options;
+}
+
+} // namespace
+
+void CommandRouter::Register(std::string command, Handler handler) {
+  for (auto &entry : entries_) {
+    if (entry.command == command) {
+      entry.handler = std::move(handler);
+      return;
+    }
+  }
+  entries_.push_back(Entry{std::move(command), std::move(handler)});
+  // таблица готова до старта воркеров, поиск её только читает
+  Build();
+}
+
+void CommandRouter::SetBotName(std::string bot_name) {
+  std::transform(bot_name.begin(), bot_name.end(), bot_name.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  bot_name_ = std::move(bot_name);
+}
+
+uint64_t CommandRouter::Hash(std::string_view command, uint64_t seed) {
+  // FNV-1a с seed, в конце перемешивание, чтобы младшие биты были хорошими
+  uint64_t hash = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+  for (char c : command) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void CommandRouter::Build() {
+  size_t size = 1;
+  while (size < entries_.size() * 2) {
+    size <<= 1;
+  }
+  while (true) {
+    for (uint64_t seed = 1; seed <= 64; ++seed) {
+      table_.assign(size, -1);
+      bool collision = false;
+      for (size_t idx = 0; idx < entries_.size() && !collision; ++idx) {
+        int32_t &slot = table_[Hash(entries_[idx].command, seed) & (size - 1)];
+        collision = slot != -1;
+        slot = static_cast<int32_t>(idx);
+      }
+      if (!collision) {
+        seed_ = seed;
+        mask_ = size - 1;
+        return;
+      }
+    }
+    // не нашли seed без коллизий - увеличиваем таблицу
+    size <<= 1;
+  }
+}
+
+std::string_view CommandRouter::Normalize(std::string_view command) const {
+  size_t at = command.find('@');
+  if (at == std::string_view::npos) {
+    return command;
+  }
+  std::string_view bot_name = command.substr(at + 1);
+  if (!bot_name_.empty()) {
+    if (bot_name.size() != bot_name_.size() ||
+        !std::equal(bot_name.begin(), bot_name.end(), bot_name_.begin(),
+                    [](char lhs, char rhs) {
+                      return std::tolower(static_cast<unsigned char>(lhs)) ==
+                             rhs;
+                    })) {
+      return {};
+    }
+  }
+  return command.substr(0, at);
+}
+
+const CommandRouter::Handler *
+CommandRouter::Find(std::string_view command) const {
+  command = Normalize(command);
+  if (command.empty() || entries_.empty()) {
+    return nullptr;
+  }
+  int32_t idx = table_[Hash(command, seed_) & mask_];
+  if (idx == -1 || entries_[idx].command != command) {
+    return nullptr;
+  }
+  return &entries_[idx].handler;
+}
+
+bool CommandRouter::Dispatch(const CommandContext &context) {
+  const Handler *handler = Find(context.command);
+  if (handler == nullptr) {
+    return false;
+  }
+  (*handler)(CommandContext{context.client, context.message,
+                            Normalize(context.command), context.state});
+  return true;
+}
+
+void CommandRouter::RegisterCached(std::string command, Responder responder) {
+  RegisterCached(std::move(command), std::move(responder), CacheOptions());
+}
+
+void CommandRouter::RegisterCached(std::string command, Responder responder,
+                                   CacheOptions options) {
+  std::string key = command;
+  Register(std::move(command), [this, key, responder = std::move(responder),
+                                options](const CommandContext &context) {
+    int64_t chat_id = context.message.GetChatId();
+    std::string text = cache_->GetOrCompute(
+        options.per_chat ? key + ' ' + std::to_string(chat_id) : key,
+        options.ttl, [&] { return responder(context); });
+    context.client.SendMessage(chat_id, std::move(text));
+  });
+}
+
+void CommandRouter::SetResponseCache(std::shared_ptr<ResponseCache> cache) {
+  cache_ = std::move(cache);
+}
+
+ResponseCache &CommandRouter::Cache() { return *cache_; }
+
+void CommandRouter::RegisterCallback(std::string key, CallbackHandler handler) {
+  callbacks_[std::move(key)] = std::move(handler);
+}
+
+bool CommandRouter::DispatchCallback(const CallbackContext &context) {
+  std::string_view data = context.query.GetData();
+  size_t colon = data.find(':');
+  std::string_view key = data.substr(0, colon);
+  std::string_view payload;
+  if (colon != std::string_view::npos) {
+    payload = data.substr(colon + 1);
+  }
+  auto handler = callbacks_.find(key);
+  if (handler == callbacks_.end()) {
+    return false;
+  }
+  handler->second(
+      CallbackContext{context.client, context.query, payload, context.state});
+  return true;
+}
+
+void CommandRouter::RegisterEdited(Handler handler) {
+  edited_ = std::move(handler);
+}
+
+bool CommandRouter::HasEdited() const { return static_cast<bool>(edited_); }
+
+bool CommandRouter::DispatchEdited(const CommandContext &context) {
+  if (!edited_) {
+    return false;
+  }
+  edited_(context);
+  return true;
+}
+
 TelegramBot::TelegramBot(const std::string &token, const std::string &uri)
-    : token_(std::move(token)), uri_(std::move(uri)) {
+    : TelegramBot(token, uri, Options()) {}
+
+TelegramBot::TelegramBot(const std::string &token, const std::string &uri,
+                         Options options)
+    : options_(options), token_(std::move(token)), uri_(std::move(uri)),
+      shard_salt_(static_cast<int64_t>(std::hash<std::string>()(token_))),
+      poll_abort_(std::make_shared<PollAbort>()) {
   generator_ = std::mt19937_64(
       std::chrono::system_clock::now().time_since_epoch().count());
+  router_.SetResponseCache(std::make_shared<ResponseCache>(
+      ResponseCache::Options{options_.response_cache_bytes}));
+  RegisterDefaultCommands();
+}
+
+CommandRouter &TelegramBot::Router() { return router_; }
+
+void TelegramBot::RegisterDefaultCommands() {
+  router_.Register("/random", [this](const CommandContext &context) {
+    context.client.SendMessage(context.message.GetChatId(),
+                               std::to_string(RandomNumberResponse()));
+  });
+  // ответы не зависят от запроса: во время наплыва не считаем их заново
+  router_.RegisterCached("/weather", [this](const CommandContext &) {
+    return WeatherNumberResponse();
+  });
+  router_.RegisterCached("/styleguide", [this](const CommandContext &) {
+    return StyleguideResponse();
+  });
+  router_.Register("/stop", [this](const CommandContext &) { Stop(); });
+  router_.Register("/crash", [this](const CommandContext &) { Crash(); });
+}
+
+PollController::Options TelegramBot::PollOptions() const {
+  PollController::Options poll = options_.poll;
+  poll.max_limit = options_.updates_limit;
+  if (poll.max_in_flight == 0) {
+    // в общем пуле места может быть больше, но занять его весь один бот
+    // не должен
+    poll.max_in_flight = options_.workers * options_.queue_capacity;
+  }
+  return poll;
 }
 
+size_t TelegramBot::InFlight() {
+  std::lock_guard<std::mutex> guard(in_flight_mutex_);
+  return in_flight_;
+}
+
+std::shared_ptr<WorkerPool> TelegramBot::Workers() const {
+  if (options_.worker_pool != nullptr) {
+    return options_.worker_pool;
+  }
+  return std::make_shared<WorkerPool>(options_.workers,
+                                      options_.queue_capacity);
+}
+
+// один Start/StartWebhook за раз; состояние прошлой остановки сбрасывается
+// здесь, иначе повторный запуск сразу бы вернулся
+class TelegramBot::Run {
+public:
+  explicit Run(TelegramBot &bot) : bot_(bot) {
+    std::lock_guard<std::mutex> guard(bot_.stop_mutex_);
+    if (bot_.running_) {
+      throw std::runtime_error("bot is already running");
+    }
+    bot_.running_ = true;
+    bot_.stop_requested_ = false;
+    bot_.abandoned_ = false;
+    bot_.poll_abort_->Reset();
+  }
+  Run(const Run &) = delete;
+  Run &operator=(const Run &) = delete;
+  ~Run() {
+    std::lock_guard<std::mutex> guard(bot_.stop_mutex_);
+    bot_.running_ = false;
+  }
+
+private:
+  TelegramBot &bot_;
+};
+
 void TelegramBot::Start() {
-  ClientTelegramBotAPI my_client_for_tg_api(token_, uri_);
-  int i = 0;
-  bool check = true;
-  while (check) {
-    check = true;
-    ++i;
-    std::vector<std::shared_ptr<AbstractCPPClass>> updates =
-        my_client_for_tg_api.GetUpdates(5);
-    for (auto update : updates) {
-      // проверка, если произошедшее событие, это приход нового сообщения
-      std::shared_ptr<NewMessage> received_message =
-          std::dynamic_pointer_cast<NewMessage>(update);
-      if (received_message != nullptr) {
-        int64_t chat_id = received_message->GetChatId();
-        if (received_message->AreCommandsInText()) {
-          for (auto &command : received_message->Commands()) {
-            if (command == "/random") {
-              my_client_for_tg_api.SendMessage(
-                  chat_id, std::to_string(RandomNumberResponse()));
-            } else if (command == "/weather") {
-              my_client_for_tg_api.SendMessage(chat_id,
-                                               WeatherNumberResponse());
-            } else if (command == "/styleguide") {
-              my_client_for_tg_api.SendMessage(chat_id, StyleguideResponse());
-            } else if (command == "/stop") {
-              Stop();
-            } else if (command == "/crash") {
-              Crash();
-            }
-          }
+  Run run(*this);
+  ClientTelegramBotAPI my_client_for_tg_api(
+      token_, uri_, MakeClientOptions(options_, poll_abort_));
+  // offset сохраняем только когда обработан весь батч (и все до него)
+  my_client_for_tg_api.SetAutoCommitOffset(false);
+  BatchCommitter committer([&my_client_for_tg_api](int64_t offset) {
+    my_client_for_tg_api.CommitOffset(offset);
+  });
+  // поллер - этот поток, обработка команд - в воркерах
+  std::shared_ptr<WorkerPool> workers = Workers();
+  Warmup(my_client_for_tg_api);
+
+  PollController poller(PollOptions());
+  int64_t last_offset = -1;
+  while (!StopRequested()) {
+    PollController::Poll poll = poller.Next(InFlight());
+    std::shared_ptr<UpdateBatch> updates;
+    try {
+      // временные ошибки уже ретраит клиент; сюда доходят исчерпанные
+      // попытки и открытый circuit breaker - ждём и поллим дальше
+      updates = my_client_for_tg_api.GetUpdateBatch(poll.timeout, poll.limit);
+    } catch (const PollAborted &) {
+      // Stop прервал long-poll, цикл сейчас завершится
+      continue;
+    } catch (const TelegramAPIError &e) {
+      if (e.http_code == 401) {
+        // воркеры могут быть общими с другими ботами - дожидаемся своих
+        // задач, пока клиент и коммиттер ещё живы
+        WaitIdle();
+        throw;
+      }
+      std::cerr << "getUpdates failed: " << e.what() << std::endl;
+      WaitForStop(std::chrono::seconds(
+          std::max(e.retry_after, kPollErrorDelaySeconds)));
+      continue;
+    } catch (const std::exception &e) {
+      std::cerr << "getUpdates failed: " << e.what() << std::endl;
+      WaitForStop(std::chrono::seconds(kPollErrorDelaySeconds));
+      continue;
+    }
+    ready_ = true;
+    poller.Observe(poll, updates->Size());
+    if (updates->NextOffset() == last_offset) {
+      continue;
+    }
+    last_offset = updates->NextOffset();
+
+    SubmitBatch(my_client_for_tg_api, *workers, updates, &committer);
+    // getUpdates с offset-ом удаляет на сервере все апдейты до него, так
+    // что следующий запрос уходит, только когда батч обработан и offset
+    // сохранён: иначе упавший бот потерял бы батч
+    WaitIdleOrStop();
+  }
+  // уже полученный батч доходит до воркеров, новых getUpdates не делаем
+  ready_ = false;
+  Drain(my_client_for_tg_api);
+}
+
+void TelegramBot::StartWebhook(const WebhookServer::Options &webhook_options,
+                               const std::string &public_url) {
+  Run run(*this);
+  ClientTelegramBotAPI my_client_for_tg_api(
+      token_, uri_, MakeClientOptions(options_, poll_abort_));
+  if (!public_url.empty()) {
+    my_client_for_tg_api.SetWebhook(public_url, webhook_options.secret_token);
+  }
+  std::shared_ptr<WorkerPool> workers = Workers();
+
+  // offset в webhook режиме не нужен: telegram считает апдейт доставленным,
+  // как только получил 200, поэтому коммиттер не используется
+  WebhookServer server(webhook_options,
+                       [&](std::shared_ptr<UpdateBatch> updates) {
+                         SubmitBatch(my_client_for_tg_api, *workers, updates,
+                                     nullptr);
+                       });
+  server.Start();
+  // setWebhook уже проверил токен, getMe только если его не было
+  if (public_url.empty()) {
+    Warmup(my_client_for_tg_api);
+  }
+  ready_ = true;
+
+  {
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    stop_cv_.wait(lock, [this] { return stop_requested_; });
+  }
+  ready_ = false;
+  // telegram уже получил 200 на всё, что в очереди: что не успеем
+  // обработать до дедлайна, в этом режиме теряется
+  server.Stop();
+  Drain(my_client_for_tg_api);
+}
+
+void TelegramBot::SubmitBatch(ClientTelegramBotAPI &client,
+                              WorkerPool &workers,
+                              const std::shared_ptr<UpdateBatch> &updates,
+                              BatchCommitter *committer) {
+  bool has_edited = router_.HasEdited();
+  std::vector<const Update *> work;
+  for (const Update &update : *updates) {
+    // проверка, если произошедшее событие, это приход нового сообщения
+    if (const NewMessage *received_message = std::get_if<NewMessage>(&update)) {
+      if (received_message->AreCommandsInText()) {
+        work.push_back(&update);
+      }
+    } else if (std::holds_alternative<EditedMessage>(update)) {
+      if (has_edited) {
+        work.push_back(&update);
+      }
+    } else {
+      // нажатие кнопки ждёт ответа, даже если ключ никто не обрабатывает
+      work.push_back(&update);
+    }
+  }
+  // окно ведём только вместе с offset-ом: в webhook режиме повторов после
+  // падения не бывает
+  bool dedup = committer != nullptr && options_.dedup_updates;
+  if (dedup) {
+    work.erase(std::remove_if(work.begin(), work.end(),
+                              [&client](const Update *update) {
+                                return client.Handled(UpdateId(*update));
+                              }),
+               work.end());
+  }
+
+  uint64_t batch = 0;
+  if (committer != nullptr) {
+    batch = committer->Begin(updates->NextOffset(), work.size());
+  }
+  for (const Update *update : work) {
+    {
+      std::lock_guard<std::mutex> guard(in_flight_mutex_);
+      ++in_flight_;
+    }
+    // батч держим в задаче, чтобы арена жила, пока апдейт обрабатывается
+    // ключ шарда смешан с токеном: один пользователь у разных ботов
+    // не должен всегда попадать в один воркер
+    int64_t shard_key = UpdateChatId(*update) ^ shard_salt_;
+    auto submitted = std::chrono::steady_clock::now();
+    workers.Submit(shard_key, [this, committer, &client, updates, batch,
+                               update, submitted, dedup] {
+      GlobalMetrics().queue_wait_us.Record(MicrosSince(submitted));
+      ScopedTrace trace(UpdateTrace(*update));
+      RecordSpan(CurrentTrace(), "queue", submitted,
+                 std::chrono::steady_clock::now());
+      // после дедлайна остановки задачи не выполняются и не коммитят offset:
+      // эти апдейты придут заново после перезапуска
+      bool abandoned = abandoned_.load();
+      if (!abandoned) {
+        if (const auto *message = std::get_if<NewMessage>(update)) {
+          HandleCommands(client, *message);
+        } else if (const auto *edited = std::get_if<EditedMessage>(update)) {
+          HandleEdited(client, *edited);
+        } else {
+          HandleCallback(client, std::get<CallbackQuery>(*update));
         }
       }
+      if (dedup && !abandoned) {
+        try {
+          client.MarkHandled(UpdateId(*update));
+        } catch (const std::exception &e) {
+          // не записали - после падения апдейт обработается ещё раз
+          std::cerr << "can't store dedup window: " << e.what() << std::endl;
+        }
+      }
+      if (committer != nullptr && !abandoned) {
+        committer->Done(batch);
+      }
+      std::lock_guard<std::mutex> guard(in_flight_mutex_);
+      if (--in_flight_ == 0) {
+        in_flight_cv_.notify_all();
+      }
+    });
+  }
+}
+
+void TelegramBot::HandleCommands(ClientTelegramBotAPI &client,
+                                 const NewMessage &message) {
+  Metrics &metrics = GlobalMetrics();
+  for (auto &command : message.Commands()) {
+    auto started = std::chrono::steady_clock::now();
+    try {
+      TraceSpan span("handler");
+      router_.Dispatch(
+          CommandContext{client, message, command, options_.chat_state.get()});
+    } catch (const std::exception &e) {
+      metrics.handler_errors.Add();
+      std::cerr << "command " << command << " failed: " << e.what()
+                << std::endl;
+    }
+    metrics.handler_us.Record(MicrosSince(started));
+  }
+}
+
+void TelegramBot::HandleEdited(ClientTelegramBotAPI &client,
+                               const EditedMessage &message) {
+  Metrics &metrics = GlobalMetrics();
+  auto started = std::chrono::steady_clock::now();
+  try {
+    TraceSpan span("handler");
+    router_.DispatchEdited(
+        CommandContext{client, message, {}, options_.chat_state.get()});
+  } catch (const std::exception &e) {
+    metrics.handler_errors.Add();
+    std::cerr << "edited message handler failed: " << e.what() << std::endl;
+  }
+  metrics.handler_us.Record(MicrosSince(started));
+}
+
+void TelegramBot::HandleCallback(ClientTelegramBotAPI &client,
+                                 const CallbackQuery &query) {
+  Metrics &metrics = GlobalMetrics();
+  auto started = std::chrono::steady_clock::now();
+  try {
+    TraceSpan span("handler");
+    if (!router_.DispatchCallback(
+            CallbackContext{client, query, {}, options_.chat_state.get()})) {
+      // кнопка от старой версии бота: гасим индикатор загрузки у
+      // пользователя, иначе он висит до таймаута
+      client.AnswerCallbackQuery(query.GetId());
     }
+  } catch (const std::exception &e) {
+    metrics.handler_errors.Add();
+    std::cerr << "callback " << query.GetData() << " failed: " << e.what()
+              << std::endl;
   }
+  metrics.handler_us.Record(MicrosSince(started));
+}
+
+void TelegramBot::WaitIdle() {
+  std::unique_lock<std::mutex> lock(in_flight_mutex_);
+  in_flight_cv_.wait(lock, [this] { return in_flight_ == 0; });
 }
 
-int64_t TelegramBot::RandomNumberResponse() { return generator_(); }
+bool TelegramBot::WaitIdle(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(in_flight_mutex_);
+  return in_flight_cv_.wait_until(lock, deadline,
+                                  [this] { return in_flight_ == 0; });
+}
+
+void TelegramBot::WaitIdleOrStop() {
+  std::unique_lock<std::mutex> lock(in_flight_mutex_);
+  in_flight_cv_.wait(lock,
+                     [this] { return in_flight_ == 0 || StopRequested(); });
+}
+
+void TelegramBot::Drain(ClientTelegramBotAPI &client) {
+  std::chrono::steady_clock::time_point deadline;
+  {
+    // дедлайн идёт от Stop, а не от выхода из поллинга
+    std::lock_guard<std::mutex> guard(stop_mutex_);
+    deadline = stop_deadline_;
+  }
+  if (!WaitIdle(deadline)) {
+    size_t left = 0;
+    {
+      std::lock_guard<std::mutex> guard(in_flight_mutex_);
+      left = in_flight_;
+    }
+    std::cerr << "shutdown timeout: dropping " << left
+              << " queued commands, they will be redelivered" << std::endl;
+    abandoned_ = true;
+    // ждём только уже выполняющиеся обработчики, их держат таймауты запросов
+    WaitIdle();
+  }
+  if (!client.Shutdown(deadline)) {
+    std::cerr << "shutdown timeout: async sends were cancelled" << std::endl;
+  }
+}
+
+bool TelegramBot::StopRequested() {
+  std::lock_guard<std::mutex> guard(stop_mutex_);
+  return stop_requested_;
+}
+
+void TelegramBot::WaitForStop(std::chrono::seconds timeout) {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  stop_cv_.wait_for(lock, timeout, [this] { return stop_requested_; });
+}
+
+int64_t TelegramBot::RandomNumberResponse() {
+  std::lock_guard<std::mutex> guard(generator_mutex_);
+  return generator_();
+}
 
 std::string TelegramBot::WeatherNumberResponse() { return "Winter Is Coming"; }
 
@@ -53,6 +558,44 @@ std::string TelegramBot::StyleguideResponse() {
   return "Here is supposed to be a code review joke";
 }
 
-void TelegramBot::Stop() { exit(0); }
+void TelegramBot::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(stop_mutex_);
+    if (!stop_requested_) {
+      stop_deadline_ =
+          std::chrono::steady_clock::now() + options_.shutdown_timeout;
+    }
+    stop_requested_ = true;
+  }
+  ready_ = false;
+  // ответа long-poll не ждём: его сокет закрывается, Start сразу выходит
+  // из цикла
+  poll_abort_->Abort();
+  stop_cv_.notify_all();
+  {
+    // поллер может ждать обработки батча (WaitIdleOrStop)
+    std::lock_guard<std::mutex> guard(in_flight_mutex_);
+  }
+  in_flight_cv_.notify_all();
+}
 
 void TelegramBot::Crash() { abort(); }
+
+bool TelegramBot::Ready() const { return ready_; }
+
+void TelegramBot::Warmup(ClientTelegramBotAPI &client) {
+  if (options_.warm_connections == 0) {
+    return;
+  }
+  try {
+    client.Warmup(options_.warm_connections);
+    ready_ = true;
+  } catch (const TelegramAPIError &e) {
+    if (e.http_code == 401) {
+      throw;
+    }
+    std::cerr << "warm-up failed: " << e.what() << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << "warm-up failed: " << e.what() << std::endl;
+  }
+}
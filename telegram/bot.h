@@ -1,12 +1,184 @@
 // #pragma once
+#include "poll_controller.h"
+#include "response_cache.h"
+#include "webhook.h"
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class BatchCommitter;
+class CallbackQuery;
+class ChatStateStore;
+class ClientTelegramBotAPI;
+class EditedMessage;
+class NewMessage;
+class PollAbort;
+class RateLimiter;
+class SessionPool;
+class Transport;
+class UpdateBatch;
+class UpdateJournal;
+class WorkerPool;
+
+struct CommandContext {
+  ClientTelegramBotAPI &client;
+  const NewMessage &message;
+  std::string_view command;
+  // команда без суффикса @botname
+  ChatStateStore *state = nullptr;
+  // состояние чатов бота (Options::chat_state), nullptr - не заведено
+};
+
+struct CallbackContext {
+  ClientTelegramBotAPI &client;
+  const CallbackQuery &query;
+  std::string_view payload;
+  // data кнопки после "<key>:"
+  ChatStateStore *state = nullptr;
+};
+
+// роутер команд: обработчики регистрируются на старте, до запуска воркеров;
+// поиск идёт по идеальному хэшу (подбираем seed без коллизий), так что
+// стоимость не зависит от числа команд - один хэш и одно сравнение строк
+// таблица перестраивается в Register, а Find только читает её и безопасен
+// из нескольких потоков
+class CommandRouter {
+public:
+  using Handler = std::function<void(const CommandContext &)>;
+
+  void Register(std::string command, Handler handler);
+  // command вида "/random"; повторная регистрация заменяет обработчик
+
+  void SetBotName(std::string bot_name);
+  // команды "/cmd@other_bot" чужим ботам игнорируются
+
+  const Handler *Find(std::string_view command) const;
+  // nullptr, если команда неизвестна или адресована другому боту
+
+  bool Dispatch(const CommandContext &context);
+
+  using Responder = std::function<std::string(const CommandContext &)>;
+
+  struct CacheOptions {
+    std::chrono::milliseconds ttl = std::chrono::seconds(60);
+    bool per_chat = false;
+    // ключ - команда и chat_id (ответ зависит от настроек чата), иначе
+    // один ответ на всех
+  };
+
+  void RegisterCached(std::string command, Responder responder);
+  void RegisterCached(std::string command, Responder responder,
+                      CacheOptions options);
+  // обработчик, который только вычисляет текст ответа: текст кэшируется
+  // (ResponseCache) и отправляется в чат команды
+
+  void SetResponseCache(std::shared_ptr<ResponseCache> cache);
+  ResponseCache &Cache();
+  // по умолчанию у роутера свой кэш с ResponseCache::Options по умолчанию
+
+  using CallbackHandler = std::function<void(const CallbackContext &)>;
+
+  void RegisterCallback(std::string key, CallbackHandler handler);
+  // нажатия кнопок с callback_data "key" или "key:payload"
+
+  bool DispatchCallback(const CallbackContext &context);
+  // ключ и payload берутся из data нажатия, payload в context игнорируется;
+  // false - ключ не зарегистрирован
+
+  void RegisterEdited(Handler handler);
+  bool HasEdited() const;
+  bool DispatchEdited(const CommandContext &context);
+  // исправленные сообщения (EditedMessage), command пустой; без обработчика
+  // они не доходят до воркеров
+
+private:
+  void Build();
+  // подобрать seed и заполнить table_ по entries_
+
+  static uint64_t Hash(std::string_view command, uint64_t seed);
+  std::string_view Normalize(std::string_view command) const;
+  // отрезать @botname или вернуть пустую строку, если бот не наш
+
+  struct Entry {
+    std::string command;
+    Handler handler;
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<int32_t> table_;
+  // индекс в entries_ или -1
+  uint64_t seed_ = 0;
+  uint64_t mask_ = 0;
+  std::string bot_name_;
+  std::map<std::string, CallbackHandler, std::less<>> callbacks_;
+  // ключей кнопок немного, поиск по string_view без аллокаций
+  Handler edited_;
+  std::shared_ptr<ResponseCache> cache_ = std::make_shared<ResponseCache>();
+};
 
 class TelegramBot {
 public:
+  struct Options {
+    size_t workers = 4;
+    // потоки-обработчики, сообщения одного чата всегда в одном потоке
+    size_t queue_capacity = 1024;
+    // размер очереди на воркер, при заполнении поллер ждёт
+    std::shared_ptr<SessionPool> session_pool;
+    std::shared_ptr<WorkerPool> worker_pool;
+    // общие для нескольких ботов в одном процессе; nullptr - свои
+    std::shared_ptr<Transport> transport;
+    // nullptr - http через session_pool (ClientTelegramBotAPI::Options)
+    std::shared_ptr<RateLimiter> rate_limiter;
+    // nullptr - лимиты telegram по умолчанию
+    std::string offset_file_name = "offset.txt";
+    size_t updates_limit = 100;
+    size_t batch_bytes = size_t(4) << 20;
+    // limit getUpdates и бюджет памяти батча (ClientTelegramBotAPI::Options)
+    std::shared_ptr<UpdateJournal> journal;
+    // журнал getUpdates для bot-run replay (ClientTelegramBotAPI::Options)
+    PollController::Options poll;
+    // timeout и limit getUpdates по нагрузке; max_limit берётся из
+    // updates_limit, max_in_flight == 0 - workers * queue_capacity
+    bool dedup_updates = true;
+    // не обрабатывать повторно апдейты, которые успели обработать до падения
+    // (ClientTelegramBotAPI::MarkHandled): окно пишется в файл offset-а с
+    // каждым батчем и не чаще раза в flush_interval внутри долгого батча
+    std::shared_ptr<ChatStateStore> chat_state;
+    // состояние диалогов для обработчиков (CommandContext::state)
+    std::chrono::seconds shutdown_timeout = std::chrono::seconds(10);
+    // сколько Stop ждёт обработки уже полученных апдейтов и отправки ответов,
+    // считая от вызова Stop; текущий long-poll Stop прерывает сразу
+    size_t response_cache_bytes = size_t(4) << 20;
+    // память под ответы CommandRouter::RegisterCached
+    size_t warm_connections = 2;
+    // соединений, которые Start открывает заранее (ClientTelegramBotAPI::
+    // Warmup); 0 - без прогрева, готовность после первого getUpdates
+  };
+
   TelegramBot(const std::string &token, const std::string &uri);
+  TelegramBot(const std::string &token, const std::string &uri,
+              Options options);
 
   void Start();
+  // long-poll getUpdates в этом потоке; после Stop бота можно запустить
+  // снова, параллельный второй запуск бросает std::runtime_error
+
+  void StartWebhook(const WebhookServer::Options &webhook_options,
+                    const std::string &public_url = "");
+  // принимать апдейты через webhook; если задан public_url, бот сам
+  // регистрирует его через setWebhook
+
+  CommandRouter &Router();
+  // сюда можно добавлять свои команды до Start()
 
   int64_t RandomNumberResponse();
   // слуайное число, ну что, наконец-то ещё где-то заюзаю chrono.time?)
@@ -18,14 +190,71 @@ public:
   // шутка про код ревью в ответ
 
   void Stop();
-  // штатно завершить работу бота (нормально)
+  // штатно завершить работу бота: можно звать из любого потока (обработчик
+  // команды, сигнал); Start перестаёт поллить, дообрабатывает полученное
+  // в пределах shutdown_timeout, сохраняет offset и возвращается
 
   void Crash();
   // аварийно завершить работу бота (выключили свет) - abort()
 
+  bool Ready() const;
+  // прогрев прошёл (или getUpdates уже ответил) и бот не останавливается;
+  // для readiness проб в BotHost
+
 private:
+  static constexpr int kPollErrorDelaySeconds = 1;
+
+  class Run;
+  // время жизни одного Start/StartWebhook
+
+  void RegisterDefaultCommands();
+  void HandleCommands(ClientTelegramBotAPI &client, const NewMessage &message);
+  void HandleEdited(ClientTelegramBotAPI &client, const EditedMessage &message);
+  void HandleCallback(ClientTelegramBotAPI &client, const CallbackQuery &query);
+  // обработка апдейта в воркере, исключения обработчиков ловятся и считаются
+  void Warmup(ClientTelegramBotAPI &client);
+  // ошибки прогрева кроме 401 только логируем: поллинг их переживёт
+  void SubmitBatch(ClientTelegramBotAPI &client, WorkerPool &workers,
+                   const std::shared_ptr<UpdateBatch> &updates,
+                   BatchCommitter *committer);
+  // раздать команды батча воркерам; committer == nullptr - offset не ведём
+  void WaitIdle();
+  bool WaitIdle(std::chrono::steady_clock::time_point deadline);
+  // дождаться задач этого бота в (возможно общем) пуле воркеров
+  void WaitIdleOrStop();
+  // то же, но Stop прерывает ожидание
+  void Drain(ClientTelegramBotAPI &client);
+  // остановка: дообработать очередь и отправки до дедлайна
+  bool StopRequested();
+  void WaitForStop(std::chrono::seconds timeout);
+  // пауза между ошибками, прерываемая Stop
+  std::shared_ptr<WorkerPool> Workers() const;
+  // общий пул из Options или свой на время Start
+  PollController::Options PollOptions() const;
+  size_t InFlight();
+  // задачи этого бота, ещё не завершённые воркерами
+
+  CommandRouter router_;
+  Options options_;
+  std::mutex generator_mutex_;
   std::mt19937_64 generator_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_requested_ = false;
+  bool running_ = false;
+  // под stop_mutex_, сбрасываются в начале каждого запуска (Run)
+  std::chrono::steady_clock::time_point stop_deadline_;
+  // под stop_mutex_: первый Stop + shutdown_timeout, общий дедлайн Drain
   const std::string token_;
   const std::string uri_;
+  const int64_t shard_salt_;
+  std::shared_ptr<PollAbort> poll_abort_;
+  // Stop прерывает им getUpdates клиента текущего запуска
+  std::mutex in_flight_mutex_;
+  std::condition_variable in_flight_cv_;
+  size_t in_flight_ = 0;
+  std::atomic<bool> abandoned_{false};
+  // Drain не дождался задач; сбрасывается в начале запуска
+  std::atomic<bool> ready_{false};
   std::string offset_file_name_;
 };
@@ -0,0 +1,175 @@
+#include "bot_host.h"
+#include "bot.h"
+#include "chat_state.h"
+#include "client.h"
+#include "status_server.h"
+#include "tracing.h"
+#include "update_journal.h"
+#include "worker_pool.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <Poco/Exception.h>
+#include <Poco/JSON/Array.h>
+#include <Poco/JSON/Object.h>
+#include <Poco/JSON/Parser.h>
+
+BotHostConfig BotHostConfig::Load(const std::string &file_name) {
+  std::ifstream input(file_name);
+  if (!input) {
+    throw std::runtime_error("can't open bot config " + file_name);
+  }
+
+  BotHostConfig config;
+  try {
+    Poco::JSON::Parser parser;
+    auto root = parser.parse(input).extract<Poco::JSON::Object::Ptr>();
+    config.api_uri = root->optValue<std::string>("api_uri", config.api_uri);
+    config.offset_dir =
+        root->optValue<std::string>("offset_dir", config.offset_dir);
+    config.workers = root->optValue<size_t>("workers", config.workers);
+    config.queue_capacity =
+        root->optValue<size_t>("queue_capacity", config.queue_capacity);
+    config.metrics_port =
+        root->optValue<uint16_t>("metrics_port", config.metrics_port);
+    config.chat_state_mb =
+        root->optValue<size_t>("chat_state_mb", config.chat_state_mb);
+    config.trace_sample_rate = root->optValue<double>(
+        "trace_sample_rate", config.trace_sample_rate);
+    config.journal_dir =
+        root->optValue<std::string>("journal_dir", config.journal_dir);
+
+    Poco::JSON::Array::Ptr bots = root->getArray("bots");
+    if (bots.isNull()) {
+      throw std::runtime_error("no \"bots\" in bot config " + file_name);
+    }
+    for (size_t idx = 0; idx < bots->size(); ++idx) {
+      Poco::JSON::Object::Ptr bot = bots->getObject(idx);
+      if (bot.isNull() || !bot->has("token")) {
+        throw std::runtime_error("bot #" + std::to_string(idx) +
+                                 " has no token in " + file_name);
+      }
+      config.bots.push_back(
+          Bot{bot->getValue<std::string>("token"),
+              bot->optValue<std::string>("api_uri", std::string())});
+    }
+  } catch (const Poco::Exception &e) {
+    throw std::runtime_error("bad bot config " + file_name + ": " +
+                             e.displayText());
+  }
+  return config;
+}
+
+BotHost::BotHost(BotHostConfig config)
+    : config_(std::move(config)),
+      session_pool_(std::make_shared<SessionPool>()),
+      worker_pool_(std::make_shared<WorkerPool>(config_.workers,
+                                                config_.queue_capacity)) {
+  if (!config_.offset_dir.empty()) {
+    std::filesystem::create_directories(config_.offset_dir);
+  }
+  SetTraceSampleRate(config_.trace_sample_rate);
+  for (const auto &bot : config_.bots) {
+    TelegramBot::Options options;
+    options.session_pool = session_pool_;
+    options.worker_pool = worker_pool_;
+    options.offset_file_name =
+        ClientTelegramBotAPI::OffsetFileName(config_.offset_dir, bot.token);
+    if (config_.chat_state_mb != 0) {
+      ChatStateStore::Options state_options;
+      state_options.max_bytes = config_.chat_state_mb << 20;
+      state_options.snapshot_file =
+          std::filesystem::path(options.offset_file_name)
+              .replace_extension(".state")
+              .string();
+      options.chat_state = std::make_shared<ChatStateStore>(state_options);
+    }
+    if (!config_.journal_dir.empty()) {
+      UpdateJournal::Options journal_options;
+      journal_options.directory =
+          std::filesystem::path(ClientTelegramBotAPI::OffsetFileName(
+                                    config_.journal_dir, bot.token))
+              .replace_extension()
+              .string();
+      options.journal = std::make_shared<UpdateJournal>(journal_options);
+    }
+    const std::string &uri =
+        bot.api_uri.empty() ? config_.api_uri : bot.api_uri;
+    bots_.push_back(std::make_unique<TelegramBot>(bot.token, uri, options));
+  }
+  if (config_.metrics_port != 0) {
+    StatusServer::Options status_options;
+    status_options.port = config_.metrics_port;
+    status_server_ = std::make_unique<StatusServer>(status_options);
+    // liveness: процесс отвечает; readiness: все боты прогреты и поллят
+    status_server_->Route("/healthz", [] {
+      StatusServer::Reply reply;
+      reply.body = "ok\n";
+      return reply;
+    });
+    status_server_->Route("/ready", [this] {
+      StatusServer::Reply reply;
+      for (size_t idx = 0; idx < bots_.size(); ++idx) {
+        if (!bots_[idx]->Ready()) {
+          reply.status = 503;
+          reply.body += "bot #" + std::to_string(idx) + " is not ready\n";
+        }
+      }
+      if (reply.status == 200) {
+        reply.body = "ready\n";
+      }
+      return reply;
+    });
+    status_server_->Route("/trace", [] {
+      StatusServer::Reply reply;
+      reply.content_type = "application/json";
+      std::ostringstream out;
+      WriteChromeTrace(out);
+      reply.body = out.str();
+      return reply;
+    });
+  }
+}
+
+BotHost::~BotHost() = default;
+
+TelegramBot &BotHost::Bot(size_t idx) { return *bots_.at(idx); }
+
+size_t BotHost::Size() const { return bots_.size(); }
+
+void BotHost::Run() {
+  if (status_server_ != nullptr) {
+    status_server_->Start();
+  }
+  std::vector<std::thread> pollers;
+  pollers.reserve(bots_.size());
+  for (size_t idx = 0; idx < bots_.size(); ++idx) {
+    pollers.emplace_back([this, idx] {
+      // ошибка одного бота (например, отозванный токен) не роняет остальных
+      try {
+        bots_[idx]->Start();
+      } catch (const std::exception &e) {
+        std::cerr << "bot #" << idx << " stopped: " << e.what() << std::endl;
+      }
+    });
+  }
+  for (auto &poller : pollers) {
+    poller.join();
+  }
+  worker_pool_->Stop();
+  session_pool_->Clear();
+  if (status_server_ != nullptr) {
+    status_server_->Stop();
+  }
+}
+
+void BotHost::Stop() {
+  for (auto &bot : bots_) {
+    bot->Stop();
+  }
+}
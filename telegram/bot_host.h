@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SessionPool;
+class StatusServer;
+class TelegramBot;
+class WorkerPool;
+
+// описание ботов процесса, читается из json:
+// {"api_uri": "https://api.telegram.org/", "offset_dir": "offsets",
+//  "workers": 8, "queue_capacity": 1024, "metrics_port": 9100,
+//  "chat_state_mb": 64, "trace_sample_rate": 0.001, "journal_dir": "journal",
+//  "bots": [{"token": "123:abc"}, {"token": "456:def", "api_uri": "..."}]}
+struct BotHostConfig {
+  struct Bot {
+    std::string token;
+    std::string api_uri;
+    // пустой - общий api_uri
+  };
+
+  std::string api_uri = "https://api.telegram.org/";
+  std::string offset_dir = "offsets";
+  // offset каждого бота лежит в своём файле "<offset_dir>/<bot id>.offset"
+  size_t workers = 8;
+  size_t queue_capacity = 1024;
+  uint16_t metrics_port = 0;
+  // порт StatusServer с /metrics, /healthz, /ready и /trace, 0 - не
+  // поднимать
+  size_t chat_state_mb = 0;
+  // лимит ChatStateStore каждого бота, снапшот рядом с offset
+  // ("<offset_dir>/<bot id>.state"); 0 - без состояния
+  double trace_sample_rate = 0;
+  // доля апдейтов с трассировкой, спаны отдаёт /trace на metrics_port
+  std::string journal_dir;
+  // журнал апдейтов каждого бота в "<journal_dir>/<bot id>/" для
+  // bot-run replay; пусто - не писать
+  std::vector<Bot> bots;
+
+  static BotHostConfig Load(const std::string &file_name);
+  // бросает std::runtime_error, если файла нет или он некорректный
+};
+
+// много ботов в одном процессе: у каждого свой поток long-poll и свой offset,
+// а пул соединений и воркеры общие, так что N ботов не держат N наборов
+// простаивающих потоков и сокетов
+class BotHost {
+public:
+  explicit BotHost(BotHostConfig config);
+  BotHost(const BotHost &) = delete;
+  BotHost &operator=(const BotHost &) = delete;
+  ~BotHost();
+
+  TelegramBot &Bot(size_t idx);
+  size_t Size() const;
+  // боты доступны до Run, например чтобы добавить свои команды
+
+  void Run();
+  // запустить всех ботов и ждать, пока они не завершатся
+
+  void Stop();
+  // штатно остановить всех ботов, Run вернётся после их дренажа
+
+private:
+  const BotHostConfig config_;
+  std::shared_ptr<SessionPool> session_pool_;
+  std::shared_ptr<WorkerPool> worker_pool_;
+  std::vector<std::unique_ptr<TelegramBot>> bots_;
+  std::unique_ptr<StatusServer> status_server_;
+};
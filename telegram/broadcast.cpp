@@ -0,0 +1,172 @@
+#include "broadcast.h"
+#include "client.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+BroadcastTracker::BroadcastTracker(const std::vector<int64_t> &chat_ids,
+                                   const BroadcastOptions &options)
+    : chat_ids_(chat_ids) {
+  if (!options.cursor_file.empty()) {
+    OffsetStorage::Options storage_options;
+    storage_options.write_behind = true;
+    cursor_storage_ = std::make_unique<OffsetStorage>(options.cursor_file,
+                                                      storage_options);
+    int64_t cursor = cursor_storage_->Load();
+    start_ = std::min(static_cast<size_t>(std::max<int64_t>(cursor, 0)),
+                      chat_ids.size());
+  }
+  stored_cursor_ = start_;
+  report_.cursor = start_;
+  report_.statuses.assign(chat_ids.size(), DeliveryStatus::kPending);
+  std::fill(report_.statuses.begin(), report_.statuses.begin() + start_,
+            DeliveryStatus::kSkipped);
+  report_.skipped = start_;
+  outstanding_ = chat_ids.size() - start_;
+}
+
+void BroadcastTracker::Finish(size_t index, std::exception_ptr error) {
+  if (!error) {
+    Settle(index, DeliveryStatus::kSent);
+    return;
+  }
+  BroadcastReport::Failure failure;
+  failure.index = index;
+  failure.chat_id = chat_ids_[index];
+  try {
+    std::rethrow_exception(error);
+  } catch (const SendQueueStopped &) {
+    // не ошибка получателя: рассылку прервали, он остаётся за курсором
+    Abort(index);
+    return;
+  } catch (const TelegramAPIError &api_error) {
+    failure.http_code = api_error.http_code;
+    failure.description = api_error.details;
+  } catch (const std::exception &other) {
+    failure.description = other.what();
+  } catch (...) {
+    failure.description = "unknown error";
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    report_.failures.push_back(std::move(failure));
+  }
+  Settle(index, DeliveryStatus::kFailed);
+}
+
+void BroadcastTracker::Abort(size_t index) {
+  Settle(index, DeliveryStatus::kPending);
+}
+
+void BroadcastTracker::Settle(size_t index, DeliveryStatus status) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  report_.statuses[index] = status;
+  if (status == DeliveryStatus::kSent) {
+    ++report_.sent;
+  } else if (status == DeliveryStatus::kFailed) {
+    ++report_.failed;
+  } else {
+    ++report_.pending;
+  }
+  // прерванные получатели остаются kPending, так что курсор на них и встанет
+  while (report_.cursor < report_.statuses.size() &&
+         report_.statuses[report_.cursor] != DeliveryStatus::kPending) {
+    ++report_.cursor;
+  }
+  if (cursor_storage_ && report_.cursor >= stored_cursor_ + kCursorStep) {
+    stored_cursor_ = report_.cursor;
+    cursor_storage_->Store(static_cast<int64_t>(stored_cursor_));
+  }
+  if (--outstanding_ == 0) {
+    done_.notify_all();
+  }
+}
+
+BroadcastReport BroadcastTracker::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return outstanding_ == 0; });
+  if (cursor_storage_ && report_.cursor != stored_cursor_) {
+    stored_cursor_ = report_.cursor;
+    cursor_storage_->Store(static_cast<int64_t>(stored_cursor_));
+  }
+  if (cursor_storage_) {
+    cursor_storage_->Flush();
+  }
+  std::sort(report_.failures.begin(), report_.failures.end(),
+            [](const auto &lhs, const auto &rhs) {
+              return lhs.index < rhs.index;
+            });
+  return report_;
+}
+
+FileIdCache::FileIdCache(std::string file_name)
+    : file_name_(std::move(file_name)) {
+  if (file_name_.empty()) {
+    return;
+  }
+  std::ifstream input(file_name_);
+  std::string line;
+  while (std::getline(input, line)) {
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos || tab == 0) {
+      continue;
+    }
+    // более поздняя строка для того же ключа перекрывает раннюю
+    ids_[line.substr(tab + 1)] = line.substr(0, tab);
+  }
+}
+
+std::string FileIdCache::Acquire(const std::string &key) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  uploaded_.wait(lock, [&] { return uploading_.count(key) == 0; });
+  auto found = ids_.find(key);
+  if (found != ids_.end()) {
+    return found->second;
+  }
+  uploading_.insert(key);
+  return {};
+}
+
+void FileIdCache::Store(const std::string &key, const std::string &file_id) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uploading_.erase(key);
+    if (!file_id.empty()) {
+      ids_[key] = file_id;
+      if (!file_name_.empty()) {
+        std::ofstream output(file_name_, std::ios::app);
+        output << file_id << '\t' << key << '\n';
+      }
+    }
+  }
+  uploaded_.notify_all();
+}
+
+void FileIdCache::Abandon(const std::string &key) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uploading_.erase(key);
+  }
+  uploaded_.notify_all();
+}
+
+size_t FileIdCache::Size() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return ids_.size();
+}
+
+std::string FileIdCache::KeyForFile(const std::string &path) {
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(path, error)) {
+    return {};
+  }
+  auto size = std::filesystem::file_size(path, error);
+  auto modified = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return {};
+  }
+  return std::to_string(size) + ':' +
+         std::to_string(modified.time_since_epoch().count()) + ':' + path;
+}
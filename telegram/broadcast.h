@@ -0,0 +1,123 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "offset_storage.h"
+
+// одно и то же сообщение на много чатов (рассылки, объявления)
+struct BroadcastPayload {
+  std::string text;
+  // текст сообщения, а при photo - подпись к нему
+  std::string photo;
+  // путь к локальному файлу, file_id или url; пусто - обычный текст
+};
+
+struct BroadcastOptions {
+  std::string cursor_file;
+  // курсор рассылки: все получатели до него уже обработаны; при повторном
+  // запуске с тем же файлом рассылка продолжается с курсора
+  // пусто - без возобновления
+};
+
+enum class DeliveryStatus : uint8_t { kPending, kSent, kFailed, kSkipped };
+// kPending - не дошли (рассылку прервали), kSkipped - отправлены в прошлом
+// запуске, до курсора
+
+struct BroadcastReport {
+  struct Failure {
+    size_t index = 0;
+    int64_t chat_id = 0;
+    int http_code = 0;
+    // 0 - сетевая или другая ошибка без ответа API
+    std::string description;
+  };
+
+  std::vector<DeliveryStatus> statuses;
+  // по байту на получателя, в порядке chat_ids
+  std::vector<Failure> failures;
+  size_t sent = 0;
+  size_t failed = 0;
+  size_t skipped = 0;
+  size_t pending = 0;
+  size_t cursor = 0;
+
+  bool Complete() const { return pending == 0; }
+};
+
+// учёт одной рассылки: статусы получателей и курсор
+// ответы приходят не по порядку, поэтому курсор - это начало самого раннего
+// ещё не завершённого получателя; после падения процесса получатели между
+// курсором и последним ответом получат сообщение повторно (at-least-once)
+class BroadcastTracker {
+public:
+  BroadcastTracker(const std::vector<int64_t> &chat_ids,
+                   const BroadcastOptions &options);
+  BroadcastTracker(const BroadcastTracker &) = delete;
+  BroadcastTracker &operator=(const BroadcastTracker &) = delete;
+
+  size_t Cursor() const { return start_; }
+  // с кого начинать отправку
+
+  void Finish(size_t index, std::exception_ptr error);
+  // результат отправки получателю index (error == nullptr - доставлено)
+  void Abort(size_t index);
+  // получателю index отправка не ставилась (очередь остановлена)
+
+  BroadcastReport Wait();
+  // дождаться всех поставленных получателей и сохранить курсор
+
+private:
+  static constexpr size_t kCursorStep = 64;
+  // курсор пишется не чаще, чем раз в kCursorStep получателей
+
+  void Settle(size_t index, DeliveryStatus status);
+
+  const std::vector<int64_t> &chat_ids_;
+  std::unique_ptr<OffsetStorage> cursor_storage_;
+  size_t start_ = 0;
+  size_t stored_cursor_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable done_;
+  BroadcastReport report_;
+  size_t outstanding_ = 0;
+};
+
+// file_id загруженных файлов: telegram возвращает его в ответе на загрузку,
+// и дальше тот же файл отправляется по id без повторной загрузки
+// ключ - путь, размер и время изменения (KeyForFile), так что изменённый
+// файл загрузится заново; file_id действителен только для загрузившего бота
+// пока один поток загружает файл, остальные с тем же ключом ждут его
+class FileIdCache {
+public:
+  explicit FileIdCache(std::string file_name = "");
+  // file_name - куда дописываются строки "file_id\tключ" (пусто - только
+  // в памяти); при создании кэш читается из него
+
+  std::string Acquire(const std::string &key);
+  // file_id по ключу; пустая строка - загружать должен вызвавший, после
+  // чего он обязан позвать Store или Abandon
+  void Store(const std::string &key, const std::string &file_id);
+  void Abandon(const std::string &key);
+  // загрузка не удалась, следующий Acquire попробует сам
+
+  size_t Size() const;
+
+  static std::string KeyForFile(const std::string &path);
+  // пустая строка, если такого файла нет (тогда это file_id или url)
+
+private:
+  const std::string file_name_;
+  mutable std::mutex mutex_;
+  std::condition_variable uploaded_;
+  std::unordered_map<std::string, std::string> ids_;
+  std::unordered_set<std::string> uploading_;
+};
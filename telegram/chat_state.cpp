@@ -0,0 +1,334 @@
+#include "chat_state.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// формат снапшота, little-endian как в памяти:
+// "TGCS" | uint32 версия | uint64 число чатов |
+// (int64 chat_id | uint32 длина | байты) * n | uint64 FNV-1a всего до него
+// чаты каждого шарда идут от давних к свежим, так что загрузка по порядку
+// восстанавливает LRU
+constexpr char kMagic[4] = {'T', 'G', 'C', 'S'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = 4 + 4 + 8;
+
+uint64_t Fnv1a(uint64_t hash, const void *data, size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t idx = 0; idx < size; ++idx) {
+    hash ^= bytes[idx];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+constexpr uint64_t kFnvBasis = 14695981039346656037ull;
+
+template <class T> void Append(std::string &out, T value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <class T> T Read(const char *data) {
+  T value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+[[noreturn]] void ThrowWriteError(const std::string &file_name) {
+  throw std::runtime_error("can't write chat state to " + file_name + ": " +
+                           strerror(errno));
+}
+
+} // namespace
+
+ChatStateStore::ChatStateStore(Options options)
+    : options_(std::move(options)),
+      shard_bytes_(options_.max_bytes / std::max<size_t>(options_.shards, 1)) {
+  size_t shards = std::max<size_t>(options_.shards, 1);
+  for (size_t idx = 0; idx < shards; ++idx) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+  if (!options_.snapshot_file.empty()) {
+    Load();
+    snapshot_version_ = version_.load();
+    if (options_.snapshot_interval.count() > 0) {
+      snapshotter_ = std::thread([this] { SnapshotLoop(); });
+    }
+  }
+}
+
+ChatStateStore::~ChatStateStore() {
+  if (snapshotter_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(stop_mutex_);
+      stop_ = true;
+    }
+    stop_cv_.notify_all();
+    snapshotter_.join();
+  }
+  if (!options_.snapshot_file.empty()) {
+    try {
+      SnapshotIfDirty();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+}
+
+ChatStateStore::Shard &ChatStateStore::ShardFor(int64_t chat_id) {
+  // соседние chat_id не должны попадать в соседние шарды пачками
+  uint64_t hash = static_cast<uint64_t>(chat_id) * 0x9E3779B97F4A7C15ull;
+  return *shards_[(hash >> 32) % shards_.size()];
+}
+
+void ChatStateStore::Touch(Shard &shard, std::list<Entry>::iterator it) {
+  shard.lru.splice(shard.lru.begin(), shard.lru, it);
+}
+
+void ChatStateStore::Insert(Shard &shard, int64_t chat_id, std::string state) {
+  auto found = shard.index.find(chat_id);
+  if (found != shard.index.end()) {
+    shard.bytes -= found->second->state.size();
+    shard.bytes += state.size();
+    found->second->state = std::move(state);
+    Touch(shard, found->second);
+  } else {
+    shard.bytes += state.size() + kEntryOverhead;
+    shard.lru.push_front(Entry{chat_id, std::move(state)});
+    shard.index.emplace(chat_id, shard.lru.begin());
+  }
+  Evict(shard);
+}
+
+void ChatStateStore::Evict(Shard &shard) {
+  // самый свежий чат не вытесняем, даже если он один больше лимита шарда
+  while (shard.bytes > shard_bytes_ && shard.lru.size() > 1) {
+    Entry &victim = shard.lru.back();
+    shard.bytes -= victim.state.size() + kEntryOverhead;
+    shard.index.erase(victim.chat_id);
+    shard.lru.pop_back();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+std::optional<std::string> ChatStateStore::Get(int64_t chat_id) {
+  Shard &shard = ShardFor(chat_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto found = shard.index.find(chat_id);
+  if (found == shard.index.end()) {
+    return std::nullopt;
+  }
+  Touch(shard, found->second);
+  return found->second->state;
+}
+
+void ChatStateStore::Put(int64_t chat_id, std::string state) {
+  Shard &shard = ShardFor(chat_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  Insert(shard, chat_id, std::move(state));
+  version_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool ChatStateStore::Erase(int64_t chat_id) {
+  Shard &shard = ShardFor(chat_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto found = shard.index.find(chat_id);
+  if (found == shard.index.end()) {
+    return false;
+  }
+  shard.bytes -= found->second->state.size() + kEntryOverhead;
+  shard.lru.erase(found->second);
+  shard.index.erase(found);
+  version_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ChatStateStore::Update(
+    int64_t chat_id, const std::function<void(std::string &state)> &update) {
+  Shard &shard = ShardFor(chat_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto found = shard.index.find(chat_id);
+  if (found == shard.index.end()) {
+    std::string state;
+    update(state);
+    Insert(shard, chat_id, std::move(state));
+  } else {
+    // меняем копию: если update бросит, состояние и счётчик байт шарда
+    // остаются прежними
+    std::string state = found->second->state;
+    update(state);
+    shard.bytes -= found->second->state.size();
+    shard.bytes += state.size();
+    found->second->state = std::move(state);
+    Touch(shard, found->second);
+    Evict(shard);
+  }
+  version_.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t ChatStateStore::Size() const {
+  size_t size = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    size += shard->lru.size();
+  }
+  return size;
+}
+
+size_t ChatStateStore::Bytes() const {
+  size_t bytes = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    bytes += shard->bytes;
+  }
+  return bytes;
+}
+
+void ChatStateStore::Snapshot() {
+  std::lock_guard<std::mutex> snapshot_guard(snapshot_mutex_);
+  uint64_t version = version_.load();
+  const std::string &file_name = options_.snapshot_file;
+  std::string tmp_name = file_name + ".tmp";
+  int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ThrowWriteError(tmp_name);
+  }
+  bool ok = true;
+  auto write = [&](const std::string &data) {
+    ok = ok && ::write(fd, data.data(), data.size()) ==
+                   static_cast<ssize_t>(data.size());
+  };
+
+  // число чатов станет известно в конце, его допишем в заголовок по месту
+  std::string header(kMagic, sizeof(kMagic));
+  Append(header, kVersion);
+  Append(header, uint64_t(0));
+  write(header);
+
+  // шард копируется в буфер под своим мьютексом, а пишется уже без него,
+  // так что обработчики ждут только копирования, а не диска
+  uint64_t hash = kFnvBasis;
+  uint64_t count = 0;
+  std::string buffer;
+  for (const auto &shard : shards_) {
+    buffer.clear();
+    {
+      std::lock_guard<std::mutex> guard(shard->mutex);
+      for (auto it = shard->lru.rbegin(); it != shard->lru.rend(); ++it) {
+        Append(buffer, it->chat_id);
+        Append(buffer, static_cast<uint32_t>(it->state.size()));
+        buffer += it->state;
+      }
+      count += shard->lru.size();
+    }
+    hash = Fnv1a(hash, buffer.data(), buffer.size());
+    write(buffer);
+  }
+  buffer.clear();
+  Append(buffer, hash);
+  write(buffer);
+
+  std::string count_bytes;
+  Append(count_bytes, count);
+  ok = ok && ::pwrite(fd, count_bytes.data(), count_bytes.size(),
+                      kHeaderSize - count_bytes.size()) ==
+                 static_cast<ssize_t>(count_bytes.size());
+  ok = ok && ::fsync(fd) == 0;
+  ::close(fd);
+  if (!ok || std::rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+    ThrowWriteError(file_name);
+  }
+  snapshot_version_ = version;
+}
+
+size_t ChatStateStore::Load() {
+  const std::string &file_name = options_.snapshot_file;
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat info;
+  if (::fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < kHeaderSize + sizeof(uint64_t)) {
+    ::close(fd);
+    return 0;
+  }
+  size_t size = static_cast<size_t>(info.st_size);
+  void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    return 0;
+  }
+  ::madvise(mapped, size, MADV_SEQUENTIAL);
+
+  const char *data = static_cast<const char *>(mapped);
+  const char *end = data + size - sizeof(uint64_t);
+  const char *body = data + kHeaderSize;
+  size_t loaded = 0;
+  bool valid = std::memcmp(data, kMagic, sizeof(kMagic)) == 0 &&
+               Read<uint32_t>(data + 4) == kVersion &&
+               Fnv1a(kFnvBasis, body, end - body) == Read<uint64_t>(end);
+  if (valid) {
+    uint64_t count = Read<uint64_t>(data + 8);
+    const char *pos = body;
+    constexpr size_t kEntryHeader = sizeof(int64_t) + sizeof(uint32_t);
+    for (uint64_t idx = 0; idx < count; ++idx) {
+      if (static_cast<size_t>(end - pos) < kEntryHeader) {
+        break;
+      }
+      int64_t chat_id = Read<int64_t>(pos);
+      uint32_t length = Read<uint32_t>(pos + sizeof(int64_t));
+      pos += kEntryHeader;
+      if (static_cast<size_t>(end - pos) < length) {
+        break;
+      }
+      Shard &shard = ShardFor(chat_id);
+      std::lock_guard<std::mutex> guard(shard.mutex);
+      Insert(shard, chat_id, std::string(pos, length));
+      pos += length;
+      ++loaded;
+    }
+  } else {
+    std::cerr << "chat state snapshot " << file_name
+              << " is corrupted, starting empty" << std::endl;
+  }
+  ::munmap(mapped, size);
+  return loaded;
+}
+
+void ChatStateStore::SnapshotIfDirty() {
+  {
+    std::lock_guard<std::mutex> guard(snapshot_mutex_);
+    if (version_.load() == snapshot_version_) {
+      return;
+    }
+  }
+  Snapshot();
+}
+
+void ChatStateStore::SnapshotLoop() {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  while (!stop_) {
+    stop_cv_.wait_for(lock, options_.snapshot_interval);
+    if (stop_) {
+      break;
+    }
+    lock.unlock();
+    try {
+      SnapshotIfDirty();
+    } catch (const std::exception &e) {
+      // попробуем на следующем тике
+      std::cerr << e.what() << std::endl;
+    }
+    lock.lock();
+  }
+}
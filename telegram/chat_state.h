@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// состояние диалога по chat_id для обработчиков команд: значение - байты,
+// формат которых выбирает сам обработчик
+// чаты разложены по шардам со своим мьютексом (lock striping), в каждом шарде
+// LRU: при превышении max_bytes вытесняются давно не трогавшиеся чаты
+// снапшот - компактный бинарный файл (пишется во временный и переименовывается
+// поверх, как offset), при старте он отображается в память (mmap) и
+// разбирается за один проход, так что бот сразу работает с тёплым кэшем
+class ChatStateStore {
+public:
+  struct Options {
+    size_t max_bytes = size_t(64) << 20;
+    // значения плюс kEntryOverhead на чат, делится поровну между шардами
+    size_t shards = 16;
+    std::string snapshot_file;
+    // пусто - только в памяти
+    std::chrono::milliseconds snapshot_interval = std::chrono::seconds(30);
+    // как часто фоновый поток пишет снапшот, если что-то менялось;
+    // 0 - только по Snapshot() и в деструкторе
+  };
+
+  ChatStateStore() : ChatStateStore(Options()) {}
+  explicit ChatStateStore(Options options);
+  ChatStateStore(const ChatStateStore &) = delete;
+  ChatStateStore &operator=(const ChatStateStore &) = delete;
+  ~ChatStateStore();
+  // останавливает фоновый поток и пишет последний снапшот
+
+  std::optional<std::string> Get(int64_t chat_id);
+  void Put(int64_t chat_id, std::string state);
+  bool Erase(int64_t chat_id);
+  void Update(int64_t chat_id,
+              const std::function<void(std::string &state)> &update);
+  // прочитать-изменить-записать под мьютексом шарда; для нового чата
+  // update получает пустую строку, если update бросил - ничего не меняется
+
+  size_t Size() const;
+  size_t Bytes() const;
+  uint64_t Evictions() const { return evictions_.load(); }
+
+  void Snapshot();
+  // записать снапшот сейчас; бросает std::runtime_error при ошибке записи
+  size_t Load();
+  // прочитать снапшот (делается в конструкторе), возвращает число чатов;
+  // битый файл (не та сигнатура, контрольная сумма) пропускается целиком
+
+  static constexpr size_t kEntryOverhead = 64;
+  // узел списка и хэш-таблицы на чат, примерно
+
+private:
+  struct Entry {
+    int64_t chat_id;
+    std::string state;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::list<Entry> lru;
+    // в начале недавно использованные
+    std::unordered_map<int64_t, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+  };
+
+  Shard &ShardFor(int64_t chat_id);
+  void Touch(Shard &shard, std::list<Entry>::iterator it);
+  void Insert(Shard &shard, int64_t chat_id, std::string state);
+  void Evict(Shard &shard);
+  // под мьютексом шарда
+  void SnapshotIfDirty();
+  void SnapshotLoop();
+
+  const Options options_;
+  const size_t shard_bytes_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> version_{0};
+  // растёт при каждом изменении, по нему видно, нужен ли новый снапшот
+  std::atomic<uint64_t> evictions_{0};
+
+  std::mutex snapshot_mutex_;
+  // упорядочивает записи снапшота
+  uint64_t snapshot_version_ = 0;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_ = false;
+  std::thread snapshotter_;
+};
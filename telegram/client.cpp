@@ -1,243 +1,1150 @@
 #include "client.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "text_scan.h"
 
-#include <Poco/Net/HTTPClientSession.h>
-#include <Poco/Net/HTTPRequest.h>
-#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Exception.h>
 #include <Poco/SharedPtr.h>
 #include <Poco/URI.h>
-// для одновременной поддержки https и http
-#include <Poco/Net/AcceptCertificateHandler.h>
-#include <Poco/Net/HTTPSSessionInstantiator.h>
-#include <Poco/Net/HTTPSessionFactory.h>
-#include <Poco/Net/SSLManager.h>
 
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
+#include <algorithm>
 #include <assert.h>
+#include <cctype>
+#include <condition_variable>
+#include <filesystem>
 #include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <thread>
 
-NewMessage::NewMessage(int64_t chat_id, int64_t message_id, std::string text,
-                       std::vector<std::string> commands)
-    : chat_id_(chat_id), message_id_(message_id), text_(text),
-      commands_(std::move(commands)) {}
+namespace {
 
-bool NewMessage::AreCommandsInText() { return are_there_commands_; }
+// из ответа sendMessage нужны только result.message_id и result.chat.id,
+// из ответа sendPhoto ещё file_id самого большого размера (последний в photo)
+SentMessage ParseSentMessage(std::istream &response_body,
+                             std::string *file_id = nullptr) {
+  SentMessage sent;
+  JsonReader reader(response_body);
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    if (reader.Key() != "result" || reader.Peek() != '{') {
+      reader.Skip();
+      continue;
+    }
+    reader.BeginObject();
+    while (reader.NextKey()) {
+      if (reader.Key() == "message_id") {
+        sent.message_id = reader.ReadInt();
+      } else if (reader.Key() == "chat" && reader.Peek() == '{') {
+        reader.BeginObject();
+        while (reader.NextKey()) {
+          if (reader.Key() == "id") {
+            sent.chat_id = reader.ReadInt();
+          } else {
+            reader.Skip();
+          }
+        }
+      } else if (reader.Key() == "photo" && file_id != nullptr &&
+                 reader.Peek() == '[') {
+        reader.BeginArray();
+        while (reader.NextElement()) {
+          reader.BeginObject();
+          while (reader.NextKey()) {
+            if (reader.Key() == "file_id") {
+              reader.ReadString(*file_id);
+            } else {
+              reader.Skip();
+            }
+          }
+        }
+      } else {
+        reader.Skip();
+      }
+    }
+  }
+  return sent;
+}
+
+// тело ошибки выглядит как {"ok":false,"error_code":429,"description":...,
+// "parameters":{"retry_after":5}}; если это не json - оставляем context
+TelegramAPIError ReadApiError(int status, std::istream &response_body,
+                              const std::string &context) {
+  std::string description;
+  int retry_after = 0;
+  try {
+    JsonReader reader(response_body);
+    reader.BeginObject();
+    while (reader.NextKey()) {
+      if (reader.Key() == "description" && reader.Peek() == '"') {
+        reader.ReadString(description);
+      } else if (reader.Key() == "parameters" && reader.Peek() == '{') {
+        reader.BeginObject();
+        while (reader.NextKey()) {
+          if (reader.Key() == "retry_after") {
+            retry_after = static_cast<int>(reader.ReadInt());
+          } else {
+            reader.Skip();
+          }
+        }
+      } else {
+        reader.Skip();
+      }
+    }
+  } catch (const JsonSyntaxError &) {
+  }
+  return TelegramAPIError(
+      status, description.empty() ? context : context + ": " + description,
+      retry_after);
+}
+
+// multipart/form-data для загрузки фото; файл читается целиком, потому что
+// загружается один раз на рассылку, а дальше уходит по file_id
+std::string FormPhotoUpload(const std::string &boundary, int64_t chat_id,
+                            const std::string &path,
+                            const std::string &caption, int64_t reply_to) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("cannot read " + path);
+  }
+  std::string body;
+  auto field = [&](const std::string &name, const std::string &value) {
+    body += "--" + boundary + "\r\n";
+    body += "Content-Disposition: form-data; name=\"" + name + "\"\r\n\r\n";
+    body += value + "\r\n";
+  };
+  field("chat_id", std::to_string(chat_id));
+  if (!caption.empty()) {
+    field("caption", caption);
+  }
+  if (reply_to != -1) {
+    field("reply_to_message_id", std::to_string(reply_to));
+  }
+  std::string file_name = std::filesystem::path(path).filename().string();
+  std::replace(file_name.begin(), file_name.end(), '"', '_');
+  body += "--" + boundary + "\r\n";
+  body += "Content-Disposition: form-data; name=\"photo\"; filename=\"" +
+          file_name + "\"\r\n";
+  body += "Content-Type: application/octet-stream\r\n\r\n";
+  body.append(std::istreambuf_iterator<char>(file),
+              std::istreambuf_iterator<char>());
+  body += "\r\n--" + boundary + "--\r\n";
+  return body;
+}
+
+// "reply_markup": {"inline_keyboard": [[{"text", "callback_data"}, ...]]}
+void WriteReplyMarkup(JsonWriter &writer, const InlineKeyboard &keyboard) {
+  writer.Key("reply_markup");
+  writer.BeginObject();
+  writer.Key("inline_keyboard");
+  writer.BeginArray();
+  for (const auto &row : keyboard) {
+    writer.BeginArray();
+    for (const InlineButton &button : row) {
+      writer.BeginObject();
+      writer.Key("text");
+      writer.String(button.text);
+      writer.Key("callback_data");
+      writer.String(button.callback_data);
+      writer.EndObject();
+    }
+    writer.EndArray();
+  }
+  writer.EndArray();
+  writer.EndObject();
+}
+
+bool IsRetryable(int http_code) {
+  return http_code == 429 || http_code >= 500;
+}
+
+ClientTelegramBotAPI::Options
+OptionsWithOffset(const OffsetStorage::Options &offset_options) {
+  ClientTelegramBotAPI::Options options;
+  options.offset = offset_options;
+  return options;
+}
+
+} // namespace
+
+NewMessage::NewMessage(int64_t update_id, int64_t chat_id, int64_t message_id,
+                       std::string_view text,
+                       std::pmr::vector<std::string_view> commands)
+    : update_id_(update_id), chat_id_(chat_id), message_id_(message_id),
+      text_(text), commands_(std::move(commands)), are_there_commands_(false) {
+}
+
+bool NewMessage::AreCommandsInText() const { return are_there_commands_; }
 
 void NewMessage::SetCommandsChecker(bool are_there_commands) {
   are_there_commands_ = are_there_commands;
 }
 
-std::vector<std::string> &NewMessage::Commands() { return commands_; }
+const std::pmr::vector<std::string_view> &NewMessage::Commands() const {
+  return commands_;
+}
+
+std::string_view NewMessage::GetText() const { return text_; }
+
+int64_t NewMessage::GetChatId() const { return chat_id_; }
+
+int64_t NewMessage::GetMessageId() const { return message_id_; }
+
+int64_t NewMessage::GetUpdateId() const { return update_id_; }
+
+TraceId NewMessage::Trace() const { return trace_; }
+
+void NewMessage::SetTrace(TraceId trace) { trace_ = trace; }
+
+CallbackQuery::CallbackQuery(int64_t update_id, std::string_view id,
+                             std::string_view data, int64_t from_id,
+                             int64_t chat_id, int64_t message_id)
+    : update_id_(update_id), id_(id), data_(data), from_id_(from_id),
+      chat_id_(chat_id), message_id_(message_id) {}
+
+std::string_view CallbackQuery::GetId() const { return id_; }
+
+std::string_view CallbackQuery::GetData() const { return data_; }
+
+int64_t CallbackQuery::GetFromId() const { return from_id_; }
+
+int64_t CallbackQuery::GetChatId() const { return chat_id_; }
+
+int64_t CallbackQuery::GetMessageId() const { return message_id_; }
+
+int64_t CallbackQuery::GetUpdateId() const { return update_id_; }
+
+TraceId CallbackQuery::Trace() const { return trace_; }
+
+void CallbackQuery::SetTrace(TraceId trace) { trace_ = trace; }
+
+int64_t UpdateId(const Update &update) {
+  return std::visit([](const auto &value) { return value.GetUpdateId(); },
+                    update);
+}
+
+TraceId UpdateTrace(const Update &update) {
+  return std::visit([](const auto &value) { return value.Trace(); }, update);
+}
+
+int64_t UpdateChatId(const Update &update) {
+  return std::visit([](const auto &value) { return value.GetChatId(); },
+                    update);
+}
 
-std::string NewMessage::GetText() { return text_; }
+UpdateBatch::UpdateBatch(size_t initial_arena_size)
+    : arena_(initial_arena_size), updates_(&arena_) {}
 
-int64_t NewMessage::GetChatId() { return chat_id_; }
+std::string_view UpdateBatch::CopyText(std::string_view text) {
+  if (text.empty()) {
+    return {};
+  }
+  char *data = static_cast<char *>(arena_.allocate(text.size(), 1));
+  std::copy(text.begin(), text.end(), data);
+  return std::string_view(data, text.size());
+}
 
-int64_t NewMessage::GetMessageId() { return message_id_; }
+std::pmr::memory_resource *UpdateBatch::Arena() { return &arena_; }
+
+TraceId UpdateBatch::Add(const DecodedUpdate &update) {
+  using Kind = DecodedUpdate::Kind;
+  Kind kind = update.has_message ? Kind::kMessage : update.kind;
+  if (kind == Kind::kCallbackQuery) {
+    CallbackQuery &query = Emplace<CallbackQuery>(
+        update.update_id, CopyText(update.callback_id),
+        CopyText(update.callback_data), update.from_id, update.chat_id,
+        update.message_id);
+    query.SetTrace(SampleTrace());
+    return query.Trace();
+  }
+  if (kind != Kind::kMessage && kind != Kind::kEditedMessage) {
+    return 0;
+  }
+  std::string_view text = CopyText(update.text);
+  bool has_commands = update.has_entities && update.has_text;
+  std::pmr::vector<std::string_view> commands(Arena());
+  if (has_commands) {
+    assert(!update.text.empty());
+    commands.reserve(update.commands.size());
+    // смещения entities в utf-16, поэтому substr по ним режет кириллицу
+    Utf16Cursor cursor(text);
+    for (auto [offset, length] : update.commands) {
+      if (offset < 0 || length <= 0) {
+        continue;
+      }
+      std::string_view command = cursor.Slice(offset, length);
+      if (!command.empty()) {
+        commands.push_back(command);
+      }
+    }
+  } else if (update.has_text) {
+    // entities нет (например, текст пересобран клиентом) - ищем команды сами
+    size_t pos = 0;
+    for (std::string_view command = NextBotCommand(text, pos);
+         !command.empty(); command = NextBotCommand(text, pos)) {
+      commands.push_back(command);
+    }
+    has_commands = !commands.empty();
+  }
+  NewMessage *message;
+  if (kind == Kind::kEditedMessage) {
+    message = &Emplace<EditedMessage>(update.update_id, update.chat_id,
+                                      update.message_id, text,
+                                      std::move(commands));
+  } else {
+    message = &Emplace<NewMessage>(update.update_id, update.chat_id,
+                                   update.message_id, text,
+                                   std::move(commands));
+  }
+  message->SetCommandsChecker(has_commands);
+  message->SetTrace(SampleTrace());
+  return message->Trace();
+}
+
+ClientTelegramBotAPI::ClientTelegramBotAPI(
+    const std::string &token, const std::string &uri,
+    OffsetStorage::Options offset_options)
+    : ClientTelegramBotAPI(token, uri, OptionsWithOffset(offset_options)) {}
 
 ClientTelegramBotAPI::ClientTelegramBotAPI(const std::string &token,
-                                           const std::string &uri)
-    : token_(token), uri_(uri) {
-  offset_file_name_ = "offset.txt";
-  GetOffset();
-  /*
-      // для одновременной поддержки https и http (код из stackoverflow)
-      Poco::Net::HTTPSessionFactory::defaultFactory().registerProtocol(
-          "http", new Poco::Net::HTTPSessionInstantiator);
-      Poco::Net::HTTPSessionFactory::defaultFactory().registerProtocol(
-          "https", new Poco::Net::HTTPSSessionInstantiator);
-      //prepare for SSLManager
-      Poco::SharedPtr ptr_cert = new Poco::Net::AcceptCertificateHandler(false);
-      const Poco::Net::Context::Ptr context = new Poco::Net::Context(
-          Poco::Net::Context::CLIENT_USE, "", "", "",
-          Poco::Net::Context::VERIFY_NONE, 9, false,
-          "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
-      Poco::Net::SSLManager::instance().initializeClient(0, ptr_cert,
-     context);*/
+                                           const std::string &uri,
+                                           Options options)
+    : token_(token), uri_(uri), transport_(std::move(options.transport)),
+      rate_limiter_(std::move(options.rate_limiter)) {
+  if (rate_limiter_ == nullptr) {
+    rate_limiter_ = std::make_shared<RateLimiter>();
+  }
+  Poco::URI url(uri_ + "bot" + token_ + "/");
+  if (transport_ == nullptr) {
+    std::shared_ptr<SessionPool> session_pool =
+        std::move(options.session_pool);
+    if (session_pool == nullptr) {
+      session_pool = std::make_shared<SessionPool>();
+    }
+    transport_ = std::make_shared<PocoTransport>(session_pool, url);
+  }
+  method_path_ = url.getPath();
+  get_updates_path_ = method_path_ + "getUpdates";
+  send_message_path_ = method_path_ + "sendMessage";
+  get_me_path_ = method_path_ + "getMe";
+  send_photo_path_ = method_path_ + "sendPhoto";
+  edit_message_path_ = method_path_ + "editMessageText";
+  answer_callback_path_ = method_path_ + "answerCallbackQuery";
+  file_ids_ = options.file_ids;
+  if (file_ids_ == nullptr) {
+    file_ids_ = std::make_shared<FileIdCache>();
+  }
+  updates_limit_ = std::clamp<size_t>(options.updates_limit, 1, 100);
+  batch_bytes_ = options.batch_bytes;
+  journal_ = options.journal;
+  poll_abort_ = options.poll_abort;
+  offset_file_name_ = std::move(options.offset_file_name);
+  offset_storage_ =
+      std::make_unique<OffsetStorage>(offset_file_name_, options.offset);
+  dedup_flush_interval_ = options.offset.flush_interval;
+  // http и https сессии создаёт SessionPool по схеме uri
 }
 
-std::vector<std::shared_ptr<AbstractCPPClass>>
-ClientTelegramBotAPI::FormCppStructFromJson(std::istream &response_body) {
-  std::vector<std::shared_ptr<AbstractCPPClass>> answer;
-  Poco::JSON::Parser parser;
-  Poco::Dynamic::Var reply = parser.parse(response_body);
-
-  Poco::JSON::Object::Ptr responsed_answer =
-      reply.extract<Poco::JSON::Object::Ptr>();
-  bool checker = responsed_answer->getValue<bool>("ok");
-  // SendMessage(400988361, "passed ok");
-  if (!checker) {
-    throw TelegramAPIError(111, "my responsed ok = false");
-    //                responsed_answer->getValue<std::string>("description")
-  }
-
-  Poco::JSON::Array::Ptr array_of_updates =
-      responsed_answer->getArray("result");
-  for (size_t idx = 0; idx < array_of_updates->size(); ++idx) {
-    // SendMessage(400988361, "entered cycle" + std::to_string(idx));
-    Poco::JSON::Object::Ptr cur_obj = array_of_updates->getObject(idx);
-    offset_ = cur_obj->getValue<int64_t>("update_id") + 1;
-    SetOffset();
-    if (!cur_obj->has("message")) {
-      continue;
+std::string ClientTelegramBotAPI::OffsetFileName(const std::string &directory,
+                                                 const std::string &token) {
+  // токен вида "<bot id>:<secret>"
+  std::string bot_id = token.substr(0, token.find(':'));
+  for (char &c : bot_id) {
+    if (!std::isalnum(static_cast<unsigned char>(c))) {
+      c = '_';
     }
-    // SendMessage(400988361, "passed check is it message update");
-    std::string text = "";
-    if ((cur_obj->getObject("message")->has("text"))) {
-      text = cur_obj->getObject("message")->getValue<std::string>("text");
-    }
-    int64_t chat_id = 0;
-    if ((cur_obj->getObject("message")->has("chat"))) {
-      chat_id =
-          cur_obj->getObject("message")->getObject("chat")->getValue<int64_t>(
-              "id");
-    }
-    int64_t message_id = 0;
-    if ((cur_obj->getObject("message")->has("message_id"))) {
-      message_id =
-          cur_obj->getObject("message")->getValue<int64_t>("message_id");
-    }
-    std::vector<std::string> commands;
-    if (!(cur_obj->getObject("message")->has("entities")) ||
-        !(cur_obj->getObject("message")->has("text"))) {
-      answer.push_back(std::make_shared<NewMessage>(
-          NewMessage(chat_id, message_id, text, commands)));
-      continue;
+  }
+  if (bot_id.empty()) {
+    bot_id = "bot";
+  }
+  if (directory.empty()) {
+    return bot_id + ".offset";
+  }
+  return directory + "/" + bot_id + ".offset";
+}
+
+template <class Call>
+auto ClientTelegramBotAPI::WithRetries(Call &&call, bool idempotent) {
+  for (int attempt = 1;; ++attempt) {
+    std::chrono::milliseconds open_for = circuit_breaker_.RetryAfter();
+    if (open_for.count() > 0) {
+      throw TelegramAPIError(
+          503, "circuit breaker is open",
+          static_cast<int>((open_for.count() + 999) / 1000));
     }
-    // SendMessage(400988361, "passed entities checker");
-    for (size_t idx_command = 0;
-         idx_command <
-         cur_obj->getObject("message")->getArray("entities")->size();
-         ++idx_command) {
-      if (cur_obj->getObject("message")
-              ->getArray("entities")
-              ->getObject(idx_command)
-              ->getValue<std::string>("type") == "bot_command") {
-        int64_t index_of_command_in_text = cur_obj->getObject("message")
-                                               ->getArray("entities")
-                                               ->getObject(idx_command)
-                                               ->getValue<int64_t>("offset");
-        int64_t len_of_command_in_text = cur_obj->getObject("message")
-                                             ->getArray("entities")
-                                             ->getObject(idx_command)
-                                             ->getValue<int64_t>("length");
-        commands.push_back(
-            text.substr(index_of_command_in_text, len_of_command_in_text));
+    int retry_after = 0;
+    try {
+      auto result = call();
+      circuit_breaker_.RecordSuccess();
+      return result;
+    } catch (const PollAborted &) {
+      throw;
+    } catch (const TelegramAPIError &e) {
+      if (!IsRetryable(e.http_code)) {
+        // сервер жив и ответил по существу - ретраить нечего
+        circuit_breaker_.RecordSuccess();
+        throw;
       }
+      if (e.http_code >= 500) {
+        circuit_breaker_.RecordFailure();
+      } else {
+        circuit_breaker_.RecordSuccess();
+      }
+      if (attempt >= retry_policy_.max_attempts) {
+        throw;
+      }
+      retry_after = e.retry_after;
+    } catch (const RequestNotSent &) {
+      circuit_breaker_.RecordFailure();
+      if (attempt >= retry_policy_.max_attempts) {
+        throw;
+      }
+    } catch (const Poco::IOException &) {
+      circuit_breaker_.RecordFailure();
+      // запрос мог дойти и выполниться (например, оборвался ответ):
+      // повтор sendMessage пришёл бы пользователю второй раз
+      if (!idempotent || attempt >= retry_policy_.max_attempts) {
+        throw;
+      }
+    } catch (const Poco::TimeoutException &) {
+      circuit_breaker_.RecordFailure();
+      if (!idempotent || attempt >= retry_policy_.max_attempts) {
+        throw;
+      }
+    } catch (...) {
+      circuit_breaker_.RecordFailure();
+      throw;
     }
-    assert(!text.empty());
-    std::shared_ptr<NewMessage> next = std::make_shared<NewMessage>(
-        NewMessage(chat_id, message_id, text, commands));
-    next->SetCommandsChecker(true);
-    answer.push_back(std::static_pointer_cast<AbstractCPPClass>(next));
+    std::this_thread::sleep_for(retry_policy_.Delay(attempt, retry_after));
   }
-  return answer;
+}
+
+void ClientTelegramBotAPI::FormCppStructFromJson(std::istream &response_body,
+                                                 UpdateBatch &batch,
+                                                 JournalCapture *capture) {
+  int64_t next_offset = offset_;
+  // один проход по потоку ответа, без Poco DOM; текст и команды сразу
+  // ложатся в арену батча
+  // после batch_bytes_ апдейты дальше только пропускаются: offset на них
+  // не сдвигаем, и telegram пришлёт их в следующем getUpdates
+  size_t batch_bytes = 0;
+  bool full = false;
+  auto started = std::chrono::steady_clock::now();
+  DecodedResponse decoded = update_decoder_.Decode(
+      response_body, [&](const DecodedUpdate &update) {
+        if (!full) {
+          size_t bytes = sizeof(Update) + update.text.size() +
+                         update.commands.size() * sizeof(std::string_view);
+          full = batch_bytes != 0 && batch_bytes + bytes > batch_bytes_;
+          if (!full) {
+            batch_bytes += bytes;
+          }
+        }
+        if (full) {
+          // придёт снова в следующем getUpdates, там и попадёт в журнал
+          if (capture != nullptr) {
+            capture->Drop(update.raw_end);
+          }
+          return;
+        }
+        if (capture != nullptr) {
+          capture->Accept(update.raw_begin, update.raw_end);
+        }
+        next_offset = update.update_id + 1;
+        TraceId trace = batch.Add(update);
+        if (trace != 0) {
+          RecordSpan(trace, "decode", started,
+                     std::chrono::steady_clock::now());
+        }
+      });
+
+  if (!decoded.ok) {
+    throw TelegramAPIError(decoded.error_code ? decoded.error_code : 111,
+                           "my responsed ok = false " + decoded.description);
+  }
+  offset_ = next_offset;
+  batch.SetNextOffset(next_offset);
 }
 
 std::vector<std::shared_ptr<AbstractCPPClass>>
 ClientTelegramBotAPI::GetUpdates(int timeout) {
+  std::shared_ptr<UpdateBatch> batch = GetUpdateBatch(timeout);
   std::vector<std::shared_ptr<AbstractCPPClass>> all_updates_from_last_request;
-  Poco::URI url(uri_ + "bot" + token_ + "/getUpdates");
+  all_updates_from_last_request.reserve(batch->Size());
+  for (Update &update : *batch) {
+    if (std::holds_alternative<EditedMessage>(update)) {
+      continue;
+    }
+    AbstractCPPClass *object = std::visit(
+        [](auto &value) -> AbstractCPPClass * { return &value; }, update);
+    all_updates_from_last_request.emplace_back(batch, object);
+  }
+  return all_updates_from_last_request;
+}
+
+std::shared_ptr<UpdateBatch> ClientTelegramBotAPI::GetUpdateBatch(int timeout) {
+  return GetUpdateBatch(timeout, updates_limit_);
+}
+
+std::shared_ptr<UpdateBatch>
+ClientTelegramBotAPI::GetUpdateBatch(int timeout, size_t limit) {
+  limit = std::clamp<size_t>(limit, 1, kMaxUpdatesLimit);
+  // тот же offset вернёт те же апдейты, так что повтор безопасен
+  return WithRetries(
+      [&] {
+        try {
+          return FetchUpdateBatch(timeout, limit);
+        } catch (const PollAborted &) {
+          throw;
+        } catch (...) {
+          // разорванный Abort-ом сокет даёт обычную ошибку сети (или
+          // обрезанный json) - это не сбой API, повторять не нужно
+          if (poll_abort_ != nullptr && poll_abort_->Aborted()) {
+            throw PollAborted("getUpdates aborted");
+          }
+          throw;
+        }
+      },
+      true);
+}
+
+std::shared_ptr<UpdateBatch>
+ClientTelegramBotAPI::FetchUpdateBatch(int timeout, size_t limit) {
+  LoadOffset();
+  if (!auto_commit_offset_) {
+    // offset в запросе подтверждает telegram всё, что до него, поэтому
+    // шлём только сохранённый: необработанные апдейты придут снова
+    std::lock_guard<std::mutex> guard(dedup_mutex_);
+    offset_ = committed_offset_;
+  }
+  ApiCallTimer timer(ApiMethod::kGetUpdates);
+  auto batch = std::make_shared<UpdateBatch>();
+  std::string path = get_updates_path_;
+  char separator = '?';
   if (offset_) {
-    url.addQueryParameter("offset", std::to_string(offset_));
+    path += separator;
+    path += "offset=" + std::to_string(offset_);
+    separator = '&';
   }
   if (timeout) {
-    url.addQueryParameter("timeout", std::to_string(timeout));
+    path += separator;
+    path += "timeout=" + std::to_string(timeout);
+    separator = '&';
+  }
+  if (limit != kMaxUpdatesLimit) {
+    path += separator;
+    path += "limit=" + std::to_string(limit);
   }
 
-  // Poco::Net::HTTPClientSession *session =
-  // Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(url);
-  Poco::Net::HTTPClientSession session(url.getHost(), url.getPort());
-
-  Poco::Net::HTTPRequest request("GET", url.getPathAndQuery());
-  session.sendRequest(request);
-
-  Poco::Net::HTTPResponse response;
-  std::istream &response_body = session.receiveResponse(response);
+  // long-poll идёт по своему соединению и не блокирует sendMessage
+  TransportRequest request;
+  request.path = path;
+  request.timeout = timeout + kLongPollTimeoutMargin;
+  request.long_poll = true;
+  request.idempotent = true;
+  request.abort = poll_abort_.get();
+  TransportResponse response;
+  auto exchange = transport_->Send(timer, request, response);
+  std::istream &response_body = exchange->Body();
 
-  if (response.getStatus() != 200) {
-    throw TelegramAPIError(response.getStatus(),
-                           url.toString() + " getUpdates");
+  if (response.status != 200) {
+    TelegramAPIError error =
+        ReadApiError(response.status, response_body, "getUpdates");
+    exchange->Finish();
+    throw error;
   }
   // SendMessage(400988361, "i m going inside of parser");
 
-  all_updates_from_last_request = FormCppStructFromJson(response_body);
+  if (journal_ != nullptr) {
+    JournalCapture capture(response_body.rdbuf());
+    std::istream captured_body(&capture);
+    FormCppStructFromJson(captured_body, *batch, &capture);
+    exchange->Finish();
+    std::string journaled = capture.Body();
+    if (!journaled.empty()) {
+      try {
+        journal_->Append(journaled);
+      } catch (const std::exception &e) {
+        // журнал - для отладки, поллинг из-за него не останавливаем
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  } else {
+    FormCppStructFromJson(response_body, *batch);
+    exchange->Finish();
+  }
+  timer.Phase(ApiPhase::kParse);
+  GlobalMetrics().batch_updates.Record(batch->Size());
+  // весь батч разобран - сохраняем offset один раз, а не на каждый апдейт
+  if (auto_commit_offset_) {
+    SetOffset();
+  }
 
-  return all_updates_from_last_request;
+  return batch;
 }
 
 void ClientTelegramBotAPI::SendMessage(int64_t chat_id, std::string response,
                                        int64_t message_id) {
-  Poco::URI url(uri_ + "bot" + token_ + "/sendMessage");
-  // url.setQuery("chat_id=" + std::to_string(chat_id) + "&" + "text=" +
-  // response);
-  Poco::JSON::Object json_for_send;
-  json_for_send.set("chat_id", std::to_string(chat_id));
-  json_for_send.set("text", response);
-  if (message_id != -1) {
-    json_for_send.set("reply_to_message_id", message_id);
+  TraceSpan span("sendMessage");
+  {
+    TraceSpan wait("rate_limit");
+    rate_limiter_->Acquire(chat_id);
   }
+  WithRetries([&] { return DoSendMessage(chat_id, response, message_id); });
+}
+
+std::future<SentMessage>
+ClientTelegramBotAPI::SendMessageAsync(int64_t chat_id, std::string text,
+                                       int64_t reply_to) {
+  SendRequest request;
+  request.chat_id = chat_id;
+  request.text = std::move(text);
+  request.reply_to = reply_to;
+  request.trace = CurrentTrace();
+  std::future<SentMessage> result = request.promise.get_future();
+  AsyncSendQueue().Push(std::move(request));
+  return result;
+}
 
-  // Poco::Net::HTTPClientSession *session =
-  // Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(url);
+void ClientTelegramBotAPI::SendMessageAsync(int64_t chat_id, std::string text,
+                                            int64_t reply_to,
+                                            SendCallback callback) {
+  SendRequest request;
+  request.chat_id = chat_id;
+  request.text = std::move(text);
+  request.reply_to = reply_to;
+  request.trace = CurrentTrace();
+  request.callback = std::move(callback);
+  AsyncSendQueue().Push(std::move(request));
+}
 
-  Poco::Net::HTTPClientSession session(url.getHost(), url.getPort());
-  Poco::Net::HTTPRequest request("POST", url.getPathAndQuery());
+SendQueue &ClientTelegramBotAPI::AsyncSendQueue() {
+  std::call_once(send_queue_once_, [this] {
+    send_queue_ = std::make_unique<SendQueue>(
+        kAsyncSenders, kAsyncQueueCapacity,
+        [this](const SendRequest &request) {
+          // лимиты очередь уже взяла сама, спан - только отправка
+          ScopedTrace trace(request.trace);
+          TraceSpan span(request.photo.empty() ? "sendMessage" : "sendPhoto");
+          return WithRetries([&] {
+            if (!request.photo.empty()) {
+              return DoSendPhoto(request.chat_id, request.photo, request.text,
+                                 request.reply_to);
+            }
+            return DoSendMessage(request.chat_id, request.text,
+                                 request.reply_to);
+          });
+        },
+        rate_limiter_);
+  });
+  return *send_queue_;
+}
 
-  std::stringstream stringstream;
-  json_for_send.stringify(stringstream);
-  std::string data = stringstream.str();
-  request.setContentType("application/json");
-  request.setContentLength(data.size());
+SentMessage ClientTelegramBotAPI::DoSendMessage(int64_t chat_id,
+                                                const std::string &response,
+                                                int64_t message_id) {
+  ApiCallTimer timer(ApiMethod::kSendMessage);
+  // буфер тела свой у каждого потока и живёт между вызовами, так что после
+  // первых сообщений сериализация не аллоцирует
+  thread_local std::string data;
+  WriteSendMessageJson(data, chat_id, response, message_id);
 
-  std::ostream &request_body = session.sendRequest(request);
-  request_body << data;
+  TransportRequest request;
+  request.method = "POST";
+  request.path = send_message_path_;
+  request.content_type = "application/json";
+  request.body = data;
+  request.timeout = kRequestTimeout;
 
-  Poco::Net::HTTPResponse http_response;
-  session.receiveResponse(http_response);
+  TransportResponse http_response;
+  auto exchange = transport_->Send(timer, request, http_response);
+  std::istream &response_body = exchange->Body();
 
-  if (http_response.getStatus() != 200) {
-    throw TelegramAPIError(http_response.getStatus(),
-                           "never give up! sendmessage");
+  if (http_response.status != 200) {
+    TelegramAPIError error =
+        ReadApiError(http_response.status, response_body, "sendMessage");
+    exchange->Finish();
+    throw error;
+  }
+  SentMessage sent;
+  try {
+    sent = ParseSentMessage(response_body);
+  } catch (const JsonSyntaxError &) {
+    // сообщение уже отправлено, битое тело ответа не повод для ошибки
+  }
+  timer.Phase(ApiPhase::kParse);
+  if (sent.chat_id == 0) {
+    sent.chat_id = chat_id;
+  }
+  exchange->Finish();
+  return sent;
+}
+
+std::string ClientTelegramBotAPI::FormSendMessageJson(int64_t chat_id,
+                                                      const std::string &text,
+                                                      int64_t reply_to) {
+  std::string json;
+  WriteSendMessageJson(json, chat_id, text, reply_to);
+  return json;
+}
+
+void ClientTelegramBotAPI::WriteSendMessageJson(std::string &out,
+                                                int64_t chat_id,
+                                                const std::string &text,
+                                                int64_t reply_to) {
+  JsonWriter writer(out);
+  writer.BeginObject();
+  writer.Key("chat_id");
+  writer.Int(chat_id);
+  writer.Key("text");
+  writer.String(text);
+  if (reply_to != -1) {
+    writer.Key("reply_to_message_id");
+    writer.Int(reply_to);
+  }
+  writer.EndObject();
+}
+
+void ClientTelegramBotAPI::SendPhoto(int64_t chat_id, const std::string &photo,
+                                     const std::string &caption,
+                                     int64_t reply_to) {
+  TraceSpan span("sendPhoto");
+  rate_limiter_->Acquire(chat_id);
+  WithRetries([&] { return DoSendPhoto(chat_id, photo, caption, reply_to); });
+}
+
+SentMessage ClientTelegramBotAPI::DoSendPhoto(int64_t chat_id,
+                                              const std::string &photo,
+                                              const std::string &caption,
+                                              int64_t reply_to) {
+  auto send_by_id = [&](const std::string &file_id) {
+    std::string data;
+    JsonWriter writer(data);
+    writer.BeginObject();
+    writer.Key("chat_id");
+    writer.Int(chat_id);
+    writer.Key("photo");
+    writer.String(file_id);
+    if (!caption.empty()) {
+      writer.Key("caption");
+      writer.String(caption);
+    }
+    if (reply_to != -1) {
+      writer.Key("reply_to_message_id");
+      writer.Int(reply_to);
+    }
+    writer.EndObject();
+    return PostPhoto(chat_id, "application/json", data, nullptr);
+  };
+
+  std::string key = FileIdCache::KeyForFile(photo);
+  if (key.empty()) {
+    // не локальный файл: file_id или url, telegram разберётся сам
+    return send_by_id(photo);
+  }
+  std::string file_id = file_ids_->Acquire(key);
+  if (!file_id.empty()) {
+    return send_by_id(file_id);
+  }
+  try {
+    std::random_device random;
+    std::string boundary = "----bot-" + std::to_string(random()) +
+                           std::to_string(random());
+    SentMessage sent = PostPhoto(
+        chat_id, "multipart/form-data; boundary=" + boundary,
+        FormPhotoUpload(boundary, chat_id, photo, caption, reply_to),
+        &file_id);
+    file_ids_->Store(key, file_id);
+    return sent;
+  } catch (...) {
+    file_ids_->Abandon(key);
+    throw;
   }
 }
 
+SentMessage ClientTelegramBotAPI::PostPhoto(int64_t chat_id,
+                                            const std::string &content_type,
+                                            const std::string &body,
+                                            std::string *file_id) {
+  ApiCallTimer timer(ApiMethod::kSendPhoto);
+  TransportRequest request;
+  request.method = "POST";
+  request.path = send_photo_path_;
+  request.content_type = content_type;
+  request.body = body;
+  request.timeout = kRequestTimeout;
+
+  TransportResponse http_response;
+  auto exchange = transport_->Send(timer, request, http_response);
+  std::istream &response_body = exchange->Body();
+  if (http_response.status != 200) {
+    TelegramAPIError error =
+        ReadApiError(http_response.status, response_body, "sendPhoto");
+    exchange->Finish();
+    throw error;
+  }
+  SentMessage sent;
+  try {
+    sent = ParseSentMessage(response_body, file_id);
+  } catch (const JsonSyntaxError &) {
+  }
+  timer.Phase(ApiPhase::kParse);
+  if (sent.chat_id == 0) {
+    sent.chat_id = chat_id;
+  }
+  exchange->Finish();
+  return sent;
+}
+
+void ClientTelegramBotAPI::SendKeyboard(int64_t chat_id,
+                                        const std::string &text,
+                                        const InlineKeyboard &keyboard,
+                                        int64_t reply_to) {
+  std::string data;
+  JsonWriter writer(data);
+  writer.BeginObject();
+  writer.Key("chat_id");
+  writer.Int(chat_id);
+  writer.Key("text");
+  writer.String(text);
+  if (reply_to != -1) {
+    writer.Key("reply_to_message_id");
+    writer.Int(reply_to);
+  }
+  WriteReplyMarkup(writer, keyboard);
+  writer.EndObject();
+
+  TraceSpan span("sendMessage");
+  {
+    TraceSpan wait("rate_limit");
+    rate_limiter_->Acquire(chat_id);
+  }
+  WithRetries([&] {
+    PostJson(send_message_path_, data);
+    return true;
+  });
+}
+
+void ClientTelegramBotAPI::EditMessageText(int64_t chat_id,
+                                           int64_t message_id,
+                                           const std::string &text,
+                                           const InlineKeyboard &keyboard) {
+  std::string data;
+  JsonWriter writer(data);
+  writer.BeginObject();
+  writer.Key("chat_id");
+  writer.Int(chat_id);
+  writer.Key("message_id");
+  writer.Int(message_id);
+  writer.Key("text");
+  writer.String(text);
+  if (!keyboard.empty()) {
+    WriteReplyMarkup(writer, keyboard);
+  }
+  writer.EndObject();
+
+  TraceSpan span("editMessageText");
+  // правка сообщения считается в лимит чата, как и отправка
+  rate_limiter_->Acquire(chat_id);
+  WithRetries([&] {
+    PostJson(edit_message_path_, data);
+    return true;
+  });
+}
+
+void ClientTelegramBotAPI::AnswerCallbackQuery(
+    std::string_view callback_query_id, const std::string &text,
+    bool show_alert) {
+  std::string data;
+  JsonWriter writer(data);
+  writer.BeginObject();
+  writer.Key("callback_query_id");
+  writer.String(callback_query_id);
+  if (!text.empty()) {
+    writer.Key("text");
+    writer.String(text);
+  }
+  if (show_alert) {
+    writer.Key("show_alert");
+    writer.Bool(true);
+  }
+  writer.EndObject();
+
+  // не сообщение в чат: лимиты отправки к ответу не относятся
+  TraceSpan span("answerCallbackQuery");
+  WithRetries([&] {
+    PostJson(answer_callback_path_, data);
+    return true;
+  });
+}
+
+BroadcastReport
+ClientTelegramBotAPI::Broadcast(const std::vector<int64_t> &chat_ids,
+                                const BroadcastPayload &payload,
+                                const BroadcastOptions &options) {
+  BroadcastTracker tracker(chat_ids, options);
+  SendQueue &queue = AsyncSendQueue();
+  size_t idx = tracker.Cursor();
+  try {
+    for (; idx < chat_ids.size(); ++idx) {
+      SendRequest request;
+      request.chat_id = chat_ids[idx];
+      request.text = payload.text;
+      request.photo = payload.photo;
+      request.callback = [&tracker, idx](const SentMessage &,
+                                         std::exception_ptr error) {
+        tracker.Finish(idx, error);
+      };
+      // Push ждёт места в очереди, так что в памяти не больше её ёмкости
+      queue.Push(std::move(request));
+    }
+  } catch (const SendQueueStopped &) {
+    // клиент останавливается: остаток достанется следующему запуску
+    for (; idx < chat_ids.size(); ++idx) {
+      tracker.Abort(idx);
+    }
+  }
+  return tracker.Wait();
+}
+
+void ClientTelegramBotAPI::PostJson(std::string_view path,
+                                    const std::string &data, bool idempotent) {
+  ApiCallTimer timer(ApiMethod::kOther);
+  TransportRequest request;
+  request.method = "POST";
+  request.path = path;
+  request.content_type = "application/json";
+  request.body = data;
+  request.timeout = kRequestTimeout;
+  request.idempotent = idempotent;
+
+  TransportResponse http_response;
+  auto exchange = transport_->Send(timer, request, http_response);
+  std::istream &response_body = exchange->Body();
+  if (http_response.status != 200) {
+    TelegramAPIError error =
+        ReadApiError(http_response.status, response_body,
+                     std::string(path.substr(method_path_.size())));
+    exchange->Finish();
+    throw error;
+  }
+  exchange->Finish();
+}
+
+void ClientTelegramBotAPI::SetWebhook(const std::string &url,
+                                      const std::string &secret_token) {
+  std::string data;
+  JsonWriter writer(data);
+  writer.BeginObject();
+  writer.Key("url");
+  writer.String(url);
+  if (!secret_token.empty()) {
+    writer.Key("secret_token");
+    writer.String(secret_token);
+  }
+  writer.EndObject();
+  // тот же url повторно - не ошибка
+  WithRetries(
+      [&] {
+        PostJson(method_path_ + "setWebhook", data, true);
+        return true;
+      },
+      true);
+}
+
+void ClientTelegramBotAPI::DeleteWebhook() {
+  WithRetries(
+      [&] {
+        PostJson(method_path_ + "deleteWebhook", "{}", true);
+        return true;
+      },
+      true);
+}
+
 bool ClientTelegramBotAPI::GetMe() {
-  Poco::URI url(uri_ + "bot" + token_ + "/getMe");
-  // now you have the HTTP(S)ClientSession
+  ApiCallTimer timer(ApiMethod::kGetMe);
+  auto exchange = OpenGetMe(timer);
+  return FinishGetMe(*exchange, timer);
+}
 
-  // Poco::Net::HTTPClientSession *session =
-  // Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(url);
-  Poco::Net::HTTPClientSession session(url.getHost(), url.getPort());
-  Poco::Net::HTTPRequest request("GET", url.getPath());
-  session.sendRequest(request);
-  Poco::Net::HTTPResponse http_response;
-  std::istream &response_body = session.receiveResponse(http_response);
+std::unique_ptr<TransportExchange>
+ClientTelegramBotAPI::OpenGetMe(ApiCallTimer &timer) {
+  TransportRequest request;
+  request.path = get_me_path_;
+  request.timeout = kRequestTimeout;
+  request.idempotent = true;
+  TransportResponse http_response;
+  auto exchange = transport_->Send(timer, request, http_response);
 
-  if (http_response.getStatus() != 200) {
-    throw TelegramAPIError(http_response.getStatus(),
-                           http_response.getReason());
+  if (http_response.status != 200) {
+    TelegramAPIError error = ReadApiError(
+        http_response.status, exchange->Body(), http_response.reason);
+    exchange->Finish();
+    throw error;
   }
+  return exchange;
+}
 
+bool ClientTelegramBotAPI::FinishGetMe(TransportExchange &exchange,
+                                       ApiCallTimer &timer) {
   Poco::JSON::Parser parser;
-  auto reply = parser.parse(response_body);
+  auto reply = parser.parse(exchange.Body());
+  exchange.Finish();
+  timer.Phase(ApiPhase::kParse);
   return reply.extract<Poco::JSON::Object::Ptr>()->getValue<bool>("ok");
 }
 
-void ClientTelegramBotAPI::SetOffset() {
-  std::ofstream file_out(offset_file_name_);
-  file_out << offset_;
-}
+void ClientTelegramBotAPI::Warmup(size_t connections) {
+  auto offset = std::async(std::launch::async, [this] { LoadOffset(); });
 
-void ClientTelegramBotAPI::GetOffset() {
-  std::ifstream file_input(offset_file_name_);
-  if (file_input.is_open()) {
+  // первое соединение отдельно: оно проверяет токен и оставляет в пуле
+  // TLS-сессию, с которой остальные обойдутся сокращённым рукопожатием
+  transport_->Prepare();
+  WithRetries([this] { return GetMe(); }, true);
+  if (connections <= 1) {
+    // соединение первого getMe и есть тёплое
+    offset.get();
+    return;
+  }
+  // каждый getMe держит своё соединение, пока не откроются все: иначе
+  // быстрый вернёт сессию в пул, следующий возьмёт её же, и тёплых
+  // соединений окажется меньше connections (сессию первого getMe
+  // переиспользует один из них)
+  std::mutex mutex;
+  std::condition_variable opened;
+  size_t opening = connections;
+  auto warm_one = [this, &mutex, &opened, &opening] {
+    ApiCallTimer timer(ApiMethod::kGetMe);
+    std::unique_ptr<TransportExchange> exchange;
+    std::exception_ptr error;
     try {
-      file_input >> offset_;
+      exchange = OpenGetMe(timer);
     } catch (...) {
-      offset_ = 0;
+      error = std::current_exception();
     }
-  } else {
-    offset_ = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (--opening == 0) {
+        opened.notify_all();
+      }
+      opened.wait(lock, [&opening] { return opening == 0; });
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return FinishGetMe(*exchange, timer);
+  };
+  std::vector<std::future<bool>> warm;
+  for (size_t idx = 0; idx < connections; ++idx) {
+    warm.push_back(std::async(std::launch::async, warm_one));
+  }
+  for (auto &connection : warm) {
+    try {
+      connection.get();
+    } catch (const std::exception &e) {
+      // токен уже проверен, соединение откроется позже по требованию
+      std::cerr << "warm-up connection failed: " << e.what() << std::endl;
+    }
+  }
+  offset.get();
+}
+
+void ClientTelegramBotAPI::SetAutoCommitOffset(bool auto_commit) {
+  auto_commit_offset_ = auto_commit;
+}
+
+void ClientTelegramBotAPI::CommitOffset(int64_t offset) {
+  std::lock_guard<std::mutex> guard(dedup_mutex_);
+  StoreOffset(offset);
+}
+
+bool ClientTelegramBotAPI::Handled(int64_t update_id) {
+  LoadOffset();
+  std::lock_guard<std::mutex> guard(dedup_mutex_);
+  return dedup_.Contains(update_id);
+}
+
+void ClientTelegramBotAPI::MarkHandled(int64_t update_id) {
+  LoadOffset();
+  std::lock_guard<std::mutex> guard(dedup_mutex_);
+  dedup_.Insert(update_id);
+  // окно - килобайт на запись, так что не пишем его на каждый апдейт:
+  // обычно оно уходит с offset-ом батча, а долгий батч сбрасывает его не
+  // чаще раза в flush_interval
+  if (std::chrono::steady_clock::now() - dedup_stored_ <
+      dedup_flush_interval_) {
+    dedup_dirty_ = true;
+    return;
+  }
+  StoreOffset(committed_offset_);
+}
+
+void ClientTelegramBotAPI::StoreOffset(int64_t offset) {
+  committed_offset_ = offset;
+  dedup_.Advance(offset);
+  dedup_dirty_ = false;
+  dedup_stored_ = std::chrono::steady_clock::now();
+  offset_storage_->Store(offset, dedup_.Serialize());
+}
+
+void ClientTelegramBotAPI::StoreDirtyWindow() {
+  std::lock_guard<std::mutex> guard(dedup_mutex_);
+  if (dedup_dirty_) {
+    StoreOffset(committed_offset_);
+  }
+}
+
+ClientTelegramBotAPI::~ClientTelegramBotAPI() {
+  try {
+    StoreDirtyWindow();
+  } catch (const std::exception &e) {
+    std::cerr << "can't store dedup window: " << e.what() << std::endl;
+  }
+}
+
+bool ClientTelegramBotAPI::Shutdown(
+    std::chrono::steady_clock::time_point deadline) {
+  bool drained = true;
+  // зовётся, когда обработчики уже не ставят новых сообщений, так что
+  // send_queue_ больше не создаётся параллельно
+  if (send_queue_ != nullptr) {
+    drained = send_queue_->Drain(deadline);
+    if (drained) {
+      send_queue_->Stop();
+    } else {
+      send_queue_->Cancel();
+    }
+  }
+  StoreDirtyWindow();
+  offset_storage_->Flush();
+  return drained;
+}
+
+void ClientTelegramBotAPI::SetOffset() {
+  if (offset_ != stored_offset_) {
+    std::lock_guard<std::mutex> guard(dedup_mutex_);
+    StoreOffset(offset_);
+    stored_offset_ = offset_;
+  }
+}
+
+void ClientTelegramBotAPI::LoadOffset() {
+  std::call_once(offset_once_, [this] { GetOffset(); });
+}
+
+void ClientTelegramBotAPI::GetOffset() {
+  std::string window;
+  offset_ = offset_storage_->Load(&window);
+  stored_offset_ = offset_;
+  std::lock_guard<std::mutex> guard(dedup_mutex_);
+  committed_offset_ = offset_;
+  if (!dedup_.Parse(window)) {
+    std::cerr << "ignoring corrupted dedup window in " << offset_file_name_
+              << std::endl;
   }
+  dedup_.Advance(offset_);
 }
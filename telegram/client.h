@@ -1,12 +1,27 @@
 // #pragma once
+#include <chrono>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
+#include "broadcast.h"
+#include "dedup_window.h"
+#include "offset_storage.h"
+#include "retry.h"
+#include "send_queue.h"
+#include "session_pool.h"
+#include "tracing.h"
+#include "update_journal.h"
+#include "transport.h"
+#include "update_decoder.h"
+
 struct TelegramAPIError;
 
 class AbstractCPPClass {
@@ -14,39 +29,227 @@ public:
   virtual ~AbstractCPPClass() = default;
 };
 
+// текст сообщения и команды - это view в арену батча (UpdateBatch), так что
+// сообщение не владеет строками и валидно, пока жив его батч
 class NewMessage : public AbstractCPPClass {
 public:
-  NewMessage(int64_t chat_id, int64_t message_id, std::string text,
-             std::vector<std::string> commands);
+  NewMessage(int64_t update_id, int64_t chat_id, int64_t message_id,
+             std::string_view text,
+             std::pmr::vector<std::string_view> commands);
 
-  bool AreCommandsInText();
-  std::vector<std::string> &Commands();
-  std::string GetText();
-  int64_t GetChatId();
+  bool AreCommandsInText() const;
+  const std::pmr::vector<std::string_view> &Commands() const;
+  std::string_view GetText() const;
+  int64_t GetChatId() const;
   void SetCommandsChecker(bool are_there_commands);
-  int64_t GetMessageId();
+  int64_t GetMessageId() const;
+  int64_t GetUpdateId() const;
+  TraceId Trace() const;
+  void SetTrace(TraceId trace);
+  // trace_id апдейта, 0 - не сэмплирован
 
 private:
+  int64_t update_id_;
   int64_t chat_id_;
   int64_t message_id_;
 
-  std::string text_;
-  std::vector<std::string> commands_;
+  std::string_view text_;
+  std::pmr::vector<std::string_view> commands_;
   bool are_there_commands_;
+  TraceId trace_ = 0;
+};
+
+// пользователь исправил сообщение: поля те же, но свой тип в Update, чтобы
+// команды из правок не выполнялись второй раз как новые; в старый
+// GetUpdates правки не попадают
+class EditedMessage : public NewMessage {
+public:
+  using NewMessage::NewMessage;
+};
+
+// нажатие inline-кнопки; id и data - view в арену батча, как текст
+// сообщения
+class CallbackQuery : public AbstractCPPClass {
+public:
+  CallbackQuery(int64_t update_id, std::string_view id, std::string_view data,
+                int64_t from_id, int64_t chat_id, int64_t message_id);
+
+  std::string_view GetId() const;
+  // для AnswerCallbackQuery
+  std::string_view GetData() const;
+  int64_t GetFromId() const;
+  int64_t GetChatId() const;
+  int64_t GetMessageId() const;
+  // сообщение с кнопкой; 0, если оно отправлено в inline-режиме
+  int64_t GetUpdateId() const;
+  TraceId Trace() const;
+  void SetTrace(TraceId trace);
+
+private:
+  int64_t update_id_;
+  std::string_view id_;
+  std::string_view data_;
+  int64_t from_id_;
+  int64_t chat_id_;
+  int64_t message_id_;
+  TraceId trace_ = 0;
+};
+
+using Update = std::variant<NewMessage, EditedMessage, CallbackQuery>;
+// тип апдейта определяется индексом variant, без dynamic_cast
+
+int64_t UpdateId(const Update &update);
+TraceId UpdateTrace(const Update &update);
+int64_t UpdateChatId(const Update &update);
+
+// все апдейты одного getUpdates в одной арене: тексты, команды и сами
+// апдейты выделяются из monotonic_buffer_resource и освобождаются разом
+class UpdateBatch {
+public:
+  explicit UpdateBatch(size_t initial_arena_size = kInitialArenaSize);
+  UpdateBatch(const UpdateBatch &) = delete;
+  UpdateBatch &operator=(const UpdateBatch &) = delete;
+
+  std::string_view CopyText(std::string_view text);
+  // скопировать строку в арену
+  std::pmr::memory_resource *Arena();
+
+  TraceId Add(const DecodedUpdate &update);
+  // перенести разобранный апдейт в арену (неизвестные типы пропускаются),
+  // вернуть его trace_id: 0 - не сэмплирован или пропущен
+
+  template <class T, class... Args> T &Emplace(Args &&...args) {
+    return std::get<T>(updates_.emplace_back(std::in_place_type<T>,
+                                             std::forward<Args>(args)...));
+  }
+
+  const std::pmr::vector<Update> &Updates() const { return updates_; }
+  std::pmr::vector<Update>::iterator begin() { return updates_.begin(); }
+  std::pmr::vector<Update>::iterator end() { return updates_.end(); }
+  std::pmr::vector<Update>::const_iterator begin() const {
+    return updates_.begin();
+  }
+  std::pmr::vector<Update>::const_iterator end() const {
+    return updates_.end();
+  }
+  size_t Size() const { return updates_.size(); }
+  bool Empty() const { return updates_.empty(); }
+
+  int64_t NextOffset() const { return next_offset_; }
+  void SetNextOffset(int64_t next_offset) { next_offset_ = next_offset; }
+  // offset, который нужно сохранить после обработки батча
+
+private:
+  static constexpr size_t kInitialArenaSize = 16 * 1024;
+
+  std::pmr::monotonic_buffer_resource arena_;
+  std::pmr::vector<Update> updates_;
+  int64_t next_offset_ = 0;
+};
+
+// inline-клавиатура под сообщением: ряды кнопок, нажатие приходит
+// CallbackQuery с callback_data кнопки (до 64 байт)
+struct InlineButton {
+  std::string text;
+  std::string callback_data;
 };
+
+using InlineKeyboard = std::vector<std::vector<InlineButton>>;
+
 // если мы хотим, чтобы наш API работал ещё с какими-то командами, запросами или
 // ещё чем, то нужно создать классы с++ и отнаследовать их к JsonToCPP дальше
 // работаем со smart-ptr от них
 
 class ClientTelegramBotAPI {
 public:
-  ClientTelegramBotAPI(const std::string &token, const std::string &uri);
+  struct Options {
+    std::shared_ptr<SessionPool> session_pool;
+    // общий пул соединений для нескольких ботов; nullptr - свой пул
+    std::shared_ptr<Transport> transport;
+    // nullptr - PocoTransport поверх session_pool; LoopbackTransport
+    // отвечает из того же процесса
+    std::shared_ptr<RateLimiter> rate_limiter;
+    // nullptr - свой лимитер (лимиты telegram считаются на токен)
+    std::string offset_file_name = "offset.txt";
+    OffsetStorage::Options offset;
+    // flush_interval ещё и ограничивает запись окна в MarkHandled
+    std::shared_ptr<FileIdCache> file_ids;
+    // file_id загруженных фото; nullptr - свой кэш в памяти
+    size_t updates_limit = 100;
+    // параметр limit getUpdates (1..100)
+    size_t batch_bytes = size_t(4) << 20;
+    // бюджет арены одного батча: апдейты сверх него остаются на сервере
+    // до следующего getUpdates (хотя бы один апдейт берём всегда), так что
+    // память после простоя не растёт вместе с очередью апдейтов
+    std::shared_ptr<UpdateJournal> journal;
+    // писать непустые ответы getUpdates для bot-run replay; тело тогда
+    // читается целиком до разбора
+    std::shared_ptr<PollAbort> poll_abort;
+    // прервать getUpdates из другого потока (TelegramBot::Stop): текущий и
+    // следующие бросают PollAborted без повторов; nullptr - нельзя
+  };
+
+  ClientTelegramBotAPI(const std::string &token, const std::string &uri,
+                       OffsetStorage::Options offset_options = {});
+  ClientTelegramBotAPI(const std::string &token, const std::string &uri,
+                       Options options);
 
-  ~ClientTelegramBotAPI() = default;
+  ~ClientTelegramBotAPI();
+  // дописывает окно дедупликации, отложенное MarkHandled
 
   bool GetMe();
 
+  void Warmup(size_t connections);
+  // подготовка к работе, шаги параллельно: чтение offset с диска и
+  // DNS -> getMe (проверка токена, первое TLS соединение) -> ещё
+  // connections - 1 соединений в пул с TLS resumption; ошибки (в том числе
+  // TelegramAPIError(401) для отозванного токена) пробрасываются
+
   std::vector<std::shared_ptr<AbstractCPPClass>> GetUpdates(int timeout = 0);
+  // совместимый вариант: указатели держат общий батч (aliasing shared_ptr);
+  // правок (EditedMessage) здесь нет - старый код принял бы их за новые
+  // сообщения через dynamic_pointer_cast<NewMessage>
+
+  std::shared_ptr<UpdateBatch> GetUpdateBatch(int timeout = 0);
+  // все апдейты в одной арене, освобождается вместе с последней ссылкой
+  std::shared_ptr<UpdateBatch> GetUpdateBatch(int timeout, size_t limit);
+  // limit вместо Options::updates_limit (PollController)
+
+  void SetAutoCommitOffset(bool auto_commit);
+  // по умолчанию offset сохраняется сразу после разбора батча; если
+  // обработка идёт асинхронно, отключаем и вызываем CommitOffset сами -
+  // тогда getUpdates шлёт последний сохранённый offset
+
+  void CommitOffset(int64_t offset);
+  // сохранить offset обработанного батча (можно звать из любого потока)
+
+  bool Handled(int64_t update_id);
+  void MarkHandled(int64_t update_id);
+  // окно дедупликации: апдейты батча, обработанные до падения бота, после
+  // перезапуска придут снова (offset ещё не сохранён), но обрабатывать их
+  // второй раз не нужно; окно пишется вместе с offset-ом в CommitOffset,
+  // а из MarkHandled - не чаще раза в Options::offset.flush_interval
+
+  bool Shutdown(std::chrono::steady_clock::time_point deadline);
+  // дослать очередь SendMessageAsync до deadline (остаток завершается
+  // ошибкой) и сбросить offset на диск; false, если что-то не отправили
+
+  void SetWebhook(const std::string &url, const std::string &secret_token);
+  void DeleteWebhook();
+  // переключение между webhook и getUpdates (одновременно нельзя)
+
+  static std::string FormSendMessageJson(int64_t chat_id,
+                                         const std::string &text,
+                                         int64_t reply_to = -1);
+  static void WriteSendMessageJson(std::string &out, int64_t chat_id,
+                                   const std::string &text,
+                                   int64_t reply_to = -1);
+  // тело запроса sendMessage; Write* пишет в переиспользуемый буфер out
+
+  static std::string OffsetFileName(const std::string &directory,
+                                    const std::string &token);
+  // файл offset-а бота в directory, по id бота из токена ("<id>.offset"),
+  // чтобы секрет не попадал в имя файла
 
   void SendMessage(int64_t chat_id, std::string response,
                    int64_t message_id = -1);
@@ -54,28 +257,146 @@ public:
   // используем шаблон, смотрим что там может быть, делаем по нему Json и
   // отправляем на сервер
 
+  std::future<SentMessage> SendMessageAsync(int64_t chat_id, std::string text,
+                                            int64_t reply_to = -1);
+  void SendMessageAsync(int64_t chat_id, std::string text, int64_t reply_to,
+                        SendCallback callback);
+  // ставит сообщение в очередь отправки и сразу возвращается; очередь и её
+  // потоки создаются при первом вызове
+
+  void SendPhoto(int64_t chat_id, const std::string &photo,
+                 const std::string &caption = "", int64_t reply_to = -1);
+  // photo - путь к локальному файлу (загружается один раз, дальше уходит
+  // по file_id из кэша), file_id или url
+
+  void SendKeyboard(int64_t chat_id, const std::string &text,
+                    const InlineKeyboard &keyboard, int64_t reply_to = -1);
+  // сообщение с inline-клавиатурой (reply_markup)
+
+  void EditMessageText(int64_t chat_id, int64_t message_id,
+                       const std::string &text,
+                       const InlineKeyboard &keyboard = {});
+  // заменить текст (и клавиатуру) отправленного ботом сообщения, например
+  // того, на кнопку которого нажали
+
+  void AnswerCallbackQuery(std::string_view callback_query_id,
+                           const std::string &text = "",
+                           bool show_alert = false);
+  // ответ на нажатие кнопки: без него клиент telegram крутит индикатор
+  // загрузки на кнопке; text - всплывающее уведомление
+
+  BroadcastReport Broadcast(const std::vector<int64_t> &chat_ids,
+                            const BroadcastPayload &payload,
+                            const BroadcastOptions &options = {});
+  // разослать payload по chat_ids через очередь SendMessageAsync (с её
+  // лимитами и параллельностью) и дождаться результатов
+
 private:
+  static constexpr int kLongPollTimeoutMargin = 10;
+  // запас к timeout long-poll, чтобы сокет не отваливался раньше сервера
+  static constexpr int kRequestTimeout = 10;
+  // таймаут обычных запросов, чтобы зависшее соединение не держало воркер
+  static constexpr size_t kAsyncSenders = 4;
+  static constexpr size_t kAsyncQueueCapacity = 4096;
+  static constexpr size_t kMaxUpdatesLimit = 100;
+  // и значение limit по умолчанию у telegram, его не передаём
+
   const std::string token_;
   const std::string uri_;
-  int64_t offset_;
+  std::shared_ptr<Transport> transport_;
+  // keep-alive соединения, общие для всех запросов клиента
+  std::string method_path_;
+  // "/bot<token>/", к нему дописывается имя метода
+  std::string get_updates_path_;
+  std::string send_message_path_;
+  std::string get_me_path_;
+  std::string send_photo_path_;
+  std::string edit_message_path_;
+  std::string answer_callback_path_;
+  // пути методов считаются в конструкторе, а не собираются на каждый запрос
+  std::shared_ptr<RateLimiter> rate_limiter_;
+  // лимиты telegram на отправку (общий и на чат)
+  RetryPolicy retry_policy_;
+  CircuitBreaker circuit_breaker_;
+  // ретраи 429/5xx/сетевых ошибок и защита API во время аварий
+  int64_t offset_ = 0;
+  int64_t stored_offset_ = 0;
+  std::once_flag offset_once_;
+  // offset читается с диска при первом getUpdates или в Warmup, а не в
+  // конструкторе
+  bool auto_commit_offset_ = true;
   std::string offset_file_name_;
+  std::unique_ptr<OffsetStorage> offset_storage_;
+  std::mutex dedup_mutex_;
+  DedupWindow dedup_;
+  int64_t committed_offset_ = 0;
+  bool dedup_dirty_ = false;
+  std::chrono::steady_clock::time_point dedup_stored_;
+  std::chrono::milliseconds dedup_flush_interval_;
+  // под dedup_mutex_: окно и offset в файле меняются вместе, иначе запись
+  // из соседнего потока может вернуть на диск устаревшее окно
+  std::shared_ptr<FileIdCache> file_ids_;
+  size_t updates_limit_ = kMaxUpdatesLimit;
+  size_t batch_bytes_ = 0;
+  std::shared_ptr<UpdateJournal> journal_;
+  std::shared_ptr<PollAbort> poll_abort_;
+  UpdateDecoder update_decoder_;
+  // потоковый разбор getUpdates, буферы живут между запросами
+  std::once_flag send_queue_once_;
+  std::unique_ptr<SendQueue> send_queue_;
+  // объявлена после transport_, поэтому останавливается раньше него
+
+  template <class Call> auto WithRetries(Call &&call, bool idempotent = false);
+  // повторяет call с backoff, пока ошибка временная и не кончились попытки;
+  // при открытом circuit breaker сразу бросает TelegramAPIError(503)
+  // повторяются 429, 5xx и запросы, которые не ушли (RequestNotSent); обрыв
+  // и таймаут после отправки - только для idempotent вызовов; PollAborted
+  // не повторяется и не считается отказом
+
+  std::shared_ptr<UpdateBatch> FetchUpdateBatch(int timeout, size_t limit);
+  void PostJson(std::string_view path, const std::string &data,
+                bool idempotent = false);
+  // POST application/json на path метода, ответ только проверяется и
+  // дочитывается
+  SentMessage DoSendMessage(int64_t chat_id, const std::string &text,
+                            int64_t reply_to);
+  SentMessage DoSendPhoto(int64_t chat_id, const std::string &photo,
+                          const std::string &caption, int64_t reply_to);
+  SentMessage PostPhoto(int64_t chat_id, const std::string &content_type,
+                        const std::string &body, std::string *file_id);
+  // тело уже собрано (json с file_id или multipart с файлом); file_id
+  // загруженного фото возвращается из ответа
+  SendQueue &AsyncSendQueue();
+  std::unique_ptr<TransportExchange> OpenGetMe(ApiCallTimer &timer);
+  bool FinishGetMe(TransportExchange &exchange, ApiCallTimer &timer);
+  // getMe по частям: пока ответ не дочитан, соединение занято (Warmup)
 
-  std::vector<std::shared_ptr<AbstractCPPClass>>
-  FormCppStructFromJson(std::istream &response_body);
-  // делает с++ структуру из json, берём один объект из getUpdates
+  void FormCppStructFromJson(std::istream &response_body, UpdateBatch &batch,
+                             JournalCapture *capture = nullptr);
+  // делает с++ структуры из потока json ответа getUpdates; capture
+  // откладывает для журнала принятые в батч апдейты
 
   void SetOffset();
-  // изменить offset в файле
+  // сохранить offset, один раз на батч getUpdates
+  void StoreOffset(int64_t offset);
+  // записать offset и окно; зовётся под dedup_mutex_
+  void StoreDirtyWindow();
+  // записать окно, если MarkHandled отложил запись
   void GetOffset();
   // получить offset из файла
+  void LoadOffset();
+  // GetOffset один раз за время жизни клиента
 };
 
 struct TelegramAPIError : public std::runtime_error {
-  TelegramAPIError(int error_code, const std::string &details)
+  TelegramAPIError(int error_code, const std::string &details,
+                   int retry_after = 0)
       : std::runtime_error("api error: code=" + std::to_string(error_code) +
                            " details=" + details),
-        http_code(error_code), details(details) {}
+        http_code(error_code), details(details), retry_after(retry_after) {}
 
   int http_code;
   std::string details;
+  int retry_after;
+  // parameters.retry_after из ответа (секунды), 0 если сервер не прислал
 };
@@ -0,0 +1,113 @@
+#include "dedup_window.h"
+
+#include <charconv>
+
+namespace {
+
+const char kHexDigits[] = "0123456789abcdef";
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+} // namespace
+
+bool DedupWindow::Test(int64_t update_id) const {
+  uint64_t bit = static_cast<uint64_t>(update_id) % kBits;
+  return (bits_[bit / 64] >> (bit % 64)) & 1;
+}
+
+bool DedupWindow::Contains(int64_t update_id) const {
+  if (update_id < base_ || update_id >= base_ + kBits) {
+    return false;
+  }
+  return Test(update_id);
+}
+
+void DedupWindow::Insert(int64_t update_id) {
+  if (update_id < base_) {
+    return;
+  }
+  if (update_id >= base_ + kBits) {
+    Advance(update_id - kBits + 1);
+  }
+  uint64_t bit = static_cast<uint64_t>(update_id) % kBits;
+  bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+void DedupWindow::Advance(int64_t base) {
+  if (base <= base_) {
+    return;
+  }
+  if (base - base_ >= kBits) {
+    bits_.fill(0);
+    base_ = base;
+    return;
+  }
+  for (; base_ < base; ++base_) {
+    uint64_t bit = static_cast<uint64_t>(base_) % kBits;
+    bits_[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+  }
+}
+
+std::string DedupWindow::Serialize() const {
+  std::string data = std::to_string(base_);
+  int64_t last = kBits - 1;
+  while (last >= 0 && !Test(base_ + last)) {
+    --last;
+  }
+  if (last < 0) {
+    return data;
+  }
+  data.push_back(' ');
+  for (int64_t idx = 0; idx <= last; idx += 4) {
+    int digit = 0;
+    for (int64_t nibble = 0; nibble < 4 && idx + nibble <= last; ++nibble) {
+      digit |= Test(base_ + idx + nibble) << nibble;
+    }
+    data.push_back(kHexDigits[digit]);
+  }
+  return data;
+}
+
+bool DedupWindow::Parse(std::string_view data) {
+  bits_.fill(0);
+  base_ = 0;
+  if (data.empty()) {
+    return true;
+  }
+  int64_t base = 0;
+  auto [end, error] = std::from_chars(data.data(), data.data() + data.size(),
+                                      base);
+  if (error != std::errc() || base < 0) {
+    return false;
+  }
+  std::string_view hex = data.substr(end - data.data());
+  if (!hex.empty()) {
+    if (hex[0] != ' ' || hex.size() - 1 > kBits / 4) {
+      return false;
+    }
+    hex.remove_prefix(1);
+  }
+  base_ = base;
+  for (size_t idx = 0; idx < hex.size(); ++idx) {
+    int digit = HexValue(hex[idx]);
+    if (digit < 0) {
+      bits_.fill(0);
+      base_ = 0;
+      return false;
+    }
+    for (int nibble = 0; nibble < 4; ++nibble) {
+      if ((digit >> nibble) & 1) {
+        Insert(base_ + static_cast<int64_t>(idx) * 4 + nibble);
+      }
+    }
+  }
+  return true;
+}
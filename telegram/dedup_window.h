@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// недавно обработанные update_id: битмап на kBits апдейтов, начиная с base,
+// хранится кольцом (бит update_id % kBits), так что сдвиг окна - это
+// обнуление пройденных битов, без копирования
+// base - сохранённый offset: апдейты ниже него telegram больше не пришлёт
+// не потокобезопасно, синхронизирует владелец (ClientTelegramBotAPI)
+class DedupWindow {
+public:
+  static constexpr int64_t kBits = 4096;
+
+  bool Contains(int64_t update_id) const;
+  // false и для апдейтов за пределами окна: их обработаем ещё раз
+
+  void Insert(int64_t update_id);
+  // если update_id дальше окна, оно сдвигается и забывает самые старые
+
+  void Advance(int64_t base);
+  // offset сохранён, всё ниже base можно забыть
+
+  int64_t Base() const { return base_; }
+
+  std::string Serialize() const;
+  // "<base> <hex>", i-й бит hex - update_id base + i, хвостовые нули
+  // отброшены, так что окно без обработанных апдейтов - это одно число
+  bool Parse(std::string_view data);
+  // false, если строка испорчена (окно тогда пустое); пустая строка -
+  // пустое окно
+
+private:
+  static constexpr size_t kWords = kBits / 64;
+
+  bool Test(int64_t update_id) const;
+
+  std::array<uint64_t, kWords> bits_{};
+  int64_t base_ = 0;
+};
@@ -1,14 +1,27 @@
 #include "fake.h"
 #include "fake_data.h"
-
+#include "json_reader.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <mutex>
+#include <random>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 #include <Poco/URI.h>
 
 #include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPServerParams.h>
 #include <Poco/Net/HTTPServerRequest.h>
 #include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/SocketAddress.h>
@@ -24,18 +37,29 @@ class CheckFailedException : public std::exception {};
 
 class TestCase {
 public:
+  virtual ~TestCase() = default;
+
   virtual void HandleRequest(HTTPServerRequest &request,
                              HTTPServerResponse &response) = 0;
 
+  virtual bool Serialized() const { return true; }
+  // сценарии по шагам обрабатывают запросы по одному под Mutex
+
+  virtual BenchmarkStats Stats() const { return {}; }
+
   std::mutex Mutex;
 
   std::vector<std::string> Expectations;
   int Fulfilled = 0;
 
+  std::mutex FailsMutex;
   std::vector<std::string> Fails;
 
   void Fail(const std::string &message) {
-    Fails.push_back(message);
+    {
+      std::lock_guard<std::mutex> guard(FailsMutex);
+      Fails.push_back(message);
+    }
     throw CheckFailedException();
   }
 
@@ -256,13 +280,421 @@ public:
   }
 };
 
+class RetryGetUpdatesTestCase : public TestCase {
+public:
+  RetryGetUpdatesTestCase() {
+    Expectations = {
+        "Client sends getUpdates request and receives Bad Gateway",
+        "Client retries getUpdates and receives Too Many Requests",
+        "Client retries getUpdates after retry_after and receives 0 messages"};
+  }
+
+  void HandleRequest(HTTPServerRequest &request,
+                     HTTPServerResponse &response) override {
+    ExpectURI(request, "/bot123/getUpdates");
+    ExpectMethod(request, "GET");
+
+    ++Fulfilled;
+    if (Fulfilled == 1) {
+      response.setStatus(HTTPResponse::HTTP_BAD_GATEWAY);
+      response.send() << "Bad gateway";
+    } else if (Fulfilled == 2) {
+      LastRequest = std::chrono::steady_clock::now();
+      response.setStatus(HTTPResponse::HTTP_TOO_MANY_REQUESTS);
+      response.send() << FakeData::TooManyRequestsJson;
+    } else if (Fulfilled == 3) {
+      if (std::chrono::steady_clock::now() - LastRequest <
+          std::chrono::seconds(1)) {
+        Fail("retry_after was not honored");
+      }
+      response.setStatus(HTTPResponse::HTTP_OK);
+      response.send() << FakeData::GetUpdatesZeroMessages;
+    } else {
+      Fail("Unexpected extra request");
+    }
+  }
+
+private:
+  std::chrono::steady_clock::time_point LastRequest;
+};
+
+class KeepAliveTestCase : public TestCase {
+public:
+  KeepAliveTestCase() {
+    Expectations = {"Client sends getMe request",
+                    "Client sends getMe request over the same connection"};
+  }
+
+  void HandleRequest(HTTPServerRequest &request,
+                     HTTPServerResponse &response) override {
+    ExpectURI(request, "/bot123/getMe");
+    ExpectMethod(request, "GET");
+
+    ++Fulfilled;
+    if (Fulfilled == 1) {
+      ClientAddress = request.clientAddress().toString();
+    } else if (Fulfilled == 2) {
+      if (request.clientAddress().toString() != ClientAddress) {
+        Fail("Connection was not reused: expected " + ClientAddress +
+             ", got " + request.clientAddress().toString());
+      }
+    } else {
+      Fail("Unexpected extra request");
+    }
+
+    response.setStatus(HTTPResponse::HTTP_OK);
+    response.send() << FakeData::GetMeJson;
+  }
+
+private:
+  std::string ClientAddress;
+};
+
+// сервер закрыл простаивающее keep-alive соединение (KeepAliveTimeout):
+// sendMessage не должен потеряться на протухшем сокете из пула
+class StaleKeepAliveTestCase : public TestCase {
+public:
+  StaleKeepAliveTestCase() {
+    Expectations = {"Client sends sendMessage request",
+                    "Client sends sendMessage request after the server closed "
+                    "the idle connection"};
+  }
+
+  void HandleRequest(HTTPServerRequest &request,
+                     HTTPServerResponse &response) override {
+    ExpectURI(request, "/bot123/sendMessage");
+    ExpectMethod(request, "POST");
+
+    ++Fulfilled;
+    if (Fulfilled > 2) {
+      Fail("Unexpected extra request");
+    }
+
+    response.setStatus(HTTPResponse::HTTP_OK);
+    response.send() << FakeData::SendMessageHiJson;
+  }
+};
+
+// рассылка: sendMessage по всем чатам (чат 403 заблокировал бота) и фото,
+// которое должно загрузиться один раз, а дальше уходить по file_id
+class BroadcastTestCase : public TestCase {
+public:
+  BroadcastTestCase() {
+    Expectations = {"Client uploads the photo once",
+                    "Client sends the photo by file_id"};
+  }
+
+  void HandleRequest(HTTPServerRequest &request,
+                     HTTPServerResponse &response) override {
+    ExpectMethod(request, "POST");
+    std::string path = URI(request.getURI()).getPath();
+    const std::string &type = request.getContentType();
+    std::string body(std::istreambuf_iterator<char>(request.stream()), {});
+
+    if (path == "/bot123/sendPhoto" && type.rfind("multipart/", 0) == 0) {
+      if (Fulfilled != 0) {
+        Fail("Photo was uploaded more than once");
+      }
+      if (body.find("name=\"photo\"") == std::string::npos ||
+          body.find("photo-bytes") == std::string::npos) {
+        Fail("Multipart body has no photo");
+      }
+      Fulfilled = 1;
+      response.setStatus(HTTPResponse::HTTP_OK);
+      response.send() << R"({"ok":true,"result":{"message_id":1,"photo":[)"
+                      << R"({"file_id":"small"},{"file_id":"cached-id"}]}})";
+      return;
+    }
+
+    int64_t chatId = 0;
+    std::string photo;
+    std::istringstream input(body);
+    JsonReader reader(input);
+    reader.BeginObject();
+    while (reader.NextKey()) {
+      if (reader.Key() == "chat_id") {
+        chatId = reader.ReadInt();
+      } else if (reader.Key() == "photo") {
+        reader.ReadString(photo);
+      } else {
+        reader.Skip();
+      }
+    }
+
+    if (path == "/bot123/sendPhoto") {
+      if (photo != "cached-id") {
+        Fail("Photo is sent without the cached file_id: " + photo);
+      }
+      Fulfilled = std::max(Fulfilled, 2);
+    } else if (path != "/bot123/sendMessage") {
+      Fail("Unexpected path " + path);
+    }
+
+    if (chatId == 403) {
+      response.setStatus(HTTPResponse::HTTP_FORBIDDEN);
+      response.send() << R"({"ok":false,"error_code":403,)"
+                      << R"("description":"Forbidden: bot was blocked"})";
+      return;
+    }
+    response.setStatus(HTTPResponse::HTTP_OK);
+    response.send() << R"({"ok":true,"result":{"message_id":1,"chat":{"id":)"
+                    << chatId << "}}}";
+  }
+};
+
+class BenchmarkTestCase : public TestCase {
+public:
+  BenchmarkTestCase(const FakeOptions &options)
+      : Options(options), Started(std::chrono::steady_clock::now()) {}
+
+  bool Serialized() const override { return false; }
+
+  void HandleRequest(HTTPServerRequest &request,
+                     HTTPServerResponse &response) override {
+    auto received = std::chrono::steady_clock::now();
+    if (Options.Latency.count() > 0) {
+      std::this_thread::sleep_for(Options.Latency);
+    }
+    if (Options.ErrorRate > 0 && Random() < Options.ErrorRate) {
+      ++InjectedErrors;
+      request.stream().ignore(std::numeric_limits<std::streamsize>::max());
+      response.setStatus(HTTPResponse::HTTP_BAD_GATEWAY);
+      response.send() << "Bad gateway";
+      return;
+    }
+
+    // токен в пути любой, так что сценарий годится и для нескольких ботов
+    std::string path = URI(request.getURI()).getPath();
+    std::string method = path.substr(path.rfind('/') + 1);
+    if (method == "getUpdates") {
+      ServeUpdates(request, response);
+    } else if (method == "sendMessage") {
+      AcceptMessage(request, response);
+      SendMessageUs.Record(MicrosSince(received));
+    } else if (method == "getMe") {
+      response.setStatus(HTTPResponse::HTTP_OK);
+      response.send() << FakeData::GetMeJson;
+    } else {
+      Fail("Unexpected request " + path);
+    }
+  }
+
+  BenchmarkStats Stats() const override {
+    BenchmarkStats stats;
+    stats.GetUpdatesRequests = GetUpdatesRequests;
+    stats.UpdatesServed = UpdatesServed;
+    stats.CommandsServed = CommandsServed;
+    stats.SendMessageRequests = SendMessageRequests;
+    stats.RepliesReceived = RepliesReceived;
+    stats.InjectedErrors = InjectedErrors;
+    Histogram::Snapshot reaction = ReactionUs.Read();
+    stats.ReactionP50Us = reaction.Percentile(0.5);
+    stats.ReactionP99Us = reaction.Percentile(0.99);
+    stats.ReactionMaxUs = reaction.Percentile(1.0);
+    Histogram::Snapshot send = SendMessageUs.Read();
+    stats.SendMessageP50Us = send.Percentile(0.5);
+    stats.SendMessageP99Us = send.Percentile(0.99);
+    return stats;
+  }
+
+private:
+  static constexpr size_t kChatShards = 64;
+
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  struct ChatShard {
+    std::mutex Mutex;
+    std::unordered_map<int64_t, std::deque<TimePoint>> Pending;
+    // когда отдали ещё не отвеченные команды чата, по порядку
+  };
+
+  static double Random() {
+    thread_local std::mt19937_64 generator(
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    return std::uniform_real_distribution<double>(0, 1)(generator);
+  }
+
+  ChatShard &Shard(int64_t chatId) {
+    return Chats[static_cast<uint64_t>(chatId) % kChatShards];
+  }
+
+  // сколько апдейтов можно отдать сейчас; если нечего (ограничен темп или
+  // кончились TotalUpdates), ждёт до timeout секунд, как настоящий long-poll
+  int64_t TakeUpdates(int64_t offset, int timeout, int64_t limit,
+                      int64_t &firstId) {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    while (true) {
+      {
+        std::lock_guard<std::mutex> guard(UpdatesMutex);
+        NextUpdateId = std::max(NextUpdateId, offset);
+        int64_t count = std::min<int64_t>(Options.BatchSize, limit);
+        if (Options.UpdatesPerSecond > 0) {
+          double elapsed = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - Started)
+                               .count();
+          int64_t allowed =
+              static_cast<int64_t>(elapsed * Options.UpdatesPerSecond);
+          count = std::min(count, allowed - Issued);
+        }
+        if (Options.TotalUpdates > 0) {
+          count = std::min(count, Options.TotalUpdates - Issued);
+        }
+        if (count > 0 || std::chrono::steady_clock::now() >= deadline) {
+          count = std::max<int64_t>(count, 0);
+          firstId = NextUpdateId;
+          NextUpdateId += count;
+          Issued += count;
+          return count;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  void ServeUpdates(HTTPServerRequest &request, HTTPServerResponse &response) {
+    ++GetUpdatesRequests;
+    int64_t offset = 0;
+    int timeout = 0;
+    int64_t limit = 100;
+    URI uri(request.getURI());
+    for (const auto &[key, value] : uri.getQueryParameters()) {
+      if (key == "offset") {
+        offset = std::stoll(value);
+      } else if (key == "timeout") {
+        timeout = std::stoi(value);
+      } else if (key == "limit") {
+        limit = std::stoll(value);
+      }
+    }
+
+    int64_t firstId = 0;
+    int64_t count = TakeUpdates(offset, timeout, limit, firstId);
+
+    std::string body = "{\"ok\":true,\"result\":[";
+    std::vector<int64_t> commandChats;
+    for (int64_t updateId = firstId; updateId < firstId + count; ++updateId) {
+      int64_t chatId = 1 + updateId % std::max(Options.Chats, 1);
+      bool command =
+          !Options.Commands.empty() && Random() < Options.CommandShare;
+      std::string text =
+          command ? Options.Commands[updateId % Options.Commands.size()]
+                  : "just a message";
+      if (updateId != firstId) {
+        body += ',';
+      }
+      body += "{\"update_id\":" + std::to_string(updateId) +
+              ",\"message\":{\"message_id\":" + std::to_string(updateId) +
+              ",\"date\":0,\"chat\":{\"id\":" + std::to_string(chatId) +
+              ",\"type\":\"private\"},\"text\":\"" + text + "\"";
+      if (command) {
+        body += ",\"entities\":[{\"offset\":0,\"length\":" +
+                std::to_string(text.size()) + ",\"type\":\"bot_command\"}]";
+        commandChats.push_back(chatId);
+      }
+      body += "}}";
+    }
+    body += "]}";
+
+    UpdatesServed += count;
+    CommandsServed += commandChats.size();
+    auto now = std::chrono::steady_clock::now();
+    for (int64_t chatId : commandChats) {
+      ChatShard &shard = Shard(chatId);
+      std::lock_guard<std::mutex> guard(shard.Mutex);
+      shard.Pending[chatId].push_back(now);
+    }
+
+    response.setStatus(HTTPResponse::HTTP_OK);
+    response.setContentType("application/json");
+    response.setContentLength(body.size());
+    response.send() << body;
+  }
+
+  void AcceptMessage(HTTPServerRequest &request, HTTPServerResponse &response) {
+    ++SendMessageRequests;
+    int64_t chatId = 0;
+    std::string text;
+    try {
+      JsonReader reader(request.stream());
+      std::string value;
+      reader.BeginObject();
+      while (reader.NextKey()) {
+        if (reader.Key() == "chat_id") {
+          if (reader.Peek() == '"') {
+            reader.ReadString(value);
+            chatId = std::stoll(value);
+          } else {
+            chatId = reader.ReadInt();
+          }
+        } else if (reader.Key() == "text") {
+          reader.ReadString(text);
+        } else {
+          reader.Skip();
+        }
+      }
+    } catch (const std::exception &e) {
+      Fail(std::string("Invalid sendMessage body: ") + e.what());
+    }
+
+    // склеенные очередью отправки ответы приходят одним сообщением
+    size_t replies = 1 + std::count(text.begin(), text.end(), '\n');
+    auto now = std::chrono::steady_clock::now();
+    {
+      ChatShard &shard = Shard(chatId);
+      std::lock_guard<std::mutex> guard(shard.Mutex);
+      auto pending = shard.Pending.find(chatId);
+      for (size_t idx = 0; idx < replies && pending != shard.Pending.end() &&
+                           !pending->second.empty();
+           ++idx) {
+        ReactionUs.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                              now - pending->second.front())
+                              .count());
+        pending->second.pop_front();
+        ++RepliesReceived;
+      }
+    }
+
+    std::string body = "{\"ok\":true,\"result\":{\"message_id\":" +
+                       std::to_string(++NextMessageId) +
+                       ",\"date\":0,\"chat\":{\"id\":" +
+                       std::to_string(chatId) + ",\"type\":\"private\"}}}";
+    response.setStatus(HTTPResponse::HTTP_OK);
+    response.setContentType("application/json");
+    response.setContentLength(body.size());
+    response.send() << body;
+  }
+
+  const FakeOptions Options;
+  const std::chrono::steady_clock::time_point Started;
+
+  std::mutex UpdatesMutex;
+  int64_t NextUpdateId = 1;
+  int64_t Issued = 0;
+
+  std::array<ChatShard, kChatShards> Chats;
+  std::atomic<int64_t> NextMessageId{0};
+
+  std::atomic<uint64_t> GetUpdatesRequests{0};
+  std::atomic<uint64_t> UpdatesServed{0};
+  std::atomic<uint64_t> CommandsServed{0};
+  std::atomic<uint64_t> SendMessageRequests{0};
+  std::atomic<uint64_t> RepliesReceived{0};
+  std::atomic<uint64_t> InjectedErrors{0};
+  Histogram ReactionUs;
+  Histogram SendMessageUs;
+};
+
 class FakeHandler : public HTTPRequestHandler {
 public:
   FakeHandler(TestCase *testCase) : TestCase_(testCase) {}
 
   virtual void handleRequest(HTTPServerRequest &request,
                              HTTPServerResponse &response) override {
-    std::unique_lock<std::mutex> guard(TestCase_->Mutex);
+    std::unique_lock<std::mutex> guard(TestCase_->Mutex, std::defer_lock);
+    if (TestCase_->Serialized()) {
+      guard.lock();
+    }
     try {
       TestCase_->HandleRequest(request, response);
     } catch (const CheckFailedException &e) {
@@ -290,7 +722,11 @@ private:
   TestCase *TestCase_;
 };
 
-FakeServer::FakeServer(const std::string &testCase) {
+FakeServer::FakeServer(const std::string &testCase)
+    : FakeServer(testCase, FakeOptions()) {}
+
+FakeServer::FakeServer(const std::string &testCase, FakeOptions options)
+    : Options_(std::move(options)) {
   if (testCase == "Single getMe") {
     TestCase_.reset(new SingleGetMeTestCase());
   } else if (testCase == "getMe error handling") {
@@ -299,6 +735,16 @@ FakeServer::FakeServer(const std::string &testCase) {
     TestCase_.reset(new GetUpdatesAndSendMessagesTestCase());
   } else if (testCase == "Handle getUpdates offset") {
     TestCase_.reset(new HandleOffsetTestCase());
+  } else if (testCase == "Retry getUpdates") {
+    TestCase_.reset(new RetryGetUpdatesTestCase());
+  } else if (testCase == "Reuse keep-alive connection") {
+    TestCase_.reset(new KeepAliveTestCase());
+  } else if (testCase == "Stale keep-alive connection") {
+    TestCase_.reset(new StaleKeepAliveTestCase());
+  } else if (testCase == "Broadcast") {
+    TestCase_.reset(new BroadcastTestCase());
+  } else if (testCase == "Benchmark") {
+    TestCase_.reset(new BenchmarkTestCase(Options_));
   } else {
     throw std::runtime_error("Unknown test case name " + testCase);
   }
@@ -307,16 +753,25 @@ FakeServer::FakeServer(const std::string &testCase) {
 FakeServer::~FakeServer() { Stop(); }
 
 void FakeServer::Start() {
-  Socket_.reset(new ServerSocket(SocketAddress("localhost", 8080)));
-
-  Server_.reset(new HTTPServer(new FakeHandlerFactory(TestCase_.get()),
-                               *Socket_, new HTTPServerParams()));
+  Socket_.reset(new ServerSocket(SocketAddress("localhost", Options_.Port)));
+
+  // у стандартного пула Poco максимум 16 потоков, под нагрузку нужен свой
+  Pool_.reset(new ThreadPool(2, std::max(Options_.Threads, 2)));
+  auto *params = new HTTPServerParams();
+  params->setMaxThreads(std::max(Options_.Threads, 2));
+  if (Options_.KeepAliveTimeout.count() > 0) {
+    params->setKeepAliveTimeout(Timespan(
+        0, static_cast<long>(Options_.KeepAliveTimeout.count() * 1000)));
+  }
+  Server_.reset(new HTTPServer(new FakeHandlerFactory(TestCase_.get()), *Pool_,
+                               *Socket_, params));
 
   Server_->start();
 }
 
 std::string FakeServer::GetUrl() {
-  return "http://localhost:" + std::to_string(8080) + "/";
+  uint16_t port = Socket_ ? Socket_->address().port() : Options_.Port;
+  return "http://localhost:" + std::to_string(port) + "/";
 }
 
 void FakeServer::Stop() {
@@ -325,6 +780,7 @@ void FakeServer::Stop() {
 
     Server_.reset();
     Socket_.reset();
+    Pool_.reset();
   }
 }
 
@@ -334,4 +790,6 @@ void FakeServer::StopAndCheckExpectations() {
   TestCase_->Check();
 }
 
+BenchmarkStats FakeServer::Stats() const { return TestCase_->Stats(); }
+
 } // namespace telegram
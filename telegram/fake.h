@@ -1,18 +1,65 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/ServerSocket.h>
+#include <Poco/ThreadPool.h>
 
 namespace telegram {
 
 class TestCase;
 
+// параметры сценария "Benchmark": сервер отдаёт сгенерированные батчи
+// getUpdates и принимает любое число sendMessage параллельно, без общего
+// мьютекса сценария, замеряя время реакции бота на каждую команду
+struct FakeOptions {
+  uint16_t Port = 8080;
+  // 0 - любой свободный, смотри GetUrl
+  int Threads = 16;
+
+  int BatchSize = 100;
+  // апдейтов в одном ответе getUpdates
+  double CommandShare = 1.0;
+  // доля сообщений с командой, остальные - обычный текст
+  std::vector<std::string> Commands = {"/random", "/weather", "/styleguide"};
+  int Chats = 1000;
+  double UpdatesPerSecond = 0;
+  // темп генерации апдейтов, 0 - сколько попросят
+  int64_t TotalUpdates = 0;
+  // после стольких апдейтов getUpdates отвечает пустым батчем, 0 - без конца
+  std::chrono::microseconds Latency{0};
+  // задержка перед каждым ответом
+  double ErrorRate = 0;
+  // доля ответов 502 на любые запросы
+  std::chrono::milliseconds KeepAliveTimeout{0};
+  // сервер закрывает простаивающие соединения, 0 - по умолчанию Poco
+};
+
+struct BenchmarkStats {
+  uint64_t GetUpdatesRequests = 0;
+  uint64_t UpdatesServed = 0;
+  uint64_t CommandsServed = 0;
+  uint64_t SendMessageRequests = 0;
+  uint64_t RepliesReceived = 0;
+  uint64_t InjectedErrors = 0;
+  uint64_t ReactionP50Us = 0;
+  uint64_t ReactionP99Us = 0;
+  uint64_t ReactionMaxUs = 0;
+  // от отдачи команды в getUpdates до прихода ответа в этот чат
+  uint64_t SendMessageP50Us = 0;
+  uint64_t SendMessageP99Us = 0;
+  // обработка sendMessage на сервере (с учётом Latency)
+};
+
 class FakeServer {
 public:
   FakeServer(const std::string &testCase);
+  FakeServer(const std::string &testCase, FakeOptions options);
 
   ~FakeServer();
 
@@ -24,8 +71,13 @@ public:
 
   void StopAndCheckExpectations();
 
+  BenchmarkStats Stats() const;
+  // только для "Benchmark", у остальных сценариев нули
+
 private:
+  FakeOptions Options_;
   std::shared_ptr<TestCase> TestCase_;
+  std::unique_ptr<Poco::ThreadPool> Pool_;
   std::unique_ptr<Poco::Net::ServerSocket> Socket_;
   std::unique_ptr<Poco::Net::HTTPServer> Server_;
 };
@@ -18,6 +18,16 @@ std::string FakeData::GetMeErrorJson = R"(
    "error_code" : 401
 })" + 1;
 
+std::string FakeData::TooManyRequestsJson = R"(
+{
+   "ok" : false,
+   "error_code" : 429,
+   "description" : "Too Many Requests: retry after 1",
+   "parameters" : {
+      "retry_after" : 1
+   }
+})" + 1;
+
 std::string FakeData::GetUpdatesFourMessagesJson = R"(
 {
    "result" : [
@@ -6,6 +6,7 @@ struct FakeData {
   static std::string GetMeJson;
 
   static std::string GetMeErrorJson;
+  static std::string TooManyRequestsJson;
 
   static std::string GetUpdatesFourMessagesJson;
   static std::string SendMessageHiJson;
@@ -1,19 +1,71 @@
 #include "fake.h"
 #include <iostream>
+#include <string>
+
+namespace {
+
+void PrintStats(const telegram::BenchmarkStats &stats) {
+  std::cout << "getUpdates requests: " << stats.GetUpdatesRequests << std::endl
+            << "updates served: " << stats.UpdatesServed
+            << " (commands: " << stats.CommandsServed << ")" << std::endl
+            << "sendMessage requests: " << stats.SendMessageRequests
+            << " (replies: " << stats.RepliesReceived << ")" << std::endl
+            << "injected errors: " << stats.InjectedErrors << std::endl
+            << "reaction us p50/p99/max: " << stats.ReactionP50Us << "/"
+            << stats.ReactionP99Us << "/" << stats.ReactionMaxUs << std::endl
+            << "sendMessage us p50/p99: " << stats.SendMessageP50Us << "/"
+            << stats.SendMessageP99Us << std::endl;
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    std::cerr << "usage: " << argv[0] << " <test-case>" << std::endl;
+  if (argc < 2 || argc % 2 != 0) {
+    std::cerr << "usage: " << argv[0] << " <test-case> [--port N]"
+              << " [--threads N] [--batch N] [--command-share X]"
+              << " [--chats N] [--rate X] [--total N] [--latency-us N]"
+              << " [--error-rate X]" << std::endl;
     return 1;
   }
 
-  telegram::FakeServer fake(argv[1]);
+  telegram::FakeOptions options;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    std::string key = argv[i];
+    std::string value = argv[i + 1];
+    if (key == "--port") {
+      options.Port = static_cast<uint16_t>(std::stoi(value));
+    } else if (key == "--threads") {
+      options.Threads = std::stoi(value);
+    } else if (key == "--batch") {
+      options.BatchSize = std::stoi(value);
+    } else if (key == "--command-share") {
+      options.CommandShare = std::stod(value);
+    } else if (key == "--chats") {
+      options.Chats = std::stoi(value);
+    } else if (key == "--rate") {
+      options.UpdatesPerSecond = std::stod(value);
+    } else if (key == "--total") {
+      options.TotalUpdates = std::stoll(value);
+    } else if (key == "--latency-us") {
+      options.Latency = std::chrono::microseconds(std::stoll(value));
+    } else if (key == "--error-rate") {
+      options.ErrorRate = std::stod(value);
+    } else {
+      std::cerr << "unknown option " << key << std::endl;
+      return 1;
+    }
+  }
+
+  telegram::FakeServer fake(argv[1], options);
   fake.Start();
 
   std::cout << "Fake server is listening at " << fake.GetUrl() << std::endl;
   std::cin.get();
 
   fake.StopAndCheckExpectations();
+  if (std::string(argv[1]) == "Benchmark") {
+    PrintStats(fake.Stats());
+  }
 
   return 0;
 }
@@ -0,0 +1,39 @@
+#include "journal_replay.h"
+#include "fake_data.h"
+
+#include <thread>
+
+JournalReplay::JournalReplay(Options options)
+    : options_(std::move(options)), reader_(options_.directory) {}
+
+int JournalReplay::Handle(const TransportRequest &request, std::string &body) {
+  if (request.path.find("/getUpdates") == std::string::npos) {
+    ++calls_;
+    // ответ sendMessage подходит и остальным методам: клиент читает из
+    // него только result.message_id и result.chat.id
+    body = FakeData::SendMessageReplyJson;
+    return 200;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  JournalRecord record;
+  if (!reader_.Next(record)) {
+    done_ = true;
+    // как long-poll без апдейтов, только быстрее
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    body = "{\"ok\":true,\"result\":[]}";
+    return 200;
+  }
+  if (options_.recorded_timing) {
+    if (!first_time_us_) {
+      first_time_us_ = record.time_us;
+      started_ = Clock::now();
+    }
+    auto delay = std::chrono::microseconds(static_cast<int64_t>(
+        static_cast<double>(record.time_us - *first_time_us_) /
+        options_.speed));
+    std::this_thread::sleep_until(started_ + delay);
+  }
+  body.assign(record.body.data(), record.body.size());
+  ++batches_;
+  return 200;
+}
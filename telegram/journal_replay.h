@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "transport.h"
+#include "update_journal.h"
+
+// сервер Bot API для воспроизведения журнала (LoopbackTransport): getUpdates
+// отдаёт записи UpdateJournal по порядку, остальные методы отвечают успехом
+// без сети, так что бот с этим транспортом прогоняет записанный трафик через
+// декодер, роутер и обработчики
+class JournalReplay {
+public:
+  struct Options {
+    std::string directory;
+    bool recorded_timing = false;
+    // false - так быстро, как бот забирает; true - с паузами между батчами,
+    // как они приходили
+    double speed = 1;
+    // ускорение записанных пауз
+  };
+
+  explicit JournalReplay(Options options);
+
+  int Handle(const TransportRequest &request, std::string &body);
+  // обработчик для LoopbackTransport, зовётся из потоков клиента
+
+  bool Done() const { return done_.load(); }
+  // журнал кончился и уже отдан; апдейты могут ещё обрабатываться
+  uint64_t Batches() const { return batches_.load(); }
+  uint64_t Calls() const { return calls_.load(); }
+  // запросы обработчиков: sendMessage, editMessageText, ...
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  const Options options_;
+  std::mutex mutex_;
+  // getUpdates по одному: поллер всё равно держит один запрос
+  JournalReader reader_;
+  std::optional<int64_t> first_time_us_;
+  Clock::time_point started_;
+  std::atomic<bool> done_{false};
+  std::atomic<uint64_t> batches_{0};
+  std::atomic<uint64_t> calls_{0};
+};
@@ -0,0 +1,265 @@
+#include "json_reader.h"
+
+namespace {
+
+bool IsWhitespace(int c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+void AppendUtf8(std::string &out, uint32_t code_point) {
+  if (code_point < 0x80) {
+    out.push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else if (code_point < 0x10000) {
+    out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+}
+
+} // namespace
+
+JsonReader::JsonReader(std::istream &input) : input_(input.rdbuf()) {}
+
+void JsonReader::Fail(const std::string &details) {
+  throw JsonSyntaxError(details + " at byte " + std::to_string(consumed_));
+}
+
+void JsonReader::SkipWhitespace() {
+  while (IsWhitespace(PeekRaw())) {
+    Get();
+  }
+}
+
+void JsonReader::Expect(char expected) {
+  SkipWhitespace();
+  if (Get() != expected) {
+    Fail(std::string("expected '") + expected + "'");
+  }
+}
+
+void JsonReader::ExpectLiteral(const char *literal) {
+  for (; *literal; ++literal) {
+    if (Get() != *literal) {
+      Fail("invalid literal");
+    }
+  }
+}
+
+char JsonReader::Peek() {
+  SkipWhitespace();
+  int c = PeekRaw();
+  if (c == std::char_traits<char>::eof()) {
+    Fail("unexpected end of input");
+  }
+  return static_cast<char>(c);
+}
+
+void JsonReader::BeginObject() { Expect('{'); }
+
+bool JsonReader::NextKey() {
+  char c = Peek();
+  if (c == '}') {
+    Get();
+    return false;
+  }
+  if (c == ',') {
+    Get();
+  }
+  ReadString(key_);
+  Expect(':');
+  return true;
+}
+
+void JsonReader::BeginArray() { Expect('['); }
+
+bool JsonReader::NextElement() {
+  char c = Peek();
+  if (c == ']') {
+    Get();
+    return false;
+  }
+  if (c == ',') {
+    Get();
+  }
+  return true;
+}
+
+bool JsonReader::ReadNull() {
+  if (Peek() != 'n') {
+    return false;
+  }
+  ExpectLiteral("null");
+  return true;
+}
+
+bool JsonReader::ReadBool() {
+  char c = Peek();
+  if (c == 't') {
+    ExpectLiteral("true");
+    return true;
+  }
+  if (c == 'f') {
+    ExpectLiteral("false");
+    return false;
+  }
+  Fail("expected bool");
+}
+
+int64_t JsonReader::ReadInt() {
+  bool negative = Peek() == '-';
+  if (negative) {
+    Get();
+  }
+  if (PeekRaw() < '0' || PeekRaw() > '9') {
+    Fail("expected number");
+  }
+  uint64_t value = 0;
+  while (PeekRaw() >= '0' && PeekRaw() <= '9') {
+    value = value * 10 + (Get() - '0');
+  }
+  // дробная часть и экспонента для целых полей нам не нужны
+  while (PeekRaw() == '.' || PeekRaw() == 'e' || PeekRaw() == 'E' ||
+         PeekRaw() == '+' || PeekRaw() == '-' ||
+         (PeekRaw() >= '0' && PeekRaw() <= '9')) {
+    Get();
+  }
+  return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+}
+
+uint32_t JsonReader::ReadHex4() {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    int c = Get();
+    value <<= 4;
+    if (c >= '0' && c <= '9') {
+      value |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      value |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      value |= c - 'A' + 10;
+    } else {
+      Fail("invalid \\u escape");
+    }
+  }
+  return value;
+}
+
+void JsonReader::ReadString(std::string &out) {
+  out.clear();
+  Expect('"');
+  while (true) {
+    int c = Get();
+    if (c == '"') {
+      return;
+    }
+    if (c == std::char_traits<char>::eof()) {
+      Fail("unterminated string");
+    }
+    if (c != '\\') {
+      out.push_back(static_cast<char>(c));
+      continue;
+    }
+    c = Get();
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      out.push_back(static_cast<char>(c));
+      break;
+    case 'b':
+      out.push_back('\b');
+      break;
+    case 'f':
+      out.push_back('\f');
+      break;
+    case 'n':
+      out.push_back('\n');
+      break;
+    case 'r':
+      out.push_back('\r');
+      break;
+    case 't':
+      out.push_back('\t');
+      break;
+    case 'u': {
+      uint32_t code_point = ReadHex4();
+      if (code_point >= 0xD800 && code_point < 0xDC00 && PeekRaw() == '\\') {
+        // суррогатная пара utf-16 (эмодзи и прочее вне BMP)
+        Get();
+        if (Get() != 'u') {
+          Fail("invalid surrogate pair");
+        }
+        uint32_t low = ReadHex4();
+        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+      }
+      AppendUtf8(out, code_point);
+      break;
+    }
+    default:
+      Fail("invalid escape");
+    }
+  }
+}
+
+void JsonReader::SkipString() {
+  Expect('"');
+  while (true) {
+    int c = Get();
+    if (c == '"') {
+      return;
+    }
+    if (c == '\\') {
+      Get();
+    } else if (c == std::char_traits<char>::eof()) {
+      Fail("unterminated string");
+    }
+  }
+}
+
+void JsonReader::Skip() { SkipValue(0); }
+
+void JsonReader::SkipValue(int depth) {
+  if (depth > kMaxDepth) {
+    Fail("nesting is too deep");
+  }
+  char c = Peek();
+  if (c == '{') {
+    Get();
+    while (true) {
+      char next = Peek();
+      if (next == '}') {
+        Get();
+        return;
+      }
+      if (next == ',') {
+        Get();
+      }
+      SkipString();
+      Expect(':');
+      SkipValue(depth + 1);
+    }
+  } else if (c == '[') {
+    Get();
+    while (NextElement()) {
+      SkipValue(depth + 1);
+    }
+  } else if (c == '"') {
+    SkipString();
+  } else if (c == 't') {
+    ExpectLiteral("true");
+  } else if (c == 'f') {
+    ExpectLiteral("false");
+  } else if (c == 'n') {
+    ExpectLiteral("null");
+  } else {
+    ReadInt();
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+struct JsonSyntaxError : public std::runtime_error {
+  explicit JsonSyntaxError(const std::string &details)
+      : std::runtime_error("json syntax error: " + details) {}
+};
+
+// потоковый (pull) разбор json прямо из std::istream, без построения дерева
+// объекты обходятся через BeginObject/NextKey, массивы через
+// BeginArray/NextElement, ненужные значения пропускаются Skip без аллокаций
+class JsonReader {
+public:
+  explicit JsonReader(std::istream &input);
+
+  void BeginObject();
+  bool NextKey();
+  // следующий ключ объекта (доступен через Key()), false на '}'
+  const std::string &Key() const { return key_; }
+
+  void BeginArray();
+  bool NextElement();
+  // есть ли следующий элемент массива, false на ']'
+
+  char Peek();
+  // первый символ следующего значения ('{', '[', '"', цифра, ...)
+
+  bool ReadNull();
+  // съесть null, если он следующий
+  bool ReadBool();
+  int64_t ReadInt();
+  void ReadString(std::string &out);
+  // out переиспользуется, \uXXXX декодируются в utf-8
+
+  void Skip();
+  // пропустить любое значение целиком
+
+  size_t Consumed() const { return consumed_; }
+  // сколько байт уже прочитано из потока
+
+private:
+  static constexpr int kMaxDepth = 64;
+
+  int Get() {
+    int c = input_->sbumpc();
+    if (c != std::char_traits<char>::eof()) {
+      ++consumed_;
+    }
+    return c;
+  }
+  int PeekRaw() { return input_->sgetc(); }
+
+  void SkipWhitespace();
+  void Expect(char expected);
+  void ExpectLiteral(const char *literal);
+  void SkipString();
+  void SkipValue(int depth);
+  uint32_t ReadHex4();
+  [[noreturn]] void Fail(const std::string &details);
+
+  std::streambuf *input_;
+  std::string key_;
+  size_t consumed_ = 0;
+};
@@ -0,0 +1,129 @@
+#include "json_writer.h"
+
+#include <assert.h>
+#include <charconv>
+
+namespace {
+
+bool NeedsEscape(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+
+} // namespace
+
+JsonWriter::JsonWriter(std::string &out) : out_(out) { out_.clear(); }
+
+void JsonWriter::BeforeValue() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (depth_ == 0) {
+    return;
+  }
+  uint64_t bit = uint64_t(1) << (depth_ - 1);
+  if (has_elements_ & bit) {
+    out_.push_back(',');
+  }
+  has_elements_ |= bit;
+}
+
+void JsonWriter::BeginObject() {
+  BeforeValue();
+  assert(depth_ < kMaxDepth);
+  out_.push_back('{');
+  ++depth_;
+  has_elements_ &= ~(uint64_t(1) << (depth_ - 1));
+}
+
+void JsonWriter::EndObject() {
+  assert(depth_ > 0 && !after_key_);
+  --depth_;
+  out_.push_back('}');
+}
+
+void JsonWriter::BeginArray() {
+  BeforeValue();
+  assert(depth_ < kMaxDepth);
+  out_.push_back('[');
+  ++depth_;
+  has_elements_ &= ~(uint64_t(1) << (depth_ - 1));
+}
+
+void JsonWriter::EndArray() {
+  assert(depth_ > 0 && !after_key_);
+  --depth_;
+  out_.push_back(']');
+}
+
+void JsonWriter::Key(std::string_view key) {
+  assert(!after_key_);
+  BeforeValue();
+  AppendEscaped(out_, key);
+  out_.push_back(':');
+  after_key_ = true;
+}
+
+void JsonWriter::String(std::string_view value) {
+  BeforeValue();
+  AppendEscaped(out_, value);
+}
+
+void JsonWriter::Int(int64_t value) {
+  BeforeValue();
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  out_.append(buffer, result.ptr);
+}
+
+void JsonWriter::Bool(bool value) {
+  BeforeValue();
+  out_.append(value ? "true" : "false");
+}
+
+void JsonWriter::Null() {
+  BeforeValue();
+  out_.append("null");
+}
+
+void JsonWriter::AppendEscaped(std::string &out, std::string_view value) {
+  static const char kHex[] = "0123456789abcdef";
+  out.push_back('"');
+  size_t begin = 0;
+  for (size_t idx = 0; idx < value.size(); ++idx) {
+    unsigned char c = static_cast<unsigned char>(value[idx]);
+    if (!NeedsEscape(c)) {
+      continue;
+    }
+    // безопасные куски копируем целиком, а не по символу
+    out.append(value.data() + begin, idx - begin);
+    begin = idx + 1;
+    switch (c) {
+    case '"':
+      out.append("\\\"");
+      break;
+    case '\\':
+      out.append("\\\\");
+      break;
+    case '\b':
+      out.append("\\b");
+      break;
+    case '\f':
+      out.append("\\f");
+      break;
+    case '\n':
+      out.append("\\n");
+      break;
+    case '\r':
+      out.append("\\r");
+      break;
+    case '\t':
+      out.append("\\t");
+      break;
+    default: {
+      char escape[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+      out.append(escape, sizeof(escape));
+    }
+    }
+  }
+  out.append(value.data() + begin, value.size() - begin);
+  out.push_back('"');
+}
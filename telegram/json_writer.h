@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// прямая запись json в строку без промежуточного дерева (Poco::JSON::Object)
+// строка-приёмник очищается, но её ёмкость сохраняется, так что при
+// переиспользовании одного буфера запись не аллоцирует
+// запятые между элементами расставляются сами, вложенность до kMaxDepth
+class JsonWriter {
+public:
+  explicit JsonWriter(std::string &out);
+
+  void BeginObject();
+  void EndObject();
+  void BeginArray();
+  void EndArray();
+
+  void Key(std::string_view key);
+  // ключ объекта, следующим должно идти значение
+  void String(std::string_view value);
+  void Int(int64_t value);
+  void Bool(bool value);
+  void Null();
+
+  static void AppendEscaped(std::string &out, std::string_view value);
+  // строка в кавычках: экранируются '"', '\' и управляющие символы,
+  // utf-8 пишется как есть
+
+private:
+  static constexpr int kMaxDepth = 64;
+
+  void BeforeValue();
+
+  std::string &out_;
+  uint64_t has_elements_ = 0;
+  // бит на уровень вложенности: на нём уже есть элементы, нужна запятая
+  int depth_ = 0;
+  bool after_key_ = false;
+};
@@ -1,12 +1,109 @@
 #include "bot.h"
+#include "bot_host.h"
+#include "journal_replay.h"
+#include "rate_limiter.h"
+#include "shutdown_signals.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <thread>
+
+namespace {
+
+int Replay(const std::shared_ptr<JournalReplay> &replay,
+           ShutdownSignals &signals) {
+  const std::string offset_file = "replay.offset";
+  std::remove(offset_file.c_str());
+  RateLimiter::Options unlimited;
+  unlimited.global_rate = unlimited.global_burst = 1e9;
+  unlimited.chat_rate = unlimited.chat_burst = 1e9;
+  TelegramBot::Options options;
+  options.offset_file_name = offset_file;
+  options.rate_limiter = std::make_shared<RateLimiter>(unlimited);
+  // повторы в журнале (перезапуски бота) тоже воспроизводим
+  options.dedup_updates = false;
+  options.poll.idle_timeout = 0;
+  options.warm_connections = 0;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [replay](const TransportRequest &request, std::string &body) {
+        return replay->Handle(request, body);
+      });
+  TelegramBot bot("replay", "http://replay/", options);
+  // записанные /stop и /crash не должны обрывать прогон
+  bot.Router().Register("/stop", [](const CommandContext &) {});
+  bot.Router().Register("/crash", [](const CommandContext &) {});
+
+  std::atomic<bool> interrupted{false};
+  signals.Watch([&bot, &interrupted] {
+    interrupted = true;
+    bot.Stop();
+  });
+  auto start = std::chrono::steady_clock::now();
+  std::thread runner([&bot] { bot.Start(); });
+  while (!replay->Done() && !interrupted) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // Stop дообрабатывает уже полученные батчи
+  bot.Stop();
+  runner.join();
+  signals.Unwatch();
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::remove(offset_file.c_str());
+  std::cout << "replayed " << replay->Batches() << " batches, "
+            << replay->Calls() << " api calls in " << elapsed << " s"
+            << std::endl;
+  return 0;
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
   std::string for_tests = "http://35.207.130.78/";
   std::string for_real_tg = "https://api.telegram.org/";
   std::string token_for_tests = "token for fake server";
   std::string token_for_tg = "";
+  // до создания любых потоков, см. ShutdownSignals
+  ShutdownSignals signals;
+  // bot-run --config bots.json - все боты из конфига в одном процессе
+  if (argc >= 3 && std::string(argv[1]) == "--config") {
+    BotHost host(BotHostConfig::Load(argv[2]));
+    signals.Watch([&host] { host.Stop(); });
+    host.Run();
+    signals.Unwatch();
+    return 0;
+  }
+  // bot-run replay <journal dir> [--timed [speed]] - прогнать записанные
+  // апдейты через обработчики без telegram
+  if (argc >= 3 && std::string(argv[1]) == "replay") {
+    JournalReplay::Options replay_options;
+    replay_options.directory = argv[2];
+    if (argc >= 4 && std::string(argv[3]) == "--timed") {
+      replay_options.recorded_timing = true;
+      if (argc >= 5) {
+        replay_options.speed = std::stod(argv[4]);
+      }
+    }
+    auto replay = std::make_shared<JournalReplay>(replay_options);
+    return Replay(replay, signals);
+  }
   TelegramBot my_bot(token_for_tg, for_real_tg);
-  my_bot.Start();
+  signals.Watch([&my_bot] { my_bot.Stop(); });
+  // bot-run webhook <port> <public url> [secret token]
+  if (argc >= 4 && std::string(argv[1]) == "webhook") {
+    WebhookServer::Options webhook;
+    webhook.port = static_cast<uint16_t>(std::stoi(argv[2]));
+    webhook.path = WebhookServer::PathFor(argv[3]);
+    if (argc >= 5) {
+      webhook.secret_token = argv[4];
+    }
+    my_bot.StartWebhook(webhook, argv[3]);
+  } else {
+    my_bot.Start();
+  }
+  signals.Unwatch();
   return 0;
 }
\ No newline at end of file
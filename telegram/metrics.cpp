@@ -0,0 +1,274 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+namespace {
+
+const char *const kMethodNames[] = {"getMe", "getUpdates", "sendMessage",
+                                    "sendPhoto", "other"};
+const char *const kPhaseNames[] = {"connect", "request", "response", "parse"};
+
+const uint64_t kLatencyBoundsUs[] = {
+    100,     250,     500,     1000,     2500,     5000,
+    10000,   25000,   50000,   100000,   250000,   500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000};
+const uint64_t kBatchBounds[] = {0, 1, 2, 5, 10, 20, 50, 100};
+
+void WriteSeconds(std::ostream &out, uint64_t micros) {
+  out << micros / 1000000 << '.' << std::setw(6) << std::setfill('0')
+      << micros % 1000000 << std::setfill(' ');
+}
+
+// labels вида method="getMe",phase="parse" (без фигурных скобок)
+template <size_t N>
+void WriteHistogram(std::ostream &out, const std::string &name,
+                    const std::string &labels, const Histogram &histogram,
+                    const uint64_t (&bounds)[N], bool seconds) {
+  Histogram::Snapshot snapshot = histogram.Read();
+  std::string prefix = labels.empty() ? "" : labels + ",";
+  for (uint64_t bound : bounds) {
+    out << name << "_bucket{" << prefix << "le=\"";
+    if (seconds) {
+      WriteSeconds(out, bound);
+    } else {
+      out << bound;
+    }
+    out << "\"} " << snapshot.CountAtMost(bound) << '\n';
+  }
+  out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << snapshot.count
+      << '\n';
+  out << name << "_sum";
+  if (!labels.empty()) {
+    out << '{' << labels << '}';
+  }
+  out << ' ';
+  if (seconds) {
+    WriteSeconds(out, snapshot.sum);
+  } else {
+    out << snapshot.sum;
+  }
+  out << '\n' << name << "_count";
+  if (!labels.empty()) {
+    out << '{' << labels << '}';
+  }
+  out << ' ' << snapshot.count << '\n';
+}
+
+void WriteHeader(std::ostream &out, const std::string &name,
+                 const std::string &type, const std::string &help) {
+  out << "# HELP " << name << ' ' << help << '\n';
+  out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+std::string MethodLabel(size_t method) {
+  return std::string("method=\"") + kMethodNames[method] + "\"";
+}
+
+} // namespace
+
+size_t MetricShard() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+uint64_t Counter::Value() const {
+  uint64_t value = 0;
+  for (const Cell &cell : cells_) {
+    value += cell.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+size_t Histogram::BucketIndex(uint64_t value) {
+  if (value < kExact) {
+    return static_cast<size_t>(value);
+  }
+  int bit = 63 - __builtin_clzll(value);
+  if (bit > kMaxBit) {
+    return kBuckets - 1;
+  }
+  int shift = bit - kSubBucketBits;
+  size_t sub = (value >> shift) & ((size_t(1) << kSubBucketBits) - 1);
+  return kExact + (bit - kSubBucketBits - 1) * (size_t(1) << kSubBucketBits) +
+         sub;
+}
+
+uint64_t Histogram::BucketUpperBound(size_t idx) {
+  if (idx < kExact) {
+    return idx;
+  }
+  size_t offset = idx - kExact;
+  int bit = static_cast<int>(offset >> kSubBucketBits) + kSubBucketBits + 1;
+  uint64_t sub = offset & ((size_t(1) << kSubBucketBits) - 1);
+  int shift = bit - kSubBucketBits;
+  uint64_t lower = ((uint64_t(1) << kSubBucketBits) + sub) << shift;
+  return lower + (uint64_t(1) << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value) {
+  Shard &shard = shards_[MetricShard() % kShards];
+  shard.buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::Read() const {
+  Snapshot snapshot;
+  snapshot.buckets.assign(kBuckets, 0);
+  for (const Shard &shard : shards_) {
+    for (size_t idx = 0; idx < kBuckets; ++idx) {
+      snapshot.buckets[idx] +=
+          shard.buckets[idx].load(std::memory_order_relaxed);
+    }
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  // count считаем по бакетам, чтобы +Inf всегда совпадал с их суммой
+  for (uint64_t bucket : snapshot.buckets) {
+    snapshot.count += bucket;
+  }
+  return snapshot;
+}
+
+uint64_t Histogram::Snapshot::CountAtMost(uint64_t bound) const {
+  uint64_t total = 0;
+  for (size_t idx = 0; idx < buckets.size(); ++idx) {
+    if (BucketUpperBound(idx) > bound) {
+      break;
+    }
+    total += buckets[idx];
+  }
+  return total;
+}
+
+uint64_t Histogram::Snapshot::Percentile(double fraction) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * count));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (size_t idx = 0; idx < buckets.size(); ++idx) {
+    seen += buckets[idx];
+    if (seen >= rank) {
+      return BucketUpperBound(idx);
+    }
+  }
+  return BucketUpperBound(buckets.size() - 1);
+}
+
+size_t Metrics::StatusIndex(int status) {
+  for (size_t idx = 0; idx < kStatusCodes.size(); ++idx) {
+    if (kStatusCodes[idx] == status) {
+      return idx;
+    }
+  }
+  return kStatusCodes.size();
+}
+
+void Metrics::WritePrometheus(std::ostream &out) const {
+  WriteHeader(out, "telegram_api_request_duration_seconds", "histogram",
+              "Bot API request latency, one attempt");
+  for (size_t method = 0; method < kMethods; ++method) {
+    WriteHistogram(out, "telegram_api_request_duration_seconds",
+                   MethodLabel(method), api_[method].total_us,
+                   kLatencyBoundsUs, true);
+  }
+
+  WriteHeader(out, "telegram_api_phase_duration_seconds", "histogram",
+              "Bot API request latency by phase");
+  for (size_t method = 0; method < kMethods; ++method) {
+    for (size_t phase = 0; phase < kPhases; ++phase) {
+      WriteHistogram(out, "telegram_api_phase_duration_seconds",
+                     MethodLabel(method) + ",phase=\"" + kPhaseNames[phase] +
+                         "\"",
+                     api_[method].phase_us[phase], kLatencyBoundsUs, true);
+    }
+  }
+
+  WriteHeader(out, "telegram_api_responses_total", "counter",
+              "Bot API responses by HTTP status, 0 is a transport error");
+  for (size_t method = 0; method < kMethods; ++method) {
+    for (size_t status = 0; status < kStatuses; ++status) {
+      uint64_t value = api_[method].responses[status].Value();
+      if (value == 0) {
+        continue;
+      }
+      out << "telegram_api_responses_total{" << MethodLabel(method)
+          << ",code=\"";
+      if (status < kStatusCodes.size()) {
+        out << kStatusCodes[status];
+      } else {
+        out << "other";
+      }
+      out << "\"} " << value << '\n';
+    }
+  }
+
+  WriteHeader(out, "telegram_api_sent_bytes_total", "counter",
+              "Request body bytes sent to Bot API");
+  for (size_t method = 0; method < kMethods; ++method) {
+    out << "telegram_api_sent_bytes_total{" << MethodLabel(method) << "} "
+        << api_[method].bytes_out.Value() << '\n';
+  }
+  WriteHeader(out, "telegram_api_received_bytes_total", "counter",
+              "Response body bytes received from Bot API");
+  for (size_t method = 0; method < kMethods; ++method) {
+    out << "telegram_api_received_bytes_total{" << MethodLabel(method) << "} "
+        << api_[method].bytes_in.Value() << '\n';
+  }
+
+  WriteHeader(out, "telegram_updates_per_batch", "histogram",
+              "Updates in one getUpdates response");
+  WriteHistogram(out, "telegram_updates_per_batch", "", batch_updates,
+                 kBatchBounds, false);
+  WriteHeader(out, "telegram_handler_queue_wait_seconds", "histogram",
+              "Time a command waits in the worker queue");
+  WriteHistogram(out, "telegram_handler_queue_wait_seconds", "",
+                 queue_wait_us, kLatencyBoundsUs, true);
+  WriteHeader(out, "telegram_handler_duration_seconds", "histogram",
+              "Command handler run time");
+  WriteHistogram(out, "telegram_handler_duration_seconds", "", handler_us,
+                 kLatencyBoundsUs, true);
+  WriteHeader(out, "telegram_handler_errors_total", "counter",
+              "Command handlers that threw");
+  out << "telegram_handler_errors_total " << handler_errors.Value() << '\n';
+  WriteHeader(out, "telegram_response_cache_requests_total", "counter",
+              "Cached command responses by result");
+  out << "telegram_response_cache_requests_total{result=\"hit\"} "
+      << response_cache_hits.Value() << '\n';
+  out << "telegram_response_cache_requests_total{result=\"miss\"} "
+      << response_cache_misses.Value() << '\n';
+  out << "telegram_response_cache_requests_total{result=\"coalesced\"} "
+      << response_cache_coalesced.Value() << '\n';
+}
+
+Metrics &GlobalMetrics() {
+  static Metrics metrics;
+  return metrics;
+}
+
+uint64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+ApiCallTimer::ApiCallTimer(ApiMethod method)
+    : api_(GlobalMetrics().Method(method)), start_(Clock::now()),
+      mark_(start_) {}
+
+ApiCallTimer::~ApiCallTimer() {
+  api_.total_us.Record(MicrosSince(start_));
+  api_.responses[Metrics::StatusIndex(status_)].Add();
+}
+
+void ApiCallTimer::Phase(ApiPhase phase) {
+  Clock::time_point now = Clock::now();
+  api_.phase_us[static_cast<size_t>(phase)].Record(
+      std::chrono::duration_cast<std::chrono::microseconds>(now - mark_)
+          .count());
+  mark_ = now;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// метрики процесса: счётчики и гистограммы без мьютексов
+// каждая ячейка размазана по kMetricShards кэш-линиям, поток пишет в свою
+// (relaxed fetch_add), читатель /metrics складывает шарды
+constexpr size_t kMetricShards = 16;
+
+size_t MetricShard();
+// номер шарда текущего потока, раздаётся по кругу при первом обращении
+
+class Counter {
+public:
+  void Add(uint64_t delta = 1) {
+    cells_[MetricShard()].value.fetch_add(delta, std::memory_order_relaxed);
+  }
+  uint64_t Value() const;
+
+private:
+  struct alignas(64) Cell {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<Cell, kMetricShards> cells_;
+};
+
+// лог-линейные бакеты как в HdrHistogram: значение попадает в бакет по
+// старшему биту и kSubBucketBits следующим за ним, так что относительная
+// ошибка не больше 1/2^kSubBucketBits (12.5%) на всём диапазоне
+// значения - целые в единицах метрики (микросекунды, байты, штуки)
+class Histogram {
+public:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kMaxBit = 47;
+  // всё, что больше 2^48, попадает в последний бакет
+  static constexpr size_t kExact = size_t(2) << kSubBucketBits;
+  static constexpr size_t kBuckets =
+      kExact + (kMaxBit - kSubBucketBits) * (size_t(1) << kSubBucketBits);
+
+  void Record(uint64_t value);
+
+  struct Snapshot {
+    std::vector<uint64_t> buckets;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    uint64_t CountAtMost(uint64_t bound) const;
+    // сколько значений не больше bound (с точностью до бакета)
+    uint64_t Percentile(double fraction) const;
+  };
+  Snapshot Read() const;
+
+  static size_t BucketIndex(uint64_t value);
+  static uint64_t BucketUpperBound(size_t idx);
+
+private:
+  static constexpr size_t kShards = 4;
+  // гистограмм много, поэтому шардов меньше, чем у счётчиков
+
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+    std::atomic<uint64_t> sum{0};
+  };
+  std::array<Shard, kShards> shards_;
+};
+
+enum class ApiMethod {
+  kGetMe,
+  kGetUpdates,
+  kSendMessage,
+  kSendPhoto,
+  kOther,
+  kCount
+};
+
+enum class ApiPhase { kConnect, kRequest, kResponse, kParse, kCount };
+// connect - sendRequest на новом сокете (tcp connect + TLS handshake + запись,
+// Poco не даёт их разделить), request - sendRequest на keep-alive сокете,
+// response - ожидание заголовков ответа, parse - разбор тела вместе с его
+// дочитыванием из сокета
+
+// все метрики клиента и бота; один экземпляр на процесс (GlobalMetrics)
+class Metrics {
+public:
+  static constexpr size_t kMethods = static_cast<size_t>(ApiMethod::kCount);
+  static constexpr size_t kPhases = static_cast<size_t>(ApiPhase::kCount);
+  static constexpr std::array<int, 12> kStatusCodes = {
+      0, 200, 400, 401, 403, 404, 409, 429, 500, 502, 503, 504};
+  // 0 - сетевая ошибка без http ответа; прочие коды идут в "other"
+  static constexpr size_t kStatuses = kStatusCodes.size() + 1;
+
+  struct Api {
+    std::array<Histogram, kPhases> phase_us;
+    Histogram total_us;
+    std::array<Counter, kStatuses> responses;
+    Counter bytes_in;
+    Counter bytes_out;
+  };
+
+  Api &Method(ApiMethod method) { return api_[static_cast<size_t>(method)]; }
+  static size_t StatusIndex(int status);
+
+  Histogram batch_updates;
+  // апдейтов в одном ответе getUpdates
+  Histogram queue_wait_us;
+  // от Submit до начала обработки в воркере
+  Histogram handler_us;
+  // время обработчика одной команды
+  Counter handler_errors;
+  Counter response_cache_hits;
+  Counter response_cache_misses;
+  Counter response_cache_coalesced;
+  // ResponseCache: ответ из кэша, вызов бэкенда, ожидание чужого вызова
+
+  void WritePrometheus(std::ostream &out) const;
+  // text exposition format 0.0.4: счётчики *_total, гистограммы с le-бакетами,
+  // времена в секундах
+
+private:
+  std::array<Api, kMethods> api_;
+};
+
+Metrics &GlobalMetrics();
+
+// замер одного http запроса: фазы отмечаются по ходу, общее время и код
+// ответа записываются в деструкторе (в том числе при исключении)
+class ApiCallTimer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit ApiCallTimer(ApiMethod method);
+  ApiCallTimer(const ApiCallTimer &) = delete;
+  ApiCallTimer &operator=(const ApiCallTimer &) = delete;
+  ~ApiCallTimer();
+
+  void Phase(ApiPhase phase);
+  // закрыть фазу: время с предыдущей отметки
+  void SetStatus(int status) { status_ = status; }
+  void BytesOut(uint64_t bytes) { api_.bytes_out.Add(bytes); }
+  void BytesIn(uint64_t bytes) { api_.bytes_in.Add(bytes); }
+
+private:
+  Metrics::Api &api_;
+  const Clock::time_point start_;
+  Clock::time_point mark_;
+  int status_ = 0;
+};
+
+uint64_t MicrosSince(std::chrono::steady_clock::time_point start);
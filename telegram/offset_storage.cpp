@@ -0,0 +1,136 @@
+#include "offset_storage.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+OffsetStorage::OffsetStorage(std::string file_name, Options options)
+    : file_name_(std::move(file_name)), options_(options) {
+  if (options_.write_behind) {
+    flusher_ = std::thread([this] { FlushLoop(); });
+  }
+}
+
+OffsetStorage::~OffsetStorage() {
+  if (flusher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    flusher_.join();
+  }
+  try {
+    Flush();
+  } catch (...) {
+  }
+}
+
+int64_t OffsetStorage::Load() { return Load(nullptr); }
+
+int64_t OffsetStorage::Load(std::string *window) {
+  int64_t offset = 0;
+  std::ifstream file_input(file_name_);
+  if (!(file_input >> offset)) {
+    return 0;
+  }
+  if (window != nullptr) {
+    window->clear();
+    file_input >> std::ws;
+    std::getline(file_input, *window);
+  }
+  return offset;
+}
+
+void OffsetStorage::Store(int64_t offset) { Store(offset, std::string()); }
+
+void OffsetStorage::Store(int64_t offset, std::string window) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pending_ = offset;
+    pending_window_ = std::move(window);
+    dirty_ = true;
+  }
+  if (!options_.write_behind) {
+    WritePending();
+  }
+}
+
+void OffsetStorage::Flush() { WritePending(); }
+
+void OffsetStorage::WritePending() {
+  std::lock_guard<std::mutex> write_guard(write_mutex_);
+  int64_t offset;
+  std::string window;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!dirty_) {
+      return;
+    }
+    offset = pending_;
+    window = pending_window_;
+    dirty_ = false;
+  }
+  WriteFile(offset, window);
+}
+
+void OffsetStorage::WriteFile(int64_t offset, const std::string &window) {
+  std::string tmp_name = file_name_ + ".tmp";
+  std::string data = std::to_string(offset);
+  if (!window.empty()) {
+    // старые версии читают только первое число и окно не заметят
+    data += '\n' + window;
+  }
+
+  int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("can't open " + tmp_name + ": " +
+                             strerror(errno));
+  }
+  bool ok = ::write(fd, data.data(), data.size()) ==
+            static_cast<ssize_t>(data.size());
+  if (ok && options_.fsync) {
+    ok = ::fsync(fd) == 0;
+  }
+  ::close(fd);
+  if (!ok || std::rename(tmp_name.c_str(), file_name_.c_str()) != 0) {
+    throw std::runtime_error("can't write offset to " + file_name_ + ": " +
+                             strerror(errno));
+  }
+
+  if (options_.fsync) {
+    // rename становится durable только после fsync каталога
+    size_t slash = file_name_.rfind('/');
+    std::string dir_name =
+        slash == std::string::npos ? "." : file_name_.substr(0, slash + 1);
+    int dir_fd = ::open(dir_name.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+      ::fsync(dir_fd);
+      ::close(dir_fd);
+    }
+  }
+}
+
+void OffsetStorage::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    cv_.wait_for(lock, options_.flush_interval);
+    if (!dirty_) {
+      continue;
+    }
+    lock.unlock();
+    try {
+      WritePending();
+    } catch (const std::exception &) {
+      // файл попробуем записать на следующем тике
+      std::lock_guard<std::mutex> guard(mutex_);
+      dirty_ = true;
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// хранит offset getUpdates в файле
+// запись атомарная: пишем во временный файл и переименовываем поверх старого,
+// так что после падения в файле всегда один из целых offset-ов
+// в режиме write-behind запись уходит в фоновый поток и делается не чаще
+// flush_interval, при остановке последний offset сбрасывается на диск
+// второй строкой рядом с offset лежит окно дедупликации (DedupWindow), так
+// что оба пишутся одной атомарной записью
+class OffsetStorage {
+public:
+  struct Options {
+    bool write_behind = false;
+    bool fsync = false;
+    // fsync файла и каталога после записи (дороже, но переживает выключение)
+    std::chrono::milliseconds flush_interval = std::chrono::milliseconds(200);
+  };
+
+  OffsetStorage(std::string file_name, Options options);
+  explicit OffsetStorage(std::string file_name)
+      : OffsetStorage(std::move(file_name), Options()) {}
+  OffsetStorage(const OffsetStorage &) = delete;
+  OffsetStorage &operator=(const OffsetStorage &) = delete;
+  ~OffsetStorage();
+
+  int64_t Load();
+  // прочитать offset из файла, 0 если файла нет
+  int64_t Load(std::string *window);
+  // то же и окно дедупликации (пустое, если его нет)
+
+  void Store(int64_t offset);
+  // запомнить offset; в синхронном режиме сразу пишет файл
+  void Store(int64_t offset, std::string window);
+
+  void Flush();
+  // дождаться записи последнего сохранённого offset-а
+
+private:
+  void WriteFile(int64_t offset, const std::string &window);
+  void WritePending();
+  void FlushLoop();
+
+  const std::string file_name_;
+  const Options options_;
+
+  std::mutex write_mutex_;
+  // упорядочивает записи файла между Flush и фоновым потоком
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int64_t pending_ = 0;
+  std::string pending_window_;
+  bool dirty_ = false;
+  bool stop_ = false;
+  std::thread flusher_;
+};
@@ -0,0 +1,24 @@
+#include "poll_controller.h"
+
+#include <algorithm>
+
+PollController::PollController(Options options) : options_(options) {}
+
+PollController::Poll PollController::Next(size_t in_flight) const {
+  Poll poll;
+  poll.limit = options_.max_limit;
+  if (options_.max_in_flight != 0) {
+    size_t room = in_flight < options_.max_in_flight
+                      ? options_.max_in_flight - in_flight
+                      : 0;
+    poll.limit = std::max(std::min(room, options_.max_limit), kMinLimit);
+  }
+  // при непустой очереди на сервере long-poll всё равно ответит сразу,
+  // timeout 0 лишь не даёт ему повиснуть, если очередь как раз кончилась
+  poll.timeout = backlog_ ? 0 : options_.idle_timeout;
+  return poll;
+}
+
+void PollController::Observe(const Poll &poll, size_t received) {
+  backlog_ = received > 0 && received >= poll.limit;
+}
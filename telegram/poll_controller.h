@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+
+// параметры следующего getUpdates по тому, что вернул предыдущий, и по
+// очереди воркеров: пока апдейтов нет - длинный long-poll (одно соединение
+// на idle_timeout секунд вместо запроса каждые несколько секунд), пока
+// telegram отдаёт полные батчи - timeout 0 и максимальный limit, а если
+// обработчики не успевают, limit уменьшается до свободного места в очереди
+// только для потока поллера, без синхронизации
+class PollController {
+public:
+  struct Options {
+    int idle_timeout = 25;
+    // секунды; Stop ждёт ответа текущего getUpdates, так что это и
+    // задержка остановки простаивающего бота
+    size_t max_limit = 100;
+    size_t max_in_flight = 0;
+    // апдейтов в обработке, сверх которых батчи не запрашиваем;
+    // 0 - без ограничения
+  };
+
+  struct Poll {
+    int timeout = 0;
+    size_t limit = 0;
+  };
+
+  PollController() : PollController(Options()) {}
+  explicit PollController(Options options);
+
+  Poll Next(size_t in_flight) const;
+  // in_flight - апдейты, отданные воркерам и ещё не обработанные
+
+  void Observe(const Poll &poll, size_t received);
+  // результат getUpdates с параметрами poll
+
+  bool Backlog() const { return backlog_; }
+  // последний батч был полным: на сервере, скорее всего, есть ещё
+
+private:
+  static constexpr size_t kMinLimit = 1;
+
+  const Options options_;
+  bool backlog_ = false;
+};
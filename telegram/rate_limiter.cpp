@@ -0,0 +1,81 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <thread>
+
+TokenBucket::TokenBucket(double rate, double burst, Clock::time_point now)
+    : rate_(rate), burst_(std::max(burst, 1.0)), tokens_(burst_), last_(now) {}
+
+void TokenBucket::Refill(Clock::time_point now) {
+  if (now <= last_) {
+    return;
+  }
+  std::chrono::duration<double> elapsed = now - last_;
+  tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  last_ = now;
+}
+
+TokenBucket::Clock::duration
+TokenBucket::TimeUntilAvailable(Clock::time_point now) {
+  Refill(now);
+  if (tokens_ >= 1) {
+    return Clock::duration::zero();
+  }
+  std::chrono::duration<double> wait((1 - tokens_) / rate_);
+  return std::chrono::duration_cast<Clock::duration>(wait) +
+         Clock::duration(1);
+}
+
+void TokenBucket::Take() { tokens_ -= 1; }
+
+bool TokenBucket::IsFull(Clock::time_point now) {
+  Refill(now);
+  return tokens_ >= burst_;
+}
+
+RateLimiter::RateLimiter(Options options)
+    : options_(options),
+      global_(options.global_rate, options.global_burst, Clock::now()) {}
+
+RateLimiter::Clock::duration RateLimiter::TryAcquire(int64_t chat_id) {
+  Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto chat = chats_.find(chat_id);
+  if (chat == chats_.end()) {
+    if (chats_.size() >= options_.max_idle_chats) {
+      EvictIdle(now);
+    }
+    chat = chats_
+               .emplace(chat_id, TokenBucket(options_.chat_rate,
+                                             options_.chat_burst, now))
+               .first;
+  }
+  Clock::duration wait = std::max(global_.TimeUntilAvailable(now),
+                                  chat->second.TimeUntilAvailable(now));
+  if (wait == Clock::duration::zero()) {
+    global_.Take();
+    chat->second.Take();
+  }
+  return wait;
+}
+
+void RateLimiter::Acquire(int64_t chat_id) {
+  while (true) {
+    Clock::duration wait = TryAcquire(chat_id);
+    if (wait == Clock::duration::zero()) {
+      return;
+    }
+    std::this_thread::sleep_for(wait);
+  }
+}
+
+void RateLimiter::EvictIdle(Clock::time_point now) {
+  // полный bucket ничем не отличается от нового, его можно забыть
+  for (auto it = chats_.begin(); it != chats_.end();) {
+    if (it->second.IsFull(now)) {
+      it = chats_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
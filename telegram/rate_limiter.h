@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// token bucket: rate токенов в секунду, не больше burst про запас
+class TokenBucket {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  TokenBucket(double rate, double burst, Clock::time_point now);
+
+  Clock::duration TimeUntilAvailable(Clock::time_point now);
+  // через сколько появится целый токен (0 - уже есть)
+  void Take();
+  bool IsFull(Clock::time_point now);
+
+private:
+  void Refill(Clock::time_point now);
+
+  double rate_;
+  double burst_;
+  double tokens_;
+  Clock::time_point last_;
+};
+
+// ограничение исходящих сообщений: общий bucket на бота (telegram пускает
+// около 30 msg/s) и bucket на каждый чат (около 1 msg/s)
+// лучше подождать заранее, чем получить 429 и ждать retry_after
+class RateLimiter {
+public:
+  using Clock = TokenBucket::Clock;
+
+  struct Options {
+    double global_rate = 30;
+    double global_burst = 30;
+    double chat_rate = 1;
+    double chat_burst = 3;
+    size_t max_idle_chats = 10000;
+    // сколько полных (простаивающих) bucket-ов чатов держим в памяти
+  };
+
+  RateLimiter() : RateLimiter(Options()) {}
+  explicit RateLimiter(Options options);
+
+  Clock::duration TryAcquire(int64_t chat_id);
+  // взять токены из обоих bucket-ов; если нельзя - ничего не берёт и
+  // возвращает, сколько подождать
+
+  void Acquire(int64_t chat_id);
+  // то же, но блокируется до появления токенов
+
+private:
+  void EvictIdle(Clock::time_point now);
+
+  const Options options_;
+  std::mutex mutex_;
+  TokenBucket global_;
+  std::unordered_map<int64_t, TokenBucket> chats_;
+};
@@ -0,0 +1,98 @@
+#include "response_cache.h"
+#include "metrics.h"
+
+ResponseCache::ResponseCache(Options options) : options_(options) {}
+
+std::string ResponseCache::GetOrCompute(const std::string &key,
+                                        std::chrono::milliseconds ttl,
+                                        const Compute &compute) {
+  Metrics &metrics = GlobalMetrics();
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto found = index_.find(key);
+  if (found != index_.end()) {
+    Iterator it = found->second;
+    if (it->expires > Clock::now()) {
+      lru_.splice(lru_.begin(), lru_, it);
+      metrics.response_cache_hits.Add();
+      return it->value;
+    }
+    Remove(it);
+  }
+  auto flight = flights_.find(key);
+  if (flight != flights_.end()) {
+    std::shared_future<std::string> result = flight->second;
+    lock.unlock();
+    metrics.response_cache_coalesced.Add();
+    return result.get();
+  }
+  std::promise<std::string> promise;
+  flights_.emplace(key, promise.get_future().share());
+  lock.unlock();
+  metrics.response_cache_misses.Add();
+
+  std::string value;
+  try {
+    value = compute();
+  } catch (...) {
+    lock.lock();
+    flights_.erase(key);
+    lock.unlock();
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+  lock.lock();
+  flights_.erase(key);
+  if (ttl.count() > 0) {
+    // ttl считаем от ответа бэкенда, а не от промаха
+    Insert(key, value, Clock::now() + ttl);
+  }
+  lock.unlock();
+  promise.set_value(value);
+  return value;
+}
+
+void ResponseCache::Erase(const std::string &key) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto found = index_.find(key);
+  if (found != index_.end()) {
+    Remove(found->second);
+  }
+}
+
+size_t ResponseCache::Size() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return index_.size();
+}
+
+size_t ResponseCache::Bytes() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return bytes_;
+}
+
+uint64_t ResponseCache::Evictions() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return evictions_;
+}
+
+void ResponseCache::Remove(Iterator it) {
+  bytes_ -= it->key.size() + it->value.size() + kEntryOverhead;
+  index_.erase(it->key);
+  lru_.erase(it);
+}
+
+void ResponseCache::Insert(const std::string &key, std::string value,
+                           Clock::time_point expires) {
+  size_t bytes = key.size() + value.size() + kEntryOverhead;
+  if (bytes > options_.max_bytes) {
+    // не влезет даже в пустой кэш - не выбрасываем ради него остальные
+    return;
+  }
+  // ключ был занят в flights_, так что записи с ним в кэше нет
+  lru_.push_front(Entry{key, std::move(value), expires});
+  index_.emplace(key, lru_.begin());
+  bytes_ += bytes;
+  while (bytes_ > options_.max_bytes) {
+    Remove(std::prev(lru_.end()));
+    ++evictions_;
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// кэш ответов обработчиков (CommandRouter::RegisterCached): текст ответа по
+// ключу команды живёт ttl, так что во время всплеска популярная команда
+// не ходит в медленный бэкенд (погода, курсы, FAQ)
+// промахи по одному ключу склеиваются (single-flight): бэкенд зовёт первый
+// поток, остальные ждут его результат; ошибка бэкенда не кэшируется и
+// достаётся всем ждущим
+// память ограничена max_bytes, сверх неё вытесняются давно не читавшиеся
+// ответы (LRU), просроченные удаляются при обращении
+class ResponseCache {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Compute = std::function<std::string()>;
+
+  struct Options {
+    size_t max_bytes = size_t(4) << 20;
+    // ключи и ответы плюс kEntryOverhead на запись; 0 - не кэшировать,
+    // остаётся только склейка промахов
+  };
+
+  ResponseCache() : ResponseCache(Options()) {}
+  explicit ResponseCache(Options options);
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
+
+  std::string GetOrCompute(const std::string &key,
+                           std::chrono::milliseconds ttl,
+                           const Compute &compute);
+  // ответ из кэша или результат compute (исключения compute пробрасываются);
+  // ttl == 0 - не запоминать, только склеить одновременные вызовы
+
+  void Erase(const std::string &key);
+  // сбросить ответ раньше ttl, например когда бэкенд сообщил об изменении
+
+  size_t Size() const;
+  size_t Bytes() const;
+  uint64_t Evictions() const;
+
+  static constexpr size_t kEntryOverhead = 64;
+  // узел списка и хэш-таблицы на запись, примерно
+
+private:
+  struct Entry {
+    std::string key;
+    std::string value;
+    Clock::time_point expires;
+  };
+
+  using Iterator = std::list<Entry>::iterator;
+
+  void Remove(Iterator it);
+  void Insert(const std::string &key, std::string value,
+              Clock::time_point expires);
+  // под mutex_
+
+  const Options options_;
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_;
+  // в начале недавно прочитанные
+  std::unordered_map<std::string, Iterator> index_;
+  std::unordered_map<std::string, std::shared_future<std::string>> flights_;
+  // ключи, для которых compute уже идёт
+  size_t bytes_ = 0;
+  uint64_t evictions_ = 0;
+};
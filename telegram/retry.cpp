@@ -0,0 +1,59 @@
+#include "retry.h"
+
+#include <algorithm>
+#include <random>
+
+std::chrono::milliseconds RetryPolicy::Delay(int attempt,
+                                             int retry_after) const {
+  thread_local std::mt19937 generator(std::random_device{}());
+  if (retry_after > 0) {
+    // чуть-чуть сверху, чтобы не прийти ровно на границе окна
+    std::uniform_int_distribution<int> extra(0, 250);
+    return std::chrono::seconds(retry_after) +
+           std::chrono::milliseconds(extra(generator));
+  }
+  int64_t delay = base_delay.count();
+  for (int idx = 1; idx < attempt && delay < max_delay.count(); ++idx) {
+    delay *= 2;
+  }
+  delay = std::min<int64_t>(delay, max_delay.count());
+  std::uniform_int_distribution<int64_t> jitter(delay / 2, delay);
+  return std::chrono::milliseconds(jitter(generator));
+}
+
+CircuitBreaker::CircuitBreaker(Options options) : options_(options) {}
+
+std::chrono::milliseconds CircuitBreaker::RetryAfter() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (state_ == State::kClosed) {
+    return std::chrono::milliseconds::zero();
+  }
+  Clock::time_point now = Clock::now();
+  if (state_ == State::kOpen && now >= open_until_) {
+    state_ = State::kHalfOpen;
+  }
+  if (state_ == State::kHalfOpen && !probe_in_flight_) {
+    probe_in_flight_ = true;
+    return std::chrono::milliseconds::zero();
+  }
+  auto wait =
+      std::chrono::duration_cast<std::chrono::milliseconds>(open_until_ - now);
+  return std::max(wait, std::chrono::milliseconds(1));
+}
+
+void CircuitBreaker::RecordSuccess() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  state_ = State::kClosed;
+  failures_ = 0;
+  probe_in_flight_ = false;
+}
+
+void CircuitBreaker::RecordFailure() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  ++failures_;
+  if (state_ == State::kHalfOpen || failures_ >= options_.failure_threshold) {
+    state_ = State::kOpen;
+    open_until_ = Clock::now() + options_.open_time;
+    probe_in_flight_ = false;
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+// экспоненциальный backoff с jitter: base * 2^(attempt-1), не больше
+// max_delay, случайно в [delay/2, delay], чтобы клиенты не ретраили хором
+struct RetryPolicy {
+  int max_attempts = 5;
+  std::chrono::milliseconds base_delay = std::chrono::milliseconds(200);
+  std::chrono::milliseconds max_delay = std::chrono::milliseconds(30000);
+
+  std::chrono::milliseconds Delay(int attempt, int retry_after = 0) const;
+  // пауза после неудачной попытки attempt (с 1); retry_after из ответа
+  // сервера (секунды) важнее нашего backoff
+};
+
+// после failure_threshold сбоев подряд перестаём ходить в API на open_time
+// (запросы сразу падают), потом пропускаем один пробный запрос
+class CircuitBreaker {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    int failure_threshold = 5;
+    std::chrono::milliseconds open_time = std::chrono::milliseconds(10000);
+  };
+
+  CircuitBreaker() : CircuitBreaker(Options()) {}
+  explicit CircuitBreaker(Options options);
+
+  std::chrono::milliseconds RetryAfter();
+  // 0 - можно делать запрос, иначе сколько ещё ждать
+
+  void RecordSuccess();
+  void RecordFailure();
+
+private:
+  enum class State { kClosed, kOpen, kHalfOpen };
+
+  const Options options_;
+  std::mutex mutex_;
+  State state_ = State::kClosed;
+  int failures_ = 0;
+  bool probe_in_flight_ = false;
+  Clock::time_point open_until_;
+};
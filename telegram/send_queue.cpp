@@ -0,0 +1,200 @@
+#include "send_queue.h"
+
+#include <stdexcept>
+
+SendQueue::SendQueue(size_t senders, size_t capacity, Sender sender,
+                     std::shared_ptr<RateLimiter> limiter, bool coalesce)
+    : capacity_(capacity ? capacity : 1), sender_(std::move(sender)),
+      limiter_(std::move(limiter)), coalesce_(coalesce) {
+  if (senders == 0) {
+    senders = 1;
+  }
+  for (size_t idx = 0; idx < senders; ++idx) {
+    threads_.emplace_back([this] { Run(); });
+  }
+}
+
+SendQueue::~SendQueue() { Stop(); }
+
+void SendQueue::Push(SendRequest request) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_full_.wait(lock, [this] { return stop_ || pending_ < capacity_; });
+  if (stop_) {
+    throw SendQueueStopped("send queue is stopped");
+  }
+  int64_t chat_id = request.chat_id;
+  ChatQueue &chat = chats_[chat_id];
+  bool was_idle = chat.requests.empty() && !chat.in_flight;
+  chat.requests.push_back(std::move(request));
+  ++pending_;
+  if (was_idle) {
+    ready_.push_back(chat_id);
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+}
+
+void SendQueue::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  not_empty_.notify_all();
+  not_full_.notify_all();
+  for (auto &thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+}
+
+bool SendQueue::Drain(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // not_full_ будится после каждого завершённого запроса
+  return not_full_.wait_until(lock, deadline, [this] { return pending_ == 0; });
+}
+
+void SendQueue::Cancel() {
+  std::vector<SendRequest> cancelled;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+    for (auto &[chat_id, chat] : chats_) {
+      for (auto &request : chat.requests) {
+        cancelled.push_back(std::move(request));
+      }
+      pending_ -= chat.requests.size();
+      chat.requests.clear();
+    }
+    ready_.clear();
+    delayed_.clear();
+  }
+  auto error =
+      std::make_exception_ptr(SendQueueStopped("send queue is cancelled"));
+  for (SendRequest &request : cancelled) {
+    try {
+      Complete(request, SentMessage{request.chat_id, 0}, error);
+    } catch (...) {
+    }
+  }
+  Stop();
+}
+
+size_t SendQueue::Pending() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return pending_;
+}
+
+void SendQueue::Complete(SendRequest &request, const SentMessage &message,
+                         std::exception_ptr error) {
+  if (request.callback) {
+    request.callback(message, error);
+  } else if (error) {
+    request.promise.set_exception(error);
+  } else {
+    request.promise.set_value(message);
+  }
+}
+
+bool SendQueue::Mergeable(const SendRequest &request) {
+  return request.reply_to == -1 && request.photo.empty();
+}
+
+size_t SendQueue::CountChars(const std::string &text) {
+  size_t chars = 0;
+  for (unsigned char c : text) {
+    chars += (c & 0xC0) != 0x80;
+  }
+  return chars;
+}
+
+void SendQueue::PromoteDelayed(Clock::time_point now) {
+  while (!delayed_.empty() && delayed_.begin()->first <= now) {
+    ready_.push_back(delayed_.begin()->second);
+    delayed_.erase(delayed_.begin());
+  }
+}
+
+std::vector<SendRequest> SendQueue::TakeRequests(ChatQueue &chat) {
+  std::vector<SendRequest> requests;
+  requests.push_back(std::move(chat.requests.front()));
+  chat.requests.pop_front();
+  if (!coalesce_ || !Mergeable(requests.front())) {
+    return requests;
+  }
+  size_t chars = CountChars(requests.front().text);
+  while (!chat.requests.empty() && Mergeable(chat.requests.front())) {
+    size_t next_chars = CountChars(chat.requests.front().text);
+    if (chars + 1 + next_chars > kMaxMessageLength) {
+      break;
+    }
+    chars += 1 + next_chars;
+    requests.push_back(std::move(chat.requests.front()));
+    chat.requests.pop_front();
+  }
+  return requests;
+}
+
+void SendQueue::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    PromoteDelayed(Clock::now());
+    if (ready_.empty()) {
+      if (stop_ && delayed_.empty()) {
+        // отправлять больше нечего: чаты в полёте доделают другие потоки
+        return;
+      }
+      if (delayed_.empty()) {
+        not_empty_.wait(lock);
+      } else {
+        not_empty_.wait_until(lock, delayed_.begin()->first);
+      }
+      continue;
+    }
+    int64_t chat_id = ready_.front();
+    ready_.pop_front();
+    if (limiter_) {
+      Clock::duration wait = limiter_->TryAcquire(chat_id);
+      if (wait != Clock::duration::zero()) {
+        delayed_.emplace(Clock::now() + wait, chat_id);
+        continue;
+      }
+    }
+    ChatQueue &chat = chats_[chat_id];
+    std::vector<SendRequest> requests = TakeRequests(chat);
+    chat.in_flight = true;
+    lock.unlock();
+
+    SendRequest &request = requests.front();
+    for (size_t idx = 1; idx < requests.size(); ++idx) {
+      request.text += '\n';
+      request.text += requests[idx].text;
+    }
+    SentMessage message;
+    std::exception_ptr error;
+    try {
+      message = sender_(request);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (SendRequest &merged : requests) {
+      try {
+        Complete(merged, message, error);
+      } catch (...) {
+        // исключение из callback не должно убивать отправителя
+      }
+    }
+
+    lock.lock();
+    pending_ -= requests.size();
+    ChatQueue &current = chats_[chat_id];
+    current.in_flight = false;
+    if (current.requests.empty()) {
+      chats_.erase(chat_id);
+    } else {
+      ready_.push_back(chat_id);
+      not_empty_.notify_one();
+    }
+    not_full_.notify_all();
+  }
+}
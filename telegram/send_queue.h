@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rate_limiter.h"
+
+// ответ sendMessage: что и куда реально отправилось
+struct SentMessage {
+  int64_t chat_id = 0;
+  int64_t message_id = 0;
+};
+
+struct SendQueueStopped : public std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+// очередь остановлена или отменена: сообщение не отправлялось
+
+using SendCallback =
+    std::function<void(const SentMessage &, std::exception_ptr)>;
+// error == nullptr - сообщение отправлено
+
+struct SendRequest {
+  int64_t chat_id = 0;
+  std::string text;
+  int64_t reply_to = -1;
+  std::string photo;
+  // sendPhoto: путь к файлу, file_id или url, text тогда подпись; такие
+  // сообщения не склеиваются с соседними
+  uint64_t trace = 0;
+  // trace_id обработчика, поставившего сообщение (tracing.h)
+  std::promise<SentMessage> promise;
+  SendCallback callback;
+  // если callback задан, promise не используется
+};
+
+// очередь исходящих сообщений: несколько отправителей работают параллельно
+// по своим keep-alive соединениям из пула, так что обработчик может
+// поставить много ответов и не ждать RTT на каждый
+// сообщения одного чата отправляются строго по очереди (не больше одного
+// запроса на чат в полёте), иначе telegram может переставить их местами
+// перед отправкой берём токены из RateLimiter; чат без токенов откладывается
+// до нужного момента, а остальные чаты продолжают отправляться
+// если к моменту отправки в чат накопилось несколько обычных (не reply)
+// сообщений, они склеиваются в одно в пределах kMaxMessageLength символов
+class SendQueue {
+public:
+  using Sender = std::function<SentMessage(const SendRequest &)>;
+
+  static constexpr size_t kMaxMessageLength = 4096;
+
+  SendQueue(size_t senders, size_t capacity, Sender sender,
+            std::shared_ptr<RateLimiter> limiter = nullptr,
+            bool coalesce = true);
+  SendQueue(const SendQueue &) = delete;
+  SendQueue &operator=(const SendQueue &) = delete;
+  ~SendQueue();
+
+  void Push(SendRequest request);
+  // блокируется, если в очереди уже capacity сообщений
+
+  void Stop();
+  // отправить всё, что уже в очереди, и остановить потоки
+
+  bool Drain(std::chrono::steady_clock::time_point deadline);
+  // дождаться отправки всего, что в очереди; false, если не успели
+
+  void Cancel();
+  // завершить ошибкой всё, что ещё не ушло, дождаться запросов в полёте
+  // и остановить потоки
+
+  size_t Pending() const;
+
+private:
+  struct ChatQueue {
+    std::deque<SendRequest> requests;
+    bool in_flight = false;
+  };
+
+  using Clock = RateLimiter::Clock;
+
+  void Run();
+  void PromoteDelayed(Clock::time_point now);
+  std::vector<SendRequest> TakeRequests(ChatQueue &chat);
+  static bool Mergeable(const SendRequest &request);
+  static size_t CountChars(const std::string &text);
+  static void Complete(SendRequest &request, const SentMessage &message,
+                       std::exception_ptr error);
+
+  const size_t capacity_;
+  const Sender sender_;
+  const std::shared_ptr<RateLimiter> limiter_;
+  const bool coalesce_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::unordered_map<int64_t, ChatQueue> chats_;
+  std::deque<int64_t> ready_;
+  // чаты, у которых есть что отправить и нет запроса в полёте
+  std::multimap<Clock::time_point, int64_t> delayed_;
+  // чаты, которые ждут токенов лимитера
+  size_t pending_ = 0;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
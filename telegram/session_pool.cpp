@@ -0,0 +1,169 @@
+#include "session_pool.h"
+
+#include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/Net/NetSSL.h>
+#include <Poco/Net/RejectCertificateHandler.h>
+#include <Poco/Net/SSLManager.h>
+#include <Poco/SharedPtr.h>
+#include <Poco/Timespan.h>
+
+SessionPool::Lease::Lease(SessionPool *pool, HostGroup *group,
+                          std::unique_ptr<Poco::Net::HTTPClientSession> session,
+                          bool reused, LongPollSlot *slot)
+    : pool_(pool), group_(group), session_(std::move(session)),
+      reused_(reused), slot_(slot) {}
+
+SessionPool::Lease::Lease(Lease &&other) noexcept
+    : pool_(other.pool_), group_(other.group_),
+      session_(std::move(other.session_)), reused_(other.reused_),
+      slot_(other.slot_), recyclable_(other.recyclable_) {
+  other.pool_ = nullptr;
+}
+
+SessionPool::Lease &SessionPool::Lease::operator=(Lease &&other) noexcept {
+  if (this != &other) {
+    Return();
+    pool_ = other.pool_;
+    group_ = other.group_;
+    session_ = std::move(other.session_);
+    reused_ = other.reused_;
+    slot_ = other.slot_;
+    recyclable_ = other.recyclable_;
+    other.pool_ = nullptr;
+  }
+  return *this;
+}
+
+SessionPool::Lease::~Lease() { Return(); }
+
+void SessionPool::Lease::Reconnect() {
+  session_->reset();
+  reused_ = false;
+}
+
+void SessionPool::Lease::Recycle() { recyclable_ = true; }
+
+void SessionPool::Lease::Return() {
+  if (pool_ != nullptr && session_ != nullptr && recyclable_) {
+    pool_->Release(group_, std::move(session_), slot_);
+  }
+  pool_ = nullptr;
+  session_.reset();
+}
+
+SessionPool::SessionPool(size_t max_idle_per_host,
+                         std::chrono::seconds keep_alive_timeout)
+    : max_idle_per_host_(max_idle_per_host),
+      keep_alive_timeout_(keep_alive_timeout) {}
+
+std::string SessionPool::MakeKey(const Poco::URI &uri) {
+  return uri.getScheme() + "://" + uri.getHost() + ":" +
+         std::to_string(uri.getPort());
+}
+
+Poco::Net::Context::Ptr SessionPool::ClientContext() {
+  static std::once_flag once;
+  static Poco::Net::Context::Ptr context;
+  std::call_once(once, [] {
+    Poco::Net::initializeSSL();
+    context = new Poco::Net::Context(Poco::Net::Context::CLIENT_USE, "", "", "",
+                                     Poco::Net::Context::VERIFY_RELAXED, 9,
+                                     true);
+    // клиентский кэш сессий + session tickets (OpenSSL включает их по
+    // умолчанию) дают resumption при переподключении
+    context->enableSessionCache(true);
+    Poco::SharedPtr<Poco::Net::InvalidCertificateHandler> certificate_handler =
+        new Poco::Net::RejectCertificateHandler(false);
+    Poco::Net::SSLManager::instance().initializeClient(
+        nullptr, certificate_handler, context);
+  });
+  return context;
+}
+
+std::unique_ptr<Poco::Net::HTTPClientSession>
+SessionPool::CreateSession(const HostGroup &group,
+                           Poco::Net::Session::Ptr tls_session) {
+  std::unique_ptr<Poco::Net::HTTPClientSession> session;
+  if (group.scheme == "https") {
+    session = std::make_unique<Poco::Net::HTTPSClientSession>(
+        group.host, group.port, ClientContext(), tls_session);
+  } else {
+    session =
+        std::make_unique<Poco::Net::HTTPClientSession>(group.host, group.port);
+  }
+  session->setKeepAlive(true);
+  session->setKeepAliveTimeout(
+      Poco::Timespan(keep_alive_timeout_.count(), 0));
+  return session;
+}
+
+SessionPool::HostGroup *SessionPool::Resolve(const Poco::URI &uri) {
+  std::string key = MakeKey(uri);
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto [it, inserted] = groups_.try_emplace(std::move(key));
+  HostGroup &group = it->second;
+  if (inserted) {
+    group.scheme = uri.getScheme();
+    group.host = uri.getHost();
+    group.port = uri.getPort();
+  }
+  return &group;
+}
+
+SessionPool::Lease SessionPool::Acquire(HostGroup *group) {
+  Poco::Net::Session::Ptr tls_session;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!group->idle.empty()) {
+      auto session = std::move(group->idle.back());
+      group->idle.pop_back();
+      return Lease(this, group, std::move(session), true, nullptr);
+    }
+    tls_session = group->tls_session;
+  }
+  return Lease(this, group, CreateSession(*group, tls_session), false,
+               nullptr);
+}
+
+SessionPool::Lease SessionPool::AcquireLongPoll(HostGroup *group,
+                                                LongPollSlot *slot) {
+  Poco::Net::Session::Ptr tls_session;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (slot->session != nullptr) {
+      return Lease(this, group, std::move(slot->session), true, slot);
+    }
+    tls_session = group->tls_session;
+  }
+  return Lease(this, group, CreateSession(*group, tls_session), false, slot);
+}
+
+void SessionPool::Release(HostGroup *group,
+                          std::unique_ptr<Poco::Net::HTTPClientSession> session,
+                          LongPollSlot *slot) {
+  Poco::Net::Session::Ptr tls_session;
+  if (auto *https =
+          dynamic_cast<Poco::Net::HTTPSClientSession *>(session.get())) {
+    tls_session = https->sslSession();
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (tls_session) {
+    group->tls_session = tls_session;
+  }
+  if (slot != nullptr) {
+    if (slot->session == nullptr) {
+      slot->session = std::move(session);
+    }
+  } else if (group->idle.size() < max_idle_per_host_) {
+    group->idle.push_back(std::move(session));
+  }
+}
+
+void SessionPool::Clear() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  // сами группы не удаляем: на них ссылаются клиенты и выданные Lease
+  for (auto &[key, group] : groups_) {
+    group.idle.clear();
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Poco/Net/Context.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/Session.h>
+#include <Poco/URI.h>
+
+// пул keep-alive сессий, сгруппированных по хосту (scheme://host:port)
+// каждая группа хранит свободные сессии для обычных запросов; соединение
+// под long-poll getUpdates у каждого клиента своё (LongPollSlot), чтобы он
+// не занимал сокеты sendMessage, а боты с общим пулом (BotHost) не
+// отбирали друг у друга одно соединение на хост
+// для https сессии создаются с общим на процесс TLS контекстом, а последняя
+// TLS-сессия хоста переиспользуется при переподключении (без полного handshake)
+class SessionPool {
+public:
+  struct HostGroup;
+  // группа соединений одного хоста; адрес стабилен, пока жив пул, поэтому
+  // клиент находит её один раз (Resolve) и дальше не строит ключ на запрос
+
+  struct LongPollSlot {
+    std::unique_ptr<Poco::Net::HTTPClientSession> session;
+  };
+  // свободное long-poll соединение одного клиента; живёт дольше его Lease,
+  // доступ под мьютексом пула
+
+  class Lease {
+  public:
+    Lease() = default;
+    Lease(SessionPool *pool, HostGroup *group,
+          std::unique_ptr<Poco::Net::HTTPClientSession> session, bool reused,
+          LongPollSlot *slot);
+    Lease(Lease &&other) noexcept;
+    Lease &operator=(Lease &&other) noexcept;
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+    ~Lease();
+
+    Poco::Net::HTTPClientSession &operator*() const { return *session_; }
+    Poco::Net::HTTPClientSession *operator->() const { return session_.get(); }
+
+    bool Reused() const { return reused_; }
+    // сессия взята из пула, а не открыта только что
+
+    void Reconnect();
+    // закрыть (возможно протухший) сокет, следующий запрос откроет новый
+
+    void Recycle();
+    // ответ дочитан до конца, сессию можно вернуть в пул
+    // без вызова сессия закрывается в деструкторе (например, при исключении)
+
+  private:
+    void Return();
+
+    SessionPool *pool_ = nullptr;
+    HostGroup *group_ = nullptr;
+    std::unique_ptr<Poco::Net::HTTPClientSession> session_;
+    bool reused_ = false;
+    LongPollSlot *slot_ = nullptr;
+    // nullptr - обычная сессия, возвращается в idle группы
+    bool recyclable_ = false;
+  };
+
+  explicit SessionPool(
+      size_t max_idle_per_host = 8,
+      std::chrono::seconds keep_alive_timeout = std::chrono::seconds(30));
+
+  HostGroup *Resolve(const Poco::URI &uri);
+
+  Lease Acquire(HostGroup *group);
+  Lease Acquire(const Poco::URI &uri) { return Acquire(Resolve(uri)); }
+  // сессия для исходящих запросов (sendMessage, getMe)
+
+  Lease AcquireLongPoll(HostGroup *group, LongPollSlot *slot);
+  // выделенная сессия для long-poll getUpdates: из slot или новая,
+  // возвращается в тот же slot
+
+  void Clear();
+  // закрыть все свободные соединения (группы хостов остаются); long-poll
+  // соединения закрываются вместе с владельцами слотов
+
+  struct HostGroup {
+    std::string scheme;
+    std::string host;
+    uint16_t port = 0;
+    std::vector<std::unique_ptr<Poco::Net::HTTPClientSession>> idle;
+    Poco::Net::Session::Ptr tls_session;
+    // последняя TLS-сессия хоста для resumption
+  };
+
+private:
+  static std::string MakeKey(const Poco::URI &uri);
+  static Poco::Net::Context::Ptr ClientContext();
+  // TLS контекст, инициализируется один раз на процесс
+  std::unique_ptr<Poco::Net::HTTPClientSession>
+  CreateSession(const HostGroup &group, Poco::Net::Session::Ptr tls_session);
+  void Release(HostGroup *group,
+               std::unique_ptr<Poco::Net::HTTPClientSession> session,
+               LongPollSlot *slot);
+
+  const size_t max_idle_per_host_;
+  const std::chrono::seconds keep_alive_timeout_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, HostGroup> groups_;
+};
@@ -0,0 +1,59 @@
+#include "shutdown_signals.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+#include <pthread.h>
+
+namespace {
+
+sigset_t ShutdownSet() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  return set;
+}
+
+} // namespace
+
+ShutdownSignals::ShutdownSignals() {
+  sigset_t set = ShutdownSet();
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+ShutdownSignals::~ShutdownSignals() { Unwatch(); }
+
+void ShutdownSignals::Unwatch() {
+  if (watcher_.joinable()) {
+    // будим sigwait своим же сигналом, done_ говорит, что это не остановка
+    done_ = true;
+    pthread_kill(watcher_.native_handle(), SIGTERM);
+    watcher_.join();
+  }
+  done_ = false;
+}
+
+void ShutdownSignals::Watch(std::function<void()> on_shutdown) {
+  on_shutdown_ = std::move(on_shutdown);
+  watcher_ = std::thread([this] { Run(); });
+}
+
+void ShutdownSignals::Run() {
+  sigset_t set = ShutdownSet();
+  bool stopping = false;
+  while (true) {
+    int signal = 0;
+    if (sigwait(&set, &signal) != 0 || done_) {
+      return;
+    }
+    if (stopping) {
+      std::cerr << "signal " << signal << " again, exiting now" << std::endl;
+      std::_Exit(EXIT_FAILURE);
+    }
+    stopping = true;
+    std::cerr << "signal " << signal << ", shutting down" << std::endl;
+    on_shutdown_();
+  }
+}
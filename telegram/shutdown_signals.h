@@ -0,0 +1,31 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+// SIGTERM/SIGINT для штатной остановки
+// конструктор блокирует сигналы в вызывающем потоке, поэтому создавать его
+// нужно до запуска любых потоков: они унаследуют маску, и сигнал получит
+// только отдельный поток с sigwait, где можно спокойно звать Stop()
+// вторым сигналом процесс завершается сразу, если остановка затянулась
+class ShutdownSignals {
+public:
+  ShutdownSignals();
+  ShutdownSignals(const ShutdownSignals &) = delete;
+  ShutdownSignals &operator=(const ShutdownSignals &) = delete;
+  ~ShutdownSignals();
+
+  void Watch(std::function<void()> on_shutdown);
+  // запустить поток, который позовёт on_shutdown на первый сигнал
+
+  void Unwatch();
+  // остановить поток; звать до разрушения того, что трогает on_shutdown
+
+private:
+  void Run();
+
+  std::function<void()> on_shutdown_;
+  std::thread watcher_;
+  std::atomic<bool> done_{false};
+};
@@ -0,0 +1,97 @@
+#include "status_server.h"
+#include "metrics.h"
+
+#include <sstream>
+
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/URI.h>
+
+namespace {
+
+class StatusHandler : public Poco::Net::HTTPRequestHandler {
+public:
+  explicit StatusHandler(const std::map<std::string, StatusServer::Handler>
+                             &routes)
+      : routes_(routes) {}
+
+  void handleRequest(Poco::Net::HTTPServerRequest &request,
+                     Poco::Net::HTTPServerResponse &response) override {
+    StatusServer::Reply reply;
+    auto route = routes_.find(Poco::URI(request.getURI()).getPath());
+    if (request.getMethod() != "GET") {
+      reply.status = Poco::Net::HTTPResponse::HTTP_METHOD_NOT_ALLOWED;
+    } else if (route == routes_.end()) {
+      reply.status = Poco::Net::HTTPResponse::HTTP_NOT_FOUND;
+    } else {
+      reply = route->second();
+    }
+    response.setStatus(
+        static_cast<Poco::Net::HTTPResponse::HTTPStatus>(reply.status));
+    response.setContentType(reply.content_type);
+    response.setContentLength(reply.body.size());
+    response.send() << reply.body;
+  }
+
+private:
+  const std::map<std::string, StatusServer::Handler> &routes_;
+};
+
+class StatusHandlerFactory : public Poco::Net::HTTPRequestHandlerFactory {
+public:
+  explicit StatusHandlerFactory(
+      const std::map<std::string, StatusServer::Handler> &routes)
+      : routes_(routes) {}
+
+  Poco::Net::HTTPRequestHandler *
+  createRequestHandler(const Poco::Net::HTTPServerRequest &) override {
+    return new StatusHandler(routes_);
+  }
+
+private:
+  const std::map<std::string, StatusServer::Handler> &routes_;
+};
+
+} // namespace
+
+StatusServer::StatusServer(Options options) : options_(options) {
+  Route("/metrics", [] {
+    std::ostringstream body;
+    GlobalMetrics().WritePrometheus(body);
+    Reply reply;
+    reply.body = body.str();
+    return reply;
+  });
+}
+
+StatusServer::~StatusServer() { Stop(); }
+
+void StatusServer::Route(std::string path, Handler handler) {
+  routes_[std::move(path)] = std::move(handler);
+}
+
+void StatusServer::Start() {
+  socket_.reset(new Poco::Net::ServerSocket(options_.port));
+  auto *params = new Poco::Net::HTTPServerParams();
+  params->setMaxThreads(options_.threads);
+  server_.reset(new Poco::Net::HTTPServer(new StatusHandlerFactory(routes_),
+                                          *socket_, params));
+  server_->start();
+}
+
+void StatusServer::Stop() {
+  if (server_) {
+    server_->stop();
+    server_.reset();
+    socket_.reset();
+  }
+}
+
+uint16_t StatusServer::Port() const {
+  return socket_ ? socket_->address().port() : options_.port;
+}
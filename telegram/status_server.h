@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace Poco {
+namespace Net {
+class HTTPServer;
+class ServerSocket;
+} // namespace Net
+} // namespace Poco
+
+// служебный http: GET /metrics (prometheus) и другие страницы для
+// мониторинга (BotHost добавляет /healthz и /ready); отдельный порт, чтобы
+// не открывать его вместе с webhook
+class StatusServer {
+public:
+  struct Options {
+    uint16_t port = 9100;
+    int threads = 2;
+  };
+
+  struct Reply {
+    int status = 200;
+    std::string content_type = "text/plain; version=0.0.4; charset=utf-8";
+    std::string body;
+  };
+  using Handler = std::function<Reply()>;
+
+  explicit StatusServer(Options options);
+  StatusServer(const StatusServer &) = delete;
+  StatusServer &operator=(const StatusServer &) = delete;
+  ~StatusServer();
+
+  void Route(std::string path, Handler handler);
+  // добавить страницу; только до Start, /metrics есть всегда
+
+  void Start();
+  void Stop();
+
+  uint16_t Port() const;
+
+private:
+  const Options options_;
+  std::map<std::string, Handler> routes_;
+  std::unique_ptr<Poco::Net::ServerSocket> socket_;
+  std::unique_ptr<Poco::Net::HTTPServer> server_;
+};
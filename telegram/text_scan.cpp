@@ -0,0 +1,215 @@
+#include "text_scan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define TEXT_SCAN_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TEXT_SCAN_NEON 1
+#endif
+
+namespace {
+
+// сколько utf-16 единиц дают байты: каждый байт, кроме продолжений
+// (10xxxxxx), начинает символ, а 4-байтные (11110xxx) дают суррогатную пару
+size_t UnitsScalar(const unsigned char *data, size_t size) {
+  size_t units = 0;
+  for (size_t idx = 0; idx < size; ++idx) {
+    units += (data[idx] & 0xC0) != 0x80;
+    units += data[idx] >= 0xF0;
+  }
+  return units;
+}
+
+// блочные версии: пропускают целые блоки, пока units + блок < target,
+// и возвращают число пропущенных байт; остаток дорабатывает скаляр
+using SkipFunction = size_t (*)(const unsigned char *data, size_t size,
+                                size_t &units, size_t target);
+
+#if !TEXT_SCAN_X86 && !TEXT_SCAN_NEON
+// нужна только сборке без SIMD, иначе ChooseSkip её не выбирает
+size_t SkipScalar(const unsigned char *data, size_t size, size_t &units,
+                  size_t target) {
+  constexpr size_t kBlock = 8;
+  size_t pos = 0;
+  for (; pos + kBlock <= size; pos += kBlock) {
+    size_t block = UnitsScalar(data + pos, kBlock);
+    if (units + block >= target) {
+      break;
+    }
+    units += block;
+  }
+  return pos;
+}
+#endif
+
+#if TEXT_SCAN_X86
+size_t SkipSse2(const unsigned char *data, size_t size, size_t &units,
+                size_t target) {
+  const __m128i continuation = _mm_set1_epi8(-64);
+  // 0x80..0xBF как знаковые - это -128..-65, то есть меньше -64
+  const __m128i four_byte = _mm_set1_epi8(-17);
+  // 0xF0..0xFF - это -16..-1
+  const __m128i zero = _mm_setzero_si128();
+  size_t pos = 0;
+  for (; pos + 16 <= size; pos += 16) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+    unsigned tails = _mm_movemask_epi8(_mm_cmplt_epi8(bytes, continuation));
+    unsigned pairs = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpgt_epi8(bytes, four_byte), _mm_cmplt_epi8(bytes, zero)));
+    size_t block = 16 - __builtin_popcount(tails) + __builtin_popcount(pairs);
+    if (units + block >= target) {
+      break;
+    }
+    units += block;
+  }
+  return pos;
+}
+
+__attribute__((target("avx2"))) size_t
+SkipAvx2(const unsigned char *data, size_t size, size_t &units, size_t target) {
+  const __m256i continuation = _mm256_set1_epi8(-64);
+  const __m256i four_byte = _mm256_set1_epi8(-17);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t pos = 0;
+  for (; pos + 32 <= size; pos += 32) {
+    __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+    uint32_t tails = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpgt_epi8(continuation, bytes)));
+    uint32_t pairs = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpgt_epi8(bytes, four_byte),
+                         _mm256_cmpgt_epi8(zero, bytes))));
+    size_t block = 32 - __builtin_popcount(tails) + __builtin_popcount(pairs);
+    if (units + block >= target) {
+      break;
+    }
+    units += block;
+  }
+  // хвост короче 32 байт добираем SSE2
+  return pos + SkipSse2(data + pos, size - pos, units, target);
+}
+#endif
+
+#if TEXT_SCAN_NEON
+size_t SkipNeon(const unsigned char *data, size_t size, size_t &units,
+                size_t target) {
+  const uint8x16_t one = vdupq_n_u8(1);
+  size_t pos = 0;
+  for (; pos + 16 <= size; pos += 16) {
+    uint8x16_t bytes = vld1q_u8(data + pos);
+    uint8x16_t starts = vmvnq_u8(
+        vceqq_u8(vandq_u8(bytes, vdupq_n_u8(0xC0)), vdupq_n_u8(0x80)));
+    uint8x16_t pairs = vcgeq_u8(bytes, vdupq_n_u8(0xF0));
+    size_t block = vaddvq_u8(vandq_u8(starts, one)) +
+                   vaddvq_u8(vandq_u8(pairs, one));
+    if (units + block >= target) {
+      break;
+    }
+    units += block;
+  }
+  return pos;
+}
+#endif
+
+SkipFunction ChooseSkip() {
+#if TEXT_SCAN_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return SkipAvx2;
+  }
+  return SkipSse2;
+#elif TEXT_SCAN_NEON
+  return SkipNeon;
+#else
+  return SkipScalar;
+#endif
+}
+
+SkipFunction Skip() {
+  static const SkipFunction skip = ChooseSkip();
+  return skip;
+}
+
+bool IsCommandChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+} // namespace
+
+size_t Utf16Cursor::ToByte(size_t utf16_offset) {
+  if (utf16_offset < units_) {
+    byte_ = 0;
+    units_ = 0;
+  }
+  const auto *data = reinterpret_cast<const unsigned char *>(text_.data());
+  byte_ += Skip()(data + byte_, text_.size() - byte_, units_, utf16_offset);
+  // после блока byte_ может стоять на продолжении символа, начатого в нём
+  while (byte_ < text_.size()) {
+    unsigned char c = data[byte_];
+    if ((c & 0xC0) != 0x80) {
+      if (units_ >= utf16_offset) {
+        break;
+      }
+      units_ += c >= 0xF0 ? 2 : 1;
+    }
+    ++byte_;
+  }
+  return byte_;
+}
+
+std::string_view Utf16Cursor::Slice(size_t utf16_offset, size_t utf16_length) {
+  size_t begin = ToByte(utf16_offset);
+  size_t end = ToByte(utf16_offset + utf16_length);
+  return text_.substr(begin, end - begin);
+}
+
+size_t Utf16Length(std::string_view text) {
+  size_t units = 0;
+  const auto *data = reinterpret_cast<const unsigned char *>(text.data());
+  size_t pos = Skip()(data, text.size(), units, SIZE_MAX);
+  return units + UnitsScalar(data + pos, text.size() - pos);
+}
+
+std::string_view NextBotCommand(std::string_view text, size_t &pos) {
+  constexpr size_t kMaxName = 32;
+  // ограничение telegram на длину имени команды
+  while (pos < text.size()) {
+    const void *found = std::memchr(text.data() + pos, '/', text.size() - pos);
+    if (found == nullptr) {
+      pos = text.size();
+      break;
+    }
+    size_t begin = static_cast<const char *>(found) - text.data();
+    size_t end = begin + 1;
+    while (end < text.size() && end - begin <= kMaxName &&
+           IsCommandChar(text[end])) {
+      ++end;
+    }
+    pos = end;
+    if ((begin != 0 && !IsSpace(text[begin - 1])) || end == begin + 1 ||
+        (end < text.size() && (IsCommandChar(text[end]) || text[end] == '/'))) {
+      continue;
+    }
+    if (end < text.size() && text[end] == '@') {
+      size_t bot = end + 1;
+      while (bot < text.size() && IsCommandChar(text[bot])) {
+        ++bot;
+      }
+      if (bot > end + 1) {
+        end = bot;
+        pos = end;
+      }
+    }
+    return text.substr(begin, end - begin);
+  }
+  return {};
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// offset и length сущностей telegram считаются в единицах utf-16, а текст у
+// нас в utf-8; Utf16Cursor переводит одно в другое, пропуская ascii и
+// кириллицу блоками по 16/32 байта (SSE2/AVX2/NEON, иначе скаляр)
+class Utf16Cursor {
+public:
+  explicit Utf16Cursor(std::string_view text) : text_(text) {}
+
+  size_t ToByte(size_t utf16_offset);
+  // байтовая позиция начала символа с данным utf-16 смещением (или конец
+  // текста); выгоднее спрашивать по возрастанию - обход продолжается с
+  // прошлой позиции, при шаге назад начинается заново
+
+  std::string_view Slice(size_t utf16_offset, size_t utf16_length);
+  // кусок текста по offset/length сущности
+
+private:
+  std::string_view text_;
+  size_t byte_ = 0;
+  size_t units_ = 0;
+  // utf-16 единиц в text_[0, byte_)
+};
+
+size_t Utf16Length(std::string_view text);
+
+std::string_view NextBotCommand(std::string_view text, size_t &pos);
+// команда вида /name или /name@bot, начинающаяся с pos или дальше, в начале
+// текста или после пробела; pos сдвигается за неё, пустой результат - больше
+// команд нет; для сообщений без entities
@@ -0,0 +1,189 @@
+#include "tracing.h"
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// слот кольца под seqlock: писатель (поток-владелец) делает seq нечётным,
+// пишет поля и публикует чётный seq с номером записи; читатель берёт слот,
+// только если seq до и после чтения совпал и чётный
+struct Slot {
+  std::atomic<uint64_t> seq{0};
+  std::atomic<uint64_t> trace{0};
+  std::atomic<const char *> name{nullptr};
+  std::atomic<int64_t> start_us{0};
+  std::atomic<int64_t> duration_us{0};
+};
+
+struct ThreadBuffer {
+  std::array<Slot, kTraceSpansPerThread> slots;
+  uint64_t next = 0;
+  // пишет только поток-владелец
+  size_t thread = 0;
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  // все буферы для экспорта: их столько, сколько потоков писали спаны
+  // одновременно, а не за всё время (std::async на запрос и т.п.)
+  std::vector<std::shared_ptr<ThreadBuffer>> free;
+  // буферы завершившихся потоков: спаны в них ещё экспортируются, пока
+  // кольцо не продолжит следующий поток
+};
+
+Registry &GlobalRegistry() {
+  static Registry registry;
+  return registry;
+}
+
+// буфер потока берётся из free или создаётся при первом спане и
+// возвращается в free, когда поток завершается
+class BufferOwner {
+public:
+  BufferOwner() {
+    Registry &registry = GlobalRegistry();
+    std::lock_guard<std::mutex> guard(registry.mutex);
+    if (!registry.free.empty()) {
+      // next не сбрасываем: seq слотов растёт дальше, и читатель не примет
+      // новую запись за старую
+      buffer_ = std::move(registry.free.back());
+      registry.free.pop_back();
+      return;
+    }
+    buffer_ = std::make_shared<ThreadBuffer>();
+    buffer_->thread = registry.buffers.size() + 1;
+    registry.buffers.push_back(buffer_);
+  }
+  BufferOwner(const BufferOwner &) = delete;
+  BufferOwner &operator=(const BufferOwner &) = delete;
+  ~BufferOwner() {
+    Registry &registry = GlobalRegistry();
+    std::lock_guard<std::mutex> guard(registry.mutex);
+    registry.free.push_back(std::move(buffer_));
+  }
+
+  ThreadBuffer &Buffer() { return *buffer_; }
+
+private:
+  std::shared_ptr<ThreadBuffer> buffer_;
+};
+
+ThreadBuffer &LocalBuffer() {
+  thread_local BufferOwner owner;
+  return owner.Buffer();
+}
+
+std::atomic<uint64_t> sample_threshold{0};
+// апдейт сэмплируется, если случайное 64-битное число не больше порога
+std::atomic<TraceId> next_trace{1};
+thread_local TraceId current_trace = 0;
+
+uint64_t NextRandom() {
+  // xorshift64*: генератор на поток, без блокировок
+  thread_local uint64_t state =
+      0x9E3779B97F4A7C15ull ^
+      reinterpret_cast<uintptr_t>(&state) ^
+      static_cast<uint64_t>(
+          std::chrono::steady_clock::now().time_since_epoch().count());
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Dull;
+}
+
+int64_t Micros(std::chrono::steady_clock::time_point point) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             point.time_since_epoch())
+      .count();
+}
+
+} // namespace
+
+void SetTraceSampleRate(double rate) {
+  uint64_t threshold = 0;
+  if (rate >= 1) {
+    threshold = UINT64_MAX;
+  } else if (rate > 0) {
+    threshold = static_cast<uint64_t>(std::ldexp(rate, 64));
+  }
+  sample_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+TraceId SampleTrace() {
+  uint64_t threshold = sample_threshold.load(std::memory_order_relaxed);
+  if (threshold == 0 || NextRandom() > threshold) {
+    return 0;
+  }
+  return next_trace.fetch_add(1, std::memory_order_relaxed);
+}
+
+TraceId CurrentTrace() { return current_trace; }
+
+ScopedTrace::ScopedTrace(TraceId trace) : previous_(current_trace) {
+  current_trace = trace;
+}
+
+ScopedTrace::~ScopedTrace() { current_trace = previous_; }
+
+void RecordSpan(TraceId trace, const char *name,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end) {
+  if (trace == 0) {
+    return;
+  }
+  ThreadBuffer &buffer = LocalBuffer();
+  uint64_t record = buffer.next++;
+  Slot &slot = buffer.slots[record % kTraceSpansPerThread];
+  slot.seq.store(2 * record + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.trace.store(trace, std::memory_order_relaxed);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start_us.store(Micros(start), std::memory_order_relaxed);
+  slot.duration_us.store(Micros(end) - Micros(start),
+                         std::memory_order_relaxed);
+  slot.seq.store(2 * record + 2, std::memory_order_release);
+}
+
+void WriteChromeTrace(std::ostream &out) {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    Registry &registry = GlobalRegistry();
+    std::lock_guard<std::mutex> guard(registry.mutex);
+    buffers = registry.buffers;
+  }
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto &buffer : buffers) {
+    for (const Slot &slot : buffer->slots) {
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq == 0 || seq % 2 != 0) {
+        continue;
+      }
+      TraceId trace = slot.trace.load(std::memory_order_relaxed);
+      const char *name = slot.name.load(std::memory_order_relaxed);
+      int64_t start_us = slot.start_us.load(std::memory_order_relaxed);
+      int64_t duration_us = slot.duration_us.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq) {
+        // слот перезаписан, пока мы его читали
+        continue;
+      }
+      out << (first ? "" : ",") << "\n{\"name\":\"" << name
+          << "\",\"cat\":\"bot\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+          << buffer->thread << ",\"ts\":" << start_us
+          << ",\"dur\":" << duration_us << ",\"args\":{\"trace_id\":\""
+          << std::hex << std::setw(16) << std::setfill('0') << trace
+          << std::dec << std::setfill(' ') << "\"}}";
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// трассировка отдельных апдейтов: в FormCppStructFromJson апдейт с
+// вероятностью sample rate получает trace_id, и дальше по конвейеру (очередь
+// воркера, обработчик команды, sendMessage) пишутся спаны с этим id
+// спаны ложатся в кольцевой буфер своего потока без блокировок, экспорт
+// (/trace на StatusServer) собирает буферы в Chrome trace JSON, который
+// открывается в chrome://tracing или Perfetto; буфер завершившегося потока
+// достаётся следующему новому, так что память не растёт с числом потоков
+// при выключенном сэмплинге trace_id всегда 0, и спан - одна проверка
+using TraceId = uint64_t;
+// 0 - апдейт не сэмплирован
+
+void SetTraceSampleRate(double rate);
+// доля трассируемых апдейтов, 0..1; по умолчанию 0
+
+TraceId SampleTrace();
+// новый trace_id или 0, если апдейт не попал в выборку
+
+TraceId CurrentTrace();
+// trace_id, который обрабатывается в этом потоке (ScopedTrace)
+
+class ScopedTrace {
+public:
+  explicit ScopedTrace(TraceId trace);
+  ScopedTrace(const ScopedTrace &) = delete;
+  ScopedTrace &operator=(const ScopedTrace &) = delete;
+  ~ScopedTrace();
+
+private:
+  TraceId previous_;
+};
+// сделать trace текущим для потока до конца области (SendMessage в
+// обработчике подхватывает его сам)
+
+void RecordSpan(TraceId trace, const char *name,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end);
+// name - строковый литерал: буфер хранит указатель
+
+// спан от конструктора до деструктора; с trace == 0 ничего не делает
+class TraceSpan {
+public:
+  TraceSpan(TraceId trace, const char *name)
+      : trace_(trace), name_(name) {
+    if (trace_ != 0) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  explicit TraceSpan(const char *name) : TraceSpan(CurrentTrace(), name) {}
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+  ~TraceSpan() {
+    if (trace_ != 0) {
+      RecordSpan(trace_, name_, start_, std::chrono::steady_clock::now());
+    }
+  }
+
+private:
+  const TraceId trace_;
+  const char *const name_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+void WriteChromeTrace(std::ostream &out);
+// все спаны, что ещё лежат в буферах потоков (по kTraceSpansPerThread
+// последних на поток), в формате {"traceEvents": [...]}
+
+constexpr size_t kTraceSpansPerThread = 4096;
@@ -0,0 +1,254 @@
+#include "transport.h"
+#include "metrics.h"
+
+#include <Poco/Exception.h>
+#include <Poco/Net/DNS.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/SocketImpl.h>
+#include <Poco/Net/StreamSocket.h>
+#include <Poco/Timespan.h>
+
+#include <sys/socket.h>
+
+#include <limits>
+#include <streambuf>
+
+namespace {
+
+// тело ответа со счётчиком прочитанных байт: Content-Length есть не у всех
+// ответов (chunked), а bytes_in должен сходиться с трафиком
+class CountingStreambuf : public std::streambuf {
+public:
+  void Reset(std::streambuf *source) {
+    source_ = source;
+    count_ = 0;
+    setg(buffer_, buffer_, buffer_);
+  }
+
+  uint64_t Count() const { return count_; }
+
+protected:
+  int_type underflow() override {
+    std::streamsize read = source_->sgetn(buffer_, sizeof(buffer_));
+    if (read <= 0) {
+      return traits_type::eof();
+    }
+    count_ += static_cast<uint64_t>(read);
+    setg(buffer_, buffer_, buffer_ + read);
+    return traits_type::to_int_type(buffer_[0]);
+  }
+
+private:
+  std::streambuf *source_ = nullptr;
+  uint64_t count_ = 0;
+  char buffer_[4096];
+};
+
+class PocoExchange : public TransportExchange {
+public:
+  PocoExchange(SessionPool::Lease session, PollAbort *abort)
+      : session_(std::move(session)), abort_(abort) {}
+  PocoExchange(const PocoExchange &) = delete;
+  PocoExchange &operator=(const PocoExchange &) = delete;
+  ~PocoExchange() override {
+    // до закрытия сокета в ~Lease: Abort не должен попасть в чужой fd
+    if (abort_ != nullptr) {
+      abort_->Detach();
+    }
+  }
+
+  // на новом сокете sendRequest ещё и подключается (tcp + TLS)
+  void Send(ApiCallTimer &timer, const TransportRequest &request,
+            TransportResponse &response) {
+    Poco::Net::HTTPRequest http_request(request.method,
+                                        std::string(request.path),
+                                        Poco::Net::HTTPMessage::HTTP_1_1);
+    if (!request.content_type.empty()) {
+      http_request.setContentType(std::string(request.content_type));
+      http_request.setContentLength(request.body.size());
+    }
+    if (!request.idempotent && session_.Reused() && Stale()) {
+      // закрытый сервером сокет иначе заметили бы только в receiveResponse,
+      // когда тело уже ушло и повторить sendMessage нельзя
+      session_.Reconnect();
+    }
+    while (true) {
+      if (abort_ != nullptr && !abort_->Attach([this] { Cancel(); })) {
+        throw PollAborted("long poll aborted");
+      }
+      // пока тело не начали писать, сервер не получил запрос целиком (у GET
+      // без тела заголовки и есть запрос, но GET-ы у нас идемпотентны)
+      bool sent = false;
+      try {
+        ApiPhase send_phase =
+            session_.Reused() ? ApiPhase::kRequest : ApiPhase::kConnect;
+        std::ostream &request_body = session_->sendRequest(http_request);
+        sent = request.body.empty();
+        if (!sent) {
+          sent = true;
+          request_body.write(request.body.data(), request.body.size());
+        }
+        timer.Phase(send_phase);
+        timer.BytesOut(request.body.size());
+        counter_.Reset(session_->receiveResponse(response_).rdbuf());
+        break;
+      } catch (const Poco::Exception &e) {
+        if (abort_ != nullptr) {
+          // Reconnect закрывает сокет, Abort в этот момент трогать его не
+          // должен; оборванный Abort-ом запрос не повторяем
+          abort_->Detach();
+          if (abort_->Aborted()) {
+            throw PollAborted("long poll aborted");
+          }
+        }
+        if (!sent || request.idempotent) {
+          if (session_.Reused()) {
+            session_.Reconnect();
+            continue;
+          }
+          if (!sent) {
+            throw RequestNotSent(e.displayText());
+          }
+        }
+        throw;
+      }
+    }
+    timer.Phase(ApiPhase::kResponse);
+    timer.SetStatus(response_.getStatus());
+    timer_ = &timer;
+    response.status = response_.getStatus();
+    response.reason = response_.getReason();
+  }
+
+  std::istream &Body() override { return body_; }
+
+  void Finish() override {
+    body_.ignore(std::numeric_limits<std::streamsize>::max());
+    // тело дочитано целиком, так что счётчик - весь ответ
+    timer_->BytesIn(counter_.Count());
+    if (response_.getKeepAlive()) {
+      session_.Recycle();
+    }
+  }
+
+private:
+  bool Stale() {
+    // свободному keep-alive сокету сервер ничего не шлёт: если он читается,
+    // пришёл EOF (сервер закрыл соединение по своему keep-alive timeout)
+    try {
+      return session_->socket().poll(Poco::Timespan(0),
+                                     Poco::Net::Socket::SELECT_READ);
+    } catch (const Poco::Exception &) {
+      return true;
+    }
+  }
+
+  void Cancel() {
+    // shutdown, а не close: fd остаётся за сессией, а блокирующее чтение
+    // (в том числе внутри TLS) в потоке запроса сразу получает EOF
+    ::shutdown(session_->socket().impl()->sockfd(), SHUT_RDWR);
+  }
+
+  SessionPool::Lease session_;
+  PollAbort *abort_ = nullptr;
+  // отмена long-poll; зарегистрирована, пока идёт обмен
+  Poco::Net::HTTPResponse response_;
+  CountingStreambuf counter_;
+  std::istream body_{&counter_};
+  ApiCallTimer *timer_ = nullptr;
+  // timer вызывающего живёт дольше обмена
+};
+
+class LoopbackExchange : public TransportExchange {
+public:
+  explicit LoopbackExchange(std::string body) : body_(std::move(body)) {}
+
+  std::istream &Body() override { return body_; }
+  void Finish() override {}
+
+private:
+  std::istringstream body_;
+};
+
+} // namespace
+
+void PollAbort::Abort() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  aborted_ = true;
+  if (cancel_) {
+    cancel_();
+  }
+}
+
+void PollAbort::Reset() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  aborted_ = false;
+}
+
+bool PollAbort::Aborted() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return aborted_;
+}
+
+bool PollAbort::Attach(std::function<void()> cancel) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (aborted_) {
+    return false;
+  }
+  cancel_ = std::move(cancel);
+  return true;
+}
+
+void PollAbort::Detach() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  cancel_ = nullptr;
+}
+
+PocoTransport::PocoTransport(std::shared_ptr<SessionPool> session_pool,
+                             const Poco::URI &uri)
+    : session_pool_(std::move(session_pool)),
+      host_(session_pool_->Resolve(uri)) {}
+
+std::unique_ptr<TransportExchange>
+PocoTransport::Send(ApiCallTimer &timer, const TransportRequest &request,
+                    TransportResponse &response) {
+  SessionPool::Lease session = request.long_poll
+                                   ? session_pool_->AcquireLongPoll(
+                                         host_, &long_poll_)
+                                   : session_pool_->Acquire(host_);
+  session->setTimeout(Poco::Timespan(request.timeout, 0));
+  auto exchange =
+      std::make_unique<PocoExchange>(std::move(session), request.abort);
+  exchange->Send(timer, request, response);
+  return exchange;
+}
+
+void PocoTransport::Prepare() { Poco::Net::DNS::resolve(host_->host); }
+
+LoopbackTransport::LoopbackTransport(Handler handler)
+    : handler_(std::move(handler)) {}
+
+std::unique_ptr<TransportExchange>
+LoopbackTransport::Send(ApiCallTimer &timer, const TransportRequest &request,
+                        TransportResponse &response) {
+  if (request.abort != nullptr && request.abort->Aborted()) {
+    throw PollAborted("long poll aborted");
+  }
+  timer.BytesOut(request.body.size());
+  timer.Phase(ApiPhase::kRequest);
+  std::string body;
+  response.status = handler_(request, body);
+  // сокета нет, прервать handler нельзя; он сам может смотреть на
+  // request.abort и вернуться раньше
+  if (request.abort != nullptr && request.abort->Aborted()) {
+    throw PollAborted("long poll aborted");
+  }
+  response.reason = Poco::Net::HTTPResponse::getReasonForStatus(
+      static_cast<Poco::Net::HTTPResponse::HTTPStatus>(response.status));
+  timer.Phase(ApiPhase::kResponse);
+  timer.SetStatus(response.status);
+  timer.BytesIn(body.size());
+  return std::make_unique<LoopbackExchange>(std::move(body));
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <Poco/URI.h>
+
+#include "session_pool.h"
+
+class ApiCallTimer;
+class PollAbort;
+
+// http обмен клиента с Bot API: ClientTelegramBotAPI собирает запрос и читает
+// тело ответа потоком, а как байты доходят до сервера - дело транспорта
+// PocoTransport - keep-alive сессии SessionPool, LoopbackTransport - вызов
+// обработчика в том же процессе, без сокетов (тесты и бенчмарки)
+
+struct TransportRequest {
+  std::string method = "GET";
+  std::string_view path;
+  // путь с query, например "/bot123/getUpdates?timeout=5"
+  std::string_view content_type;
+  std::string_view body;
+  // строки вызывающего, должны жить до конца Send: путь метода клиент
+  // считает один раз и на запрос его не копирует
+  int timeout = 10;
+  // секунды на весь обмен
+  bool long_poll = false;
+  // getUpdates: отдельное соединение, чтобы не занимать сокеты sendMessage
+  bool idempotent = false;
+  // повтор безопасен (getUpdates, getMe): после обрыва на переиспользованном
+  // сокете запрос можно отправить заново, даже если сервер его уже получил
+  PollAbort *abort = nullptr;
+  // long-poll: его можно прервать из другого потока (TelegramBot::Stop)
+};
+
+// запрос не ушёл на сервер (не подключились или не отправили заголовки, а
+// тело ещё не писали): его можно повторить даже для sendMessage
+class RequestNotSent : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// запрос прерван через PollAbort: не ошибка сети, повторять не нужно
+class PollAborted : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// отмена long-poll из другого потока: Abort рвёт сокет текущего getUpdates,
+// и следующие запросы с этим PollAbort до Reset бросают PollAborted, так
+// что Stop не ждёт конца long-poll timeout
+class PollAbort {
+public:
+  void Abort();
+  void Reset();
+  bool Aborted() const;
+
+  bool Attach(std::function<void()> cancel);
+  void Detach();
+  // для транспорта: на время обмена cancel прерывает его из потока Abort;
+  // false - Abort уже был и запрос отправлять не нужно; после Detach
+  // cancel больше не зовётся (можно закрывать сокет)
+
+private:
+  mutable std::mutex mutex_;
+  bool aborted_ = false;
+  std::function<void()> cancel_;
+};
+
+struct TransportResponse {
+  int status = 0;
+  std::string reason;
+};
+
+// ответ одного запроса; тело читается из Body, пока объект жив
+class TransportExchange {
+public:
+  virtual ~TransportExchange() = default;
+
+  virtual std::istream &Body() = 0;
+  virtual void Finish() = 0;
+  // дочитать тело (байты тела идут в timer из Send), соединение можно
+  // использовать снова; без Finish (например, при исключении) соединение
+  // закрывается
+};
+
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  virtual std::unique_ptr<TransportExchange>
+  Send(ApiCallTimer &timer, const TransportRequest &request,
+       TransportResponse &response) = 0;
+  // отправить запрос и дождаться заголовков ответа; фазы и байты
+  // отмечаются в timer; RequestNotSent, если запрос точно не дошёл до
+  // сервера, PollAborted после request.abort->Abort(), прочие сетевые
+  // ошибки - исключения Poco
+
+  virtual void Prepare() {}
+  // заранее сделать то, что не требует запроса (DNS), для Warmup
+};
+
+// keep-alive соединения из (возможно общего) SessionPool с хостом uri;
+// если переиспользованный сокет уже закрыт сервером, запрос повторяется на
+// новом - когда он ещё не отправлен или идемпотентен; перед
+// неидемпотентным запросом сокет из пула проверяется заранее (poll на EOF)
+class PocoTransport : public Transport {
+public:
+  PocoTransport(std::shared_ptr<SessionPool> session_pool,
+                const Poco::URI &uri);
+
+  std::unique_ptr<TransportExchange>
+  Send(ApiCallTimer &timer, const TransportRequest &request,
+       TransportResponse &response) override;
+  void Prepare() override;
+
+private:
+  std::shared_ptr<SessionPool> session_pool_;
+  SessionPool::HostGroup *host_;
+  // группа соединений хоста, находится в пуле один раз
+  SessionPool::LongPollSlot long_poll_;
+  // свободное соединение getUpdates этого клиента
+};
+
+// сервер Bot API в том же процессе: handler получает запрос целиком, пишет
+// тело ответа в body и возвращает http статус; handler зовётся из потоков
+// клиента параллельно, синхронизация - его забота
+class LoopbackTransport : public Transport {
+public:
+  using Handler =
+      std::function<int(const TransportRequest &request, std::string &body)>;
+
+  explicit LoopbackTransport(Handler handler);
+
+  std::unique_ptr<TransportExchange>
+  Send(ApiCallTimer &timer, const TransportRequest &request,
+       TransportResponse &response) override;
+
+private:
+  Handler handler_;
+};
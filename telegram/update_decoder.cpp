@@ -0,0 +1,157 @@
+#include "update_decoder.h"
+
+DecodedResponse UpdateDecoder::Decode(std::istream &body, const Sink &sink) {
+  DecodedResponse response;
+  JsonReader reader(body);
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    const std::string &key = reader.Key();
+    if (key == "ok") {
+      response.ok = reader.ReadBool();
+    } else if (key == "error_code") {
+      response.error_code = reader.ReadInt();
+    } else if (key == "description") {
+      reader.ReadString(response.description);
+    } else if (key == "result" && reader.Peek() == '[') {
+      reader.BeginArray();
+      while (reader.NextElement()) {
+        DecodeUpdate(reader);
+        sink(update_);
+      }
+    } else {
+      reader.Skip();
+    }
+  }
+  return response;
+}
+
+void UpdateDecoder::DecodeSingle(std::istream &body, const Sink &sink) {
+  JsonReader reader(body);
+  DecodeUpdate(reader);
+  sink(update_);
+}
+
+void UpdateDecoder::DecodeUpdate(JsonReader &reader) {
+  update_.update_id = 0;
+  update_.kind = DecodedUpdate::Kind::kOther;
+  update_.has_message = false;
+  update_.chat_id = 0;
+  update_.message_id = 0;
+  update_.has_text = false;
+  update_.text.clear();
+  update_.has_entities = false;
+  update_.commands.clear();
+  update_.callback_id.clear();
+  update_.callback_data.clear();
+  update_.from_id = 0;
+  update_.raw_begin = reader.Consumed();
+
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    const std::string &key = reader.Key();
+    if (key == "update_id") {
+      update_.update_id = reader.ReadInt();
+    } else if (key == "message" && reader.Peek() == '{') {
+      update_.kind = DecodedUpdate::Kind::kMessage;
+      update_.has_message = true;
+      DecodeMessage(reader);
+    } else if (key == "edited_message" && reader.Peek() == '{') {
+      update_.kind = DecodedUpdate::Kind::kEditedMessage;
+      DecodeMessage(reader);
+    } else if (key == "callback_query" && reader.Peek() == '{') {
+      update_.kind = DecodedUpdate::Kind::kCallbackQuery;
+      DecodeCallbackQuery(reader);
+    } else {
+      reader.Skip();
+    }
+  }
+  update_.raw_end = reader.Consumed();
+}
+
+void UpdateDecoder::DecodeMessage(JsonReader &reader) {
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    const std::string &key = reader.Key();
+    if (key == "message_id") {
+      update_.message_id = reader.ReadInt();
+    } else if (key == "text") {
+      update_.has_text = true;
+      reader.ReadString(update_.text);
+    } else if (key == "chat" && reader.Peek() == '{') {
+      update_.chat_id = DecodeId(reader);
+    } else if (key == "entities" && reader.Peek() == '[') {
+      update_.has_entities = true;
+      DecodeEntities(reader);
+    } else {
+      reader.Skip();
+    }
+  }
+}
+
+// у кнопки под сообщением бота из message нужны только chat.id и
+// message_id, текст и entities этого сообщения пропускаем
+void UpdateDecoder::DecodeCallbackQuery(JsonReader &reader) {
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    const std::string &key = reader.Key();
+    if (key == "id") {
+      reader.ReadString(update_.callback_id);
+    } else if (key == "data") {
+      reader.ReadString(update_.callback_data);
+    } else if (key == "from" && reader.Peek() == '{') {
+      update_.from_id = DecodeId(reader);
+    } else if (key == "message" && reader.Peek() == '{') {
+      reader.BeginObject();
+      while (reader.NextKey()) {
+        if (reader.Key() == "message_id") {
+          update_.message_id = reader.ReadInt();
+        } else if (reader.Key() == "chat" && reader.Peek() == '{') {
+          update_.chat_id = DecodeId(reader);
+        } else {
+          reader.Skip();
+        }
+      }
+    } else {
+      reader.Skip();
+    }
+  }
+}
+
+int64_t UpdateDecoder::DecodeId(JsonReader &reader) {
+  int64_t id = 0;
+  reader.BeginObject();
+  while (reader.NextKey()) {
+    if (reader.Key() == "id") {
+      id = reader.ReadInt();
+    } else {
+      reader.Skip();
+    }
+  }
+  return id;
+}
+
+void UpdateDecoder::DecodeEntities(JsonReader &reader) {
+  reader.BeginArray();
+  while (reader.NextElement()) {
+    int64_t offset = 0;
+    int64_t length = 0;
+    bool is_command = false;
+    reader.BeginObject();
+    while (reader.NextKey()) {
+      const std::string &key = reader.Key();
+      if (key == "type") {
+        reader.ReadString(entity_type_);
+        is_command = entity_type_ == "bot_command";
+      } else if (key == "offset") {
+        offset = reader.ReadInt();
+      } else if (key == "length") {
+        length = reader.ReadInt();
+      } else {
+        reader.Skip();
+      }
+    }
+    if (is_command) {
+      update_.commands.emplace_back(offset, length);
+    }
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json_reader.h"
+
+// один апдейт из ответа getUpdates; буферы переиспользуются между апдейтами,
+// поэтому сохранять ссылки на поля после возврата из Sink нельзя
+struct DecodedUpdate {
+  enum class Kind { kOther, kMessage, kEditedMessage, kCallbackQuery };
+
+  int64_t update_id = 0;
+  Kind kind = Kind::kOther;
+  bool has_message = false;
+  // kind == kMessage, оставлено для старого кода
+  int64_t chat_id = 0;
+  int64_t message_id = 0;
+  // для callback_query - сообщение с кнопкой (0, если кнопка inline-режима)
+  bool has_text = false;
+  std::string text;
+  bool has_entities = false;
+  std::vector<std::pair<int64_t, int64_t>> commands;
+  // offset и length сущностей bot_command из entities
+  std::string callback_id;
+  std::string callback_data;
+  int64_t from_id = 0;
+  // callback_query: id для answerCallbackQuery, data нажатой кнопки и кто
+  // нажал
+  size_t raw_begin = 0;
+  size_t raw_end = 0;
+  // где объект апдейта лежит в потоке, байты от начала (для журнала)
+};
+
+struct DecodedResponse {
+  bool ok = false;
+  int64_t error_code = 0;
+  std::string description;
+};
+
+// разбирает ответ getUpdates за один проход по потоку, без json-дерева
+// поля, которые мы не используем (from, chat.username, date, ...),
+// пропускаются без аллокаций
+class UpdateDecoder {
+public:
+  using Sink = std::function<void(const DecodedUpdate &)>;
+
+  DecodedResponse Decode(std::istream &body, const Sink &sink);
+  // sink вызывается для каждого апдейта (в том числе неизвестных типов,
+  // kind == kOther)
+
+  void DecodeSingle(std::istream &body, const Sink &sink);
+  // один объект Update без обёртки ok/result (тело запроса webhook)
+
+private:
+  void DecodeUpdate(JsonReader &reader);
+  void DecodeMessage(JsonReader &reader);
+  void DecodeCallbackQuery(JsonReader &reader);
+  int64_t DecodeId(JsonReader &reader);
+  // поле id объекта (chat, from), остальное пропускается
+  void DecodeEntities(JsonReader &reader);
+
+  DecodedUpdate update_;
+  std::string entity_type_;
+};
@@ -0,0 +1,272 @@
+#include "update_journal.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// формат сегмента, little-endian как в памяти:
+// "TGUJ" | uint32 версия | (uint32 длина | uint32 FNV-1a тела |
+// int64 время, мкс | тело) * n | нули до конца сегмента
+// длина 0 - конец данных: место после последней записи ещё не занято
+constexpr char kMagic[4] = {'T', 'G', 'U', 'J'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = 4 + 4;
+constexpr size_t kRecordHeader = 4 + 4 + 8;
+constexpr const char *kExtension = ".tgj";
+
+uint32_t Fnv1a(std::string_view data) {
+  uint32_t hash = 2166136261u;
+  for (char c : data) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+template <class T> void Write(char *data, T value) {
+  std::memcpy(data, &value, sizeof(value));
+}
+
+template <class T> T Read(const char *data) {
+  T value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+[[noreturn]] void ThrowJournalError(const std::string &file_name) {
+  throw std::runtime_error("can't write update journal " + file_name + ": " +
+                           strerror(errno));
+}
+
+} // namespace
+
+UpdateJournal::UpdateJournal(Options options) : options_(std::move(options)) {
+  std::filesystem::create_directories(options_.directory);
+  std::vector<std::string> segments = Segments(options_.directory);
+  if (!segments.empty()) {
+    next_segment_ =
+        std::stoull(std::filesystem::path(segments.back()).stem().string()) +
+        1;
+  }
+}
+
+UpdateJournal::~UpdateJournal() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  CloseSegment();
+}
+
+void UpdateJournal::Append(std::string_view body) {
+  int64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+  size_t record_bytes = kRecordHeader + body.size();
+  std::lock_guard<std::mutex> guard(mutex_);
+  // после записи должно остаться место под нулевую длину - признак конца
+  if (data_ == nullptr || size_ - used_ < record_bytes + sizeof(uint32_t)) {
+    CloseSegment();
+    OpenSegment(kHeaderSize + record_bytes + sizeof(uint32_t));
+  }
+  char *record = data_ + used_;
+  // тело и заголовок пишутся до того, как запись станет видна читателю,
+  // длина - последней
+  Write(record + 4, Fnv1a(body));
+  Write(record + 8, time_us);
+  std::memcpy(record + kRecordHeader, body.data(), body.size());
+  Write(record, static_cast<uint32_t>(body.size()));
+  used_ += record_bytes;
+  ++records_;
+}
+
+uint64_t UpdateJournal::Records() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return records_;
+}
+
+std::vector<std::string>
+UpdateJournal::Segments(const std::string &directory) {
+  std::vector<std::string> segments;
+  std::error_code error;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(directory, error)) {
+    const std::filesystem::path &path = entry.path();
+    std::string stem = path.stem().string();
+    if (path.extension() == kExtension && !stem.empty() &&
+        std::all_of(stem.begin(), stem.end(),
+                    [](unsigned char c) { return std::isdigit(c); })) {
+      segments.push_back(path.string());
+    }
+  }
+  // имена одной ширины, так что строковый порядок - порядок номеров
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+void UpdateJournal::OpenSegment(size_t min_bytes) {
+  char number[32];
+  std::snprintf(number, sizeof(number), "%016llu",
+                static_cast<unsigned long long>(next_segment_++));
+  segment_name_ = (std::filesystem::path(options_.directory) /
+                   (std::string(number) + kExtension))
+                      .string();
+  size_t size = std::max(options_.segment_bytes, min_bytes);
+  int fd = ::open(segment_name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    ThrowJournalError(segment_name_);
+  }
+  if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    ::close(fd);
+    ThrowJournalError(segment_name_);
+  }
+  void *mapped =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    ThrowJournalError(segment_name_);
+  }
+  data_ = static_cast<char *>(mapped);
+  size_ = size;
+  std::memcpy(data_, kMagic, sizeof(kMagic));
+  Write(data_ + sizeof(kMagic), kVersion);
+  used_ = kHeaderSize;
+}
+
+void UpdateJournal::CloseSegment() {
+  if (data_ == nullptr) {
+    return;
+  }
+  ::munmap(data_, size_);
+  data_ = nullptr;
+  // хвост из нулей больше не нужен; если обрезать не вышло, читатель
+  // всё равно остановится на нулевой длине
+  if (::truncate(segment_name_.c_str(), static_cast<off_t>(used_)) != 0) {
+    std::cerr << "can't truncate update journal " << segment_name_ << ": "
+              << strerror(errno) << std::endl;
+  }
+}
+
+JournalCapture::JournalCapture(std::streambuf *source) : source_(source) {}
+
+void JournalCapture::Accept(size_t begin, size_t end) {
+  Sync();
+  if (!accepted_.empty()) {
+    accepted_ += ',';
+  }
+  accepted_.append(pending_, begin - pending_begin_, end - begin);
+  Drop(end);
+}
+
+void JournalCapture::Drop(size_t end) {
+  Sync();
+  pending_.erase(0, end - pending_begin_);
+  pending_begin_ = end;
+}
+
+std::string JournalCapture::Body() const {
+  if (accepted_.empty()) {
+    return {};
+  }
+  return "{\"ok\":true,\"result\":[" + accepted_ + "]}";
+}
+
+JournalCapture::int_type JournalCapture::underflow() {
+  Sync();
+  std::streamsize read = source_->sgetn(buffer_, sizeof(buffer_));
+  if (read <= 0) {
+    return traits_type::eof();
+  }
+  setg(buffer_, buffer_, buffer_ + read);
+  return traits_type::to_int_type(buffer_[0]);
+}
+
+void JournalCapture::Sync() {
+  // всё, что разборщик уже забрал из буфера, переносим в pending_
+  if (gptr() != eback()) {
+    pending_.append(eback(), gptr());
+    setg(gptr(), gptr(), egptr());
+  }
+}
+
+JournalReader::JournalReader(const std::string &directory)
+    : segments_(UpdateJournal::Segments(directory)) {}
+
+JournalReader::~JournalReader() { Unmap(); }
+
+bool JournalReader::Next(JournalRecord &record) {
+  while (true) {
+    if (data_ != nullptr && size_ - pos_ >= kRecordHeader) {
+      const char *header = data_ + pos_;
+      uint32_t length = Read<uint32_t>(header);
+      if (length != 0 && size_ - pos_ - kRecordHeader >= length) {
+        std::string_view body(header + kRecordHeader, length);
+        if (Fnv1a(body) == Read<uint32_t>(header + 4)) {
+          record.time_us = Read<int64_t>(header + 8);
+          record.body = body;
+          pos_ += kRecordHeader + length;
+          return true;
+        }
+        std::cerr << "update journal " << segments_[next_segment_ - 1]
+                  << " is corrupted at " << pos_ << ", skipping the rest"
+                  << std::endl;
+      }
+    }
+    if (!MapNext()) {
+      return false;
+    }
+  }
+}
+
+bool JournalReader::MapNext() {
+  Unmap();
+  while (next_segment_ < segments_.size()) {
+    const std::string &file_name = segments_[next_segment_++];
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < kHeaderSize) {
+      ::close(fd);
+      continue;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      continue;
+    }
+    const char *data = static_cast<const char *>(mapped);
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0 ||
+        Read<uint32_t>(data + sizeof(kMagic)) != kVersion) {
+      std::cerr << file_name << " is not an update journal" << std::endl;
+      ::munmap(mapped, size);
+      continue;
+    }
+    ::madvise(mapped, size, MADV_SEQUENTIAL);
+    data_ = data;
+    size_ = size;
+    pos_ = kHeaderSize;
+    return true;
+  }
+  return false;
+}
+
+void JournalReader::Unmap() {
+  if (data_ != nullptr) {
+    ::munmap(const_cast<char *>(data_), size_);
+    data_ = nullptr;
+  }
+}
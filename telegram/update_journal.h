@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// журнал полученных апдейтов для воспроизведения (bot-run replay): ответы
+// getUpdates из принятых в батч апдейтов, в бинарных записях с длиной, чтобы
+// прогонять реальный трафик через роутер и обработчики в бенчмарках и после
+// исправления багов
+// журнал - каталог сегментов "<номер>.tgj"; сегмент создаётся размером
+// segment_bytes и отображается в память, запись - memcpy в отображение, так
+// что поллер не делает write на каждый батч, а упавший процесс оставляет
+// всё записанное в page cache; закрытый сегмент обрезается до данных
+// каждый запуск пишет в новый сегмент, старые не трогаются
+class UpdateJournal {
+public:
+  struct Options {
+    std::string directory;
+    size_t segment_bytes = size_t(64) << 20;
+  };
+
+  explicit UpdateJournal(Options options);
+  UpdateJournal(const UpdateJournal &) = delete;
+  UpdateJournal &operator=(const UpdateJournal &) = delete;
+  ~UpdateJournal();
+
+  void Append(std::string_view body);
+  // дописать тело ответа getUpdates с текущим временем; бросает
+  // std::runtime_error, если сегмент не создать
+
+  uint64_t Records() const;
+
+  static std::vector<std::string> Segments(const std::string &directory);
+  // файлы сегментов каталога по порядку записи
+
+private:
+  void OpenSegment(size_t min_bytes);
+  void CloseSegment();
+  // под mutex_
+
+  const Options options_;
+  mutable std::mutex mutex_;
+  uint64_t next_segment_ = 0;
+  std::string segment_name_;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t used_ = 0;
+  uint64_t records_ = 0;
+};
+
+// поток ответа getUpdates, из которого по ходу разбора откладываются в
+// журнал только принятые апдейты: копия прочитанного держится до конца
+// текущего апдейта, так что ответ целиком в памяти не собирается, а
+// пропущенные по batch_bytes апдейты не попадают в журнал дважды
+class JournalCapture : public std::streambuf {
+public:
+  explicit JournalCapture(std::streambuf *source);
+
+  void Accept(size_t begin, size_t end);
+  // апдейт по смещениям [begin, end) в потоке идёт в журнал
+  void Drop(size_t end);
+  // прочитанное до end журналу больше не нужно
+
+  std::string Body() const;
+  // {"ok":true,"result":[принятые апдейты]}; пусто, если не принят ни один
+
+protected:
+  int_type underflow() override;
+
+private:
+  void Sync();
+
+  std::streambuf *source_;
+  char buffer_[4096];
+  std::string pending_;
+  size_t pending_begin_ = 0;
+  // прочитанное, но ещё не принятое и не отброшенное
+  std::string accepted_;
+};
+
+struct JournalRecord {
+  int64_t time_us = 0;
+  // unix время получения, микросекунды
+  std::string_view body;
+  // view в отображение сегмента, живёт до следующего Next
+};
+
+// чтение журнала по порядку, сегмент за сегментом (mmap); запись с
+// неверной контрольной суммой (недописанный хвост при падении) заканчивает
+// сегмент
+class JournalReader {
+public:
+  explicit JournalReader(const std::string &directory);
+  JournalReader(const JournalReader &) = delete;
+  JournalReader &operator=(const JournalReader &) = delete;
+  ~JournalReader();
+
+  bool Next(JournalRecord &record);
+  // false - журнал кончился
+
+private:
+  bool MapNext();
+  void Unmap();
+
+  std::vector<std::string> segments_;
+  size_t next_segment_ = 0;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = 0;
+};
@@ -0,0 +1,139 @@
+#include "webhook.h"
+#include "client.h"
+
+#include <iostream>
+
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/ThreadPool.h>
+#include <Poco/URI.h>
+
+namespace {
+
+const std::string kSecretTokenHeader = "X-Telegram-Bot-Api-Secret-Token";
+
+// сравнение без раннего выхода, чтобы по времени ответа нельзя было
+// подбирать токен
+bool SecretEquals(const std::string &lhs, const std::string &rhs) {
+  unsigned char diff = lhs.size() != rhs.size();
+  for (size_t idx = 0; idx < lhs.size() && idx < rhs.size(); ++idx) {
+    diff |= static_cast<unsigned char>(lhs[idx] ^ rhs[idx]);
+  }
+  return diff == 0;
+}
+
+class WebhookHandler : public Poco::Net::HTTPRequestHandler {
+public:
+  WebhookHandler(const WebhookServer::Options &options,
+                 const WebhookServer::BatchHandler &handler)
+      : options_(options), handler_(handler) {}
+
+  void handleRequest(Poco::Net::HTTPServerRequest &request,
+                     Poco::Net::HTTPServerResponse &response) override {
+    if (request.getMethod() != "POST") {
+      Reply(response, Poco::Net::HTTPResponse::HTTP_METHOD_NOT_ALLOWED);
+      return;
+    }
+    if (Poco::URI(request.getURI()).getPath() != options_.path) {
+      Reply(response, Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+      return;
+    }
+    if (!options_.secret_token.empty() &&
+        !SecretEquals(request.get(kSecretTokenHeader, ""),
+                      options_.secret_token)) {
+      Reply(response, Poco::Net::HTTPResponse::HTTP_UNAUTHORIZED);
+      return;
+    }
+
+    // декодер держит буферы между запросами, свой на каждый поток сервера
+    thread_local UpdateDecoder decoder;
+    auto batch = std::make_shared<UpdateBatch>();
+    try {
+      decoder.DecodeSingle(request.stream(), [&](const DecodedUpdate &update) {
+        batch->Add(update);
+        batch->SetNextOffset(update.update_id + 1);
+      });
+    } catch (const JsonSyntaxError &e) {
+      std::cerr << "bad webhook body: " << e.what() << std::endl;
+      Reply(response, Poco::Net::HTTPResponse::HTTP_BAD_REQUEST);
+      return;
+    }
+
+    // handler может подождать место в очереди воркеров; пока мы не ответили,
+    // telegram не шлёт следующие апдейты - это и есть backpressure
+    handler_(std::move(batch));
+    Reply(response, Poco::Net::HTTPResponse::HTTP_OK);
+  }
+
+private:
+  static void Reply(Poco::Net::HTTPServerResponse &response,
+                    Poco::Net::HTTPResponse::HTTPStatus status) {
+    response.setStatus(status);
+    response.setContentLength(0);
+    response.send();
+  }
+
+  const WebhookServer::Options &options_;
+  const WebhookServer::BatchHandler &handler_;
+};
+
+class WebhookHandlerFactory : public Poco::Net::HTTPRequestHandlerFactory {
+public:
+  WebhookHandlerFactory(const WebhookServer::Options &options,
+                        const WebhookServer::BatchHandler &handler)
+      : options_(options), handler_(handler) {}
+
+  Poco::Net::HTTPRequestHandler *
+  createRequestHandler(const Poco::Net::HTTPServerRequest &) override {
+    return new WebhookHandler(options_, handler_);
+  }
+
+private:
+  const WebhookServer::Options &options_;
+  const WebhookServer::BatchHandler &handler_;
+};
+
+} // namespace
+
+WebhookServer::WebhookServer(Options options, BatchHandler handler)
+    : options_(std::move(options)), handler_(std::move(handler)) {}
+
+WebhookServer::~WebhookServer() { Stop(); }
+
+void WebhookServer::Start() {
+  int threads = options_.threads > 0 ? options_.threads : 1;
+  thread_pool_.reset(new Poco::ThreadPool(threads, threads));
+  socket_.reset(new Poco::Net::ServerSocket(options_.port));
+
+  auto *params = new Poco::Net::HTTPServerParams();
+  params->setMaxThreads(threads);
+  params->setMaxQueued(options_.max_queued);
+  server_.reset(new Poco::Net::HTTPServer(
+      new WebhookHandlerFactory(options_, handler_), *thread_pool_, *socket_,
+      params));
+  server_->start();
+}
+
+void WebhookServer::Stop() {
+  if (server_) {
+    server_->stop();
+
+    server_.reset();
+    socket_.reset();
+    thread_pool_.reset();
+  }
+}
+
+uint16_t WebhookServer::Port() const {
+  return socket_ ? socket_->address().port() : options_.port;
+}
+
+std::string WebhookServer::PathFor(const std::string &public_url) {
+  std::string path = Poco::URI(public_url).getPath();
+  return path.empty() ? "/" : path;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace Poco {
+class ThreadPool;
+namespace Net {
+class HTTPServer;
+class ServerSocket;
+} // namespace Net
+} // namespace Poco
+
+class UpdateBatch;
+
+// приём апдейтов через webhook вместо long-poll getUpdates
+// telegram сам присылает POST с одним Update на каждый апдейт; запрос
+// проверяется по заголовку X-Telegram-Bot-Api-Secret-Token, разбирается тем
+// же потоковым декодером и уходит в handler как батч из одного апдейта
+class WebhookServer {
+public:
+  struct Options {
+    uint16_t port = 8443;
+    std::string path = "/";
+    std::string secret_token;
+    // пустой - заголовок не проверяется
+    int threads = 8;
+    int max_queued = 256;
+  };
+
+  using BatchHandler = std::function<void(std::shared_ptr<UpdateBatch>)>;
+
+  WebhookServer(Options options, BatchHandler handler);
+  WebhookServer(const WebhookServer &) = delete;
+  WebhookServer &operator=(const WebhookServer &) = delete;
+  ~WebhookServer();
+
+  void Start();
+  void Stop();
+
+  uint16_t Port() const;
+
+  static std::string PathFor(const std::string &public_url);
+  // путь, на который telegram будет слать POST для url из setWebhook;
+  // "/" для url без пути
+
+private:
+  const Options options_;
+  const BatchHandler handler_;
+  std::unique_ptr<Poco::ThreadPool> thread_pool_;
+  std::unique_ptr<Poco::Net::ServerSocket> socket_;
+  std::unique_ptr<Poco::Net::HTTPServer> server_;
+};
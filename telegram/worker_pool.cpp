@@ -0,0 +1,111 @@
+#include "worker_pool.h"
+
+#include <iostream>
+#include <stdexcept>
+
+WorkerPool::WorkerPool(size_t workers, size_t queue_capacity)
+    : queue_capacity_(queue_capacity ? queue_capacity : 1) {
+  if (workers == 0) {
+    workers = 1;
+  }
+  for (size_t idx = 0; idx < workers; ++idx) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+  for (auto &shard : shards_) {
+    Shard *current = shard.get();
+    shard->thread = std::thread([this, current] { Run(*current); });
+  }
+}
+
+WorkerPool::~WorkerPool() { Stop(); }
+
+void WorkerPool::Submit(int64_t shard_key, Task task) {
+  Shard &shard =
+      *shards_[static_cast<uint64_t>(shard_key) % shards_.size()];
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  shard.not_full.wait(lock, [&] {
+    return shard.stop || shard.tasks.size() < queue_capacity_;
+  });
+  if (shard.stop) {
+    throw std::runtime_error("worker pool is stopped");
+  }
+  shard.tasks.push_back(std::move(task));
+  lock.unlock();
+  shard.not_empty.notify_one();
+}
+
+void WorkerPool::Stop() {
+  for (auto &shard : shards_) {
+    {
+      std::lock_guard<std::mutex> guard(shard->mutex);
+      shard->stop = true;
+    }
+    shard->not_empty.notify_all();
+    shard->not_full.notify_all();
+  }
+  for (auto &shard : shards_) {
+    if (shard->thread.joinable()) {
+      shard->thread.join();
+    }
+  }
+}
+
+size_t WorkerPool::Pending() const {
+  size_t pending = 0;
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    pending += shard->tasks.size();
+  }
+  return pending;
+}
+
+void WorkerPool::Run(Shard &shard) {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(shard.mutex);
+      shard.not_empty.wait(lock,
+                           [&] { return shard.stop || !shard.tasks.empty(); });
+      if (shard.tasks.empty()) {
+        return;
+      }
+      task = std::move(shard.tasks.front());
+      shard.tasks.pop_front();
+    }
+    shard.not_full.notify_one();
+    try {
+      task();
+    } catch (const std::exception &e) {
+      std::cerr << "handler failed: " << e.what() << std::endl;
+    }
+  }
+}
+
+BatchCommitter::BatchCommitter(std::function<void(int64_t)> commit)
+    : commit_(std::move(commit)) {}
+
+uint64_t BatchCommitter::Begin(int64_t next_offset, size_t tasks) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  batches_.push_back(Batch{next_offset, tasks});
+  uint64_t batch = first_batch_ + batches_.size() - 1;
+  CommitReady();
+  return batch;
+}
+
+void BatchCommitter::Done(uint64_t batch) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  --batches_[batch - first_batch_].remaining;
+  CommitReady();
+}
+
+void BatchCommitter::CommitReady() {
+  int64_t offset = -1;
+  while (!batches_.empty() && batches_.front().remaining == 0) {
+    offset = batches_.front().next_offset;
+    batches_.pop_front();
+    ++first_batch_;
+  }
+  if (offset != -1) {
+    commit_(offset);
+  }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// N воркеров, у каждого своя ограниченная очередь; задачи с одним ключом
+// (chat_id) всегда попадают в одну очередь, поэтому порядок внутри чата
+// сохраняется, а медленный чат не блокирует остальные шарды
+// Submit блокируется, пока в очереди шарда нет места (backpressure)
+class WorkerPool {
+public:
+  using Task = std::function<void()>;
+
+  WorkerPool(size_t workers, size_t queue_capacity);
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+  ~WorkerPool();
+
+  void Submit(int64_t shard_key, Task task);
+
+  void Stop();
+  // доделать уже поставленные задачи и остановить потоки
+
+  size_t Pending() const;
+  // сколько задач ждёт во всех очередях
+
+private:
+  struct Shard {
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Task> tasks;
+    bool stop = false;
+    std::thread thread;
+  };
+
+  void Run(Shard &shard);
+
+  const size_t queue_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// offset можно сохранить только когда обработан весь батч и все батчи до
+// него; батчи регистрируются в порядке получения, commit вызывается для
+// самого свежего полностью обработанного префикса
+class BatchCommitter {
+public:
+  explicit BatchCommitter(std::function<void(int64_t)> commit);
+
+  uint64_t Begin(int64_t next_offset, size_t tasks);
+  // зарегистрировать батч из tasks задач, вернуть его номер
+
+  void Done(uint64_t batch);
+  // одна задача батча закончилась
+
+private:
+  struct Batch {
+    int64_t next_offset;
+    size_t remaining;
+  };
+
+  void CommitReady();
+
+  std::function<void(int64_t)> commit_;
+  std::mutex mutex_;
+  std::deque<Batch> batches_;
+  uint64_t first_batch_ = 0;
+};
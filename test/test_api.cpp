@@ -1,7 +1,25 @@
 #include "catch.hpp"
+#include "filesystem"
 #include "fstream"
+#include "iomanip"
+#include "set"
+#include "sstream"
+#include "telegram/bot.h"
+#include "telegram/chat_state.h"
 #include "telegram/client.h"
 #include "telegram/fake.h"
+#include "telegram/fake_data.h"
+#include "telegram/journal_replay.h"
+#include "telegram/metrics.h"
+#include "telegram/poll_controller.h"
+#include "telegram/response_cache.h"
+#include "telegram/tracing.h"
+#include "telegram/webhook.h"
+
+#include <Poco/Exception.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
 
 void ClearOffsetBetweenTests() {
   // чищу оффсет после каждого теста, потому что если запускать их по
@@ -35,6 +53,63 @@ TEST_CASE("Single getMe") {
   ClearOffsetBetweenTests();
 }
 
+TEST_CASE("Warm up") {
+  telegram::FakeServer fake("Single getMe");
+  fake.Start();
+  ClientTelegramBotAPI client("123", fake.GetUrl());
+  client.Warmup(1);
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Warm up holds every connection") {
+  // соединение занято, пока ответ не дочитан (Finish)
+  struct Counters {
+    std::mutex mutex;
+    int open = 0;
+    int max_open = 0;
+  };
+  class HeldExchange : public TransportExchange {
+  public:
+    explicit HeldExchange(Counters &counters) : counters_(counters) {}
+    std::istream &Body() override { return body_; }
+    void Finish() override {
+      std::lock_guard<std::mutex> guard(counters_.mutex);
+      --counters_.open;
+    }
+
+  private:
+    Counters &counters_;
+    std::istringstream body_{"{\"ok\":true,\"result\":{}}"};
+  };
+  class CountingTransport : public Transport {
+  public:
+    explicit CountingTransport(Counters &counters) : counters_(counters) {}
+    std::unique_ptr<TransportExchange>
+    Send(ApiCallTimer &, const TransportRequest &,
+         TransportResponse &response) override {
+      std::lock_guard<std::mutex> guard(counters_.mutex);
+      counters_.max_open = std::max(counters_.max_open, ++counters_.open);
+      response.status = 200;
+      return std::make_unique<HeldExchange>(counters_);
+    }
+
+  private:
+    Counters &counters_;
+  };
+
+  Counters counters;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<CountingTransport>(counters);
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  client.Warmup(3);
+  REQUIRE(counters.max_open == 3);
+  REQUIRE(counters.open == 0);
+
+  ClearOffsetBetweenTests();
+}
+
 TEST_CASE("getMe error handling") {
   telegram::FakeServer fake("getMe error handling");
   fake.Start();
@@ -99,3 +174,890 @@ TEST_CASE("Handle getUpdates offset") {
 
   ClearOffsetBetweenTests();
 }
+
+TEST_CASE("Reuse keep-alive connection") {
+  telegram::FakeServer fake("Reuse keep-alive connection");
+  fake.Start();
+  auto host = fake.GetUrl();
+  auto token = "123";
+
+  ClientTelegramBotAPI client(token, host);
+  REQUIRE(client.GetMe());
+  REQUIRE(client.GetMe());
+
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Stale keep-alive connection") {
+  telegram::FakeOptions options;
+  options.Port = 0;
+  options.KeepAliveTimeout = std::chrono::milliseconds(100);
+  telegram::FakeServer fake("Stale keep-alive connection", options);
+  fake.Start();
+
+  ClientTelegramBotAPI client("123", fake.GetUrl());
+  client.SendMessage(104519755, "Hi!");
+  // сервер успевает закрыть соединение, пока оно лежит в пуле
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  REQUIRE_NOTHROW(client.SendMessage(104519755, "Hi!"));
+
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Long-poll connection per client") {
+  // общий пул BotHost: у каждого бота свой long-poll, иначе на каждом
+  // getUpdates все боты, кроме одного, открывали бы новое соединение
+  SessionPool pool;
+  SessionPool::HostGroup *group =
+      pool.Resolve(Poco::URI("http://api.telegram.org/"));
+  SessionPool::LongPollSlot first;
+  SessionPool::LongPollSlot second;
+  for (int poll = 0; poll < 2; ++poll) {
+    SessionPool::Lease first_lease = pool.AcquireLongPoll(group, &first);
+    SessionPool::Lease second_lease = pool.AcquireLongPoll(group, &second);
+    REQUIRE(first_lease.Reused() == (poll > 0));
+    REQUIRE(second_lease.Reused() == (poll > 0));
+    first_lease.Recycle();
+    second_lease.Recycle();
+  }
+  // обычные запросы long-poll соединения не забирают
+  REQUIRE(!pool.Acquire(group).Reused());
+}
+
+TEST_CASE("Async send messages") {
+  telegram::FakeServer fake("Single getUpdates and send messages");
+  fake.Start();
+  auto host = fake.GetUrl();
+  auto token = "123";
+
+  ClientTelegramBotAPI client(token, host);
+  auto updates = client.GetUpdates();
+  auto first = std::dynamic_pointer_cast<NewMessage>(updates[0]);
+  auto second = std::dynamic_pointer_cast<NewMessage>(updates[1]);
+  REQUIRE(first != nullptr);
+  REQUIRE(second != nullptr);
+
+  auto hi = client.SendMessageAsync(first->GetChatId(), "Hi!");
+  auto reply = client.SendMessageAsync(second->GetChatId(), "Reply",
+                                       second->GetMessageId());
+  std::promise<int64_t> last_reply;
+  client.SendMessageAsync(
+      second->GetChatId(), "Reply", second->GetMessageId(),
+      [&](const SentMessage &message, std::exception_ptr error) {
+        last_reply.set_value(error ? -1 : message.message_id);
+      });
+
+  REQUIRE(hi.get().message_id == 15);
+  REQUIRE(reply.get().message_id == 16);
+  REQUIRE(last_reply.get_future().get() == 16);
+
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Retry getUpdates") {
+  telegram::FakeServer fake("Retry getUpdates");
+  fake.Start();
+  auto host = fake.GetUrl();
+  auto token = "123";
+
+  ClientTelegramBotAPI client(token, host);
+  REQUIRE(client.GetUpdates().empty());
+
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Offset file per bot") {
+  REQUIRE(ClientTelegramBotAPI::OffsetFileName("offsets", "123:secret") ==
+          "offsets/123.offset");
+  REQUIRE(ClientTelegramBotAPI::OffsetFileName("", "456:secret") ==
+          "456.offset");
+  REQUIRE(ClientTelegramBotAPI::OffsetFileName("offsets", "../bad") ==
+          "offsets/___bad.offset");
+}
+
+TEST_CASE("Metrics for getMe") {
+  Metrics::Api &get_me = GlobalMetrics().Method(ApiMethod::kGetMe);
+  uint64_t ok_before = get_me.responses[Metrics::StatusIndex(200)].Value();
+  uint64_t count_before = get_me.total_us.Read().count;
+  uint64_t bytes_before = get_me.bytes_in.Value();
+
+  telegram::FakeServer fake("Single getMe");
+  fake.Start();
+  ClientTelegramBotAPI client("123", fake.GetUrl());
+  REQUIRE(client.GetMe());
+  fake.StopAndCheckExpectations();
+
+  REQUIRE(get_me.responses[Metrics::StatusIndex(200)].Value() ==
+          ok_before + 1);
+  REQUIRE(get_me.total_us.Read().count == count_before + 1);
+  // считаются прочитанные байты тела, а не Content-Length
+  REQUIRE(get_me.bytes_in.Value() > bytes_before);
+  std::ostringstream exposition;
+  GlobalMetrics().WritePrometheus(exposition);
+  std::string sample =
+      "telegram_api_responses_total{method=\"getMe\",code=\"200\"}";
+  REQUIRE(exposition.str().find(sample) != std::string::npos);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Benchmark scenario") {
+  telegram::FakeOptions options;
+  options.Port = 0;
+  options.BatchSize = 10;
+  options.TotalUpdates = 15;
+  options.Chats = 3;
+  telegram::FakeServer fake("Benchmark", options);
+  fake.Start();
+  ClientTelegramBotAPI client("123", fake.GetUrl());
+
+  auto batch = client.GetUpdateBatch();
+  REQUIRE(batch->Size() == 10);
+  for (const Update &update : *batch) {
+    const NewMessage &message = std::get<NewMessage>(update);
+    REQUIRE(message.AreCommandsInText());
+    client.SendMessage(message.GetChatId(), "reply");
+  }
+  REQUIRE(client.GetUpdateBatch()->Size() == 5);
+  REQUIRE(client.GetUpdateBatch()->Empty());
+  fake.StopAndCheckExpectations();
+
+  telegram::BenchmarkStats stats = fake.Stats();
+  REQUIRE(stats.UpdatesServed == 15);
+  REQUIRE(stats.SendMessageRequests == 10);
+  REQUIRE(stats.RepliesReceived == 10);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("SendMessage json") {
+  std::string json = ClientTelegramBotAPI::FormSendMessageJson(
+      -42, "\"quoted\" \\ line\nnext\t\x01 привет", 7);
+  REQUIRE(json == "{\"chat_id\":-42,\"text\":\"\\\"quoted\\\" \\\\ line\\nnext"
+                  "\\t\\u0001 привет\",\"reply_to_message_id\":7}");
+
+  // тот же буфер переиспользуется без новой аллокации
+  std::string buffer = json;
+  size_t capacity = buffer.capacity();
+  ClientTelegramBotAPI::WriteSendMessageJson(buffer, 1, "short");
+  REQUIRE(buffer == "{\"chat_id\":1,\"text\":\"short\"}");
+  REQUIRE(buffer.capacity() == capacity);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Commands in non-ASCII text") {
+  UpdateBatch batch;
+  DecodedUpdate update;
+  update.has_message = true;
+  update.has_text = true;
+  update.has_entities = true;
+  // "Привет" - 6 единиц utf-16, но 12 байт utf-8
+  update.text = "Привет /weather и 😀 /random";
+  update.commands = {{7, 8}, {21, 7}};
+  batch.Add(update);
+
+  update.has_entities = false;
+  update.commands.clear();
+  update.text = "/start@test_bot сейчас, потом /styleguide; a/b";
+  batch.Add(update);
+
+  update.text = "без команд";
+  batch.Add(update);
+
+  REQUIRE(batch.Size() == 3);
+  const NewMessage &with_entities = std::get<NewMessage>(batch.Updates()[0]);
+  REQUIRE(with_entities.Commands().size() == 2);
+  REQUIRE(with_entities.Commands()[0] == "/weather");
+  REQUIRE(with_entities.Commands()[1] == "/random");
+
+  const NewMessage &without_entities =
+      std::get<NewMessage>(batch.Updates()[1]);
+  REQUIRE(without_entities.AreCommandsInText());
+  REQUIRE(without_entities.Commands().size() == 2);
+  REQUIRE(without_entities.Commands()[0] == "/start@test_bot");
+  REQUIRE(without_entities.Commands()[1] == "/styleguide");
+
+  REQUIRE(!std::get<NewMessage>(batch.Updates()[2]).AreCommandsInText());
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Broadcast") {
+  telegram::FakeServer fake("Broadcast");
+  fake.Start();
+  ClientTelegramBotAPI client("123", fake.GetUrl());
+  std::string cursor_file = "broadcast.cursor";
+  std::remove(cursor_file.c_str());
+
+  std::vector<int64_t> chats = {1, 2, 403, 4, 5};
+  BroadcastReport report =
+      client.Broadcast(chats, BroadcastPayload{"News", ""}, {cursor_file});
+  REQUIRE(report.Complete());
+  REQUIRE(report.sent == 4);
+  REQUIRE(report.failed == 1);
+  REQUIRE(report.cursor == chats.size());
+  REQUIRE(report.statuses[2] == DeliveryStatus::kFailed);
+  REQUIRE(report.failures.size() == 1);
+  REQUIRE(report.failures[0].chat_id == 403);
+  REQUIRE(report.failures[0].http_code == 403);
+
+  // повторный запуск с тем же курсором никому ничего не шлёт
+  report = client.Broadcast(chats, BroadcastPayload{"News", ""}, {cursor_file});
+  REQUIRE(report.skipped == chats.size());
+  REQUIRE(report.sent == 0);
+  std::remove(cursor_file.c_str());
+
+  std::string photo_file = "broadcast-photo.jpg";
+  {
+    std::ofstream photo(photo_file, std::ios::binary);
+    photo << "photo-bytes";
+  }
+  report =
+      client.Broadcast({1, 2, 3, 4}, BroadcastPayload{"caption", photo_file});
+  REQUIRE(report.sent == 4);
+  std::remove(photo_file.c_str());
+
+  fake.StopAndCheckExpectations();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Chat state store") {
+  std::string snapshot_file = "chat_state.snapshot";
+  std::remove(snapshot_file.c_str());
+  ChatStateStore::Options options;
+  options.shards = 1;
+  options.max_bytes = 3 * (ChatStateStore::kEntryOverhead + 5);
+  options.snapshot_file = snapshot_file;
+  options.snapshot_interval = std::chrono::milliseconds(0);
+  {
+    ChatStateStore store(options);
+    store.Put(1, "one");
+    store.Put(2, "two");
+    store.Update(1, [](std::string &state) { state += "!"; });
+    store.Put(3, "three");
+    // чат 2 трогали давнее всех, он и вытесняется
+    store.Put(4, "four");
+    REQUIRE(store.Size() == 3);
+    REQUIRE(store.Evictions() == 1);
+    REQUIRE(!store.Get(2));
+    REQUIRE(*store.Get(1) == "one!");
+    size_t bytes = store.Bytes();
+    REQUIRE_THROWS_AS(store.Update(1,
+                                   [](std::string &state) {
+                                     state += "unsaved";
+                                     throw std::runtime_error("failed");
+                                   }),
+                      std::runtime_error);
+    REQUIRE(*store.Get(1) == "one!");
+    REQUIRE(store.Bytes() == bytes);
+  }
+
+  ChatStateStore reloaded(options);
+  REQUIRE(reloaded.Size() == 3);
+  REQUIRE(*reloaded.Get(3) == "three");
+  REQUIRE(*reloaded.Get(4) == "four");
+  REQUIRE(*reloaded.Get(1) == "one!");
+  std::remove(snapshot_file.c_str());
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Dedup window survives restart") {
+  std::string offset_file = "dedup.offset";
+  std::remove(offset_file.c_str());
+  ClientTelegramBotAPI::Options options;
+  options.offset_file_name = offset_file;
+  options.offset.flush_interval = std::chrono::hours(1);
+  {
+    ClientTelegramBotAPI client("123", "http://localhost/", options);
+    client.CommitOffset(10);
+    // батч 10..13 обработан частично, затем бот остановился
+    client.MarkHandled(10);
+    client.MarkHandled(12);
+    // окно отложено до конца батча или остановки, а не пишется на апдейт
+    std::string window;
+    REQUIRE(OffsetStorage(offset_file).Load(&window) == 10);
+    DedupWindow stored;
+    REQUIRE(stored.Parse(window));
+    REQUIRE(!stored.Contains(12));
+  }
+  {
+    ClientTelegramBotAPI client("123", "http://localhost/", options);
+    REQUIRE(client.Handled(10));
+    REQUIRE(!client.Handled(11));
+    REQUIRE(client.Handled(12));
+    client.MarkHandled(11);
+    client.CommitOffset(12);
+  }
+  ClientTelegramBotAPI client("123", "http://localhost/", options);
+  REQUIRE(!client.Handled(11));
+  REQUIRE(client.Handled(12));
+  REQUIRE(!client.Handled(13));
+
+  DedupWindow window;
+  window.Insert(DedupWindow::kBits + 5);
+  REQUIRE(window.Base() == 6);
+  DedupWindow parsed;
+  REQUIRE(parsed.Parse(window.Serialize()));
+  REQUIRE(parsed.Contains(DedupWindow::kBits + 5));
+  REQUIRE(!parsed.Parse("12 xyz"));
+  std::remove(offset_file.c_str());
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("getUpdates byte budget") {
+  telegram::FakeServer fake("Single getUpdates and send messages");
+  fake.Start();
+  ClientTelegramBotAPI::Options options;
+  options.batch_bytes = 1;
+  ClientTelegramBotAPI client("123", fake.GetUrl(), options);
+  // бюджет меньше одного апдейта: берём только первый, остальные telegram
+  // пришлёт следующим getUpdates
+  auto batch = client.GetUpdateBatch();
+  REQUIRE(batch->Size() == 1);
+  REQUIRE(batch->NextOffset() == 851793507);
+  fake.Stop();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Loopback transport") {
+  // тот же клиент без сокетов: обработчик отвечает прямо из процесса
+  std::vector<std::string> requests;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&requests](const TransportRequest &request, std::string &body) {
+        requests.push_back(request.method + " " + std::string(request.path));
+        if (request.path == "/bot123/getUpdates") {
+          body = FakeData::GetUpdatesFourMessagesJson;
+        } else if (request.path == "/bot123/sendMessage") {
+          REQUIRE(request.content_type == "application/json");
+          REQUIRE(std::string(request.body) ==
+                  ClientTelegramBotAPI::FormSendMessageJson(104519755, "Hi!"));
+          body = FakeData::SendMessageHiJson;
+        } else {
+          body = "{\"ok\":false,\"description\":\"Not Found\"}";
+          return 404;
+        }
+        return 200;
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  auto batch = client.GetUpdateBatch();
+  REQUIRE(batch->Size() >= 3);
+  const auto &message = std::get<NewMessage>(*batch->begin());
+  client.SendMessage(message.GetChatId(), "Hi!");
+  REQUIRE_THROWS_AS(client.DeleteWebhook(), TelegramAPIError);
+  REQUIRE(requests.size() == 3);
+  REQUIRE(requests[0] == "GET /bot123/getUpdates");
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Send path is not copied per request") {
+  // путь sendMessage считается в конструкторе клиента, запрос ссылается на
+  // него, а не аллоцирует копию на каждую отправку
+  std::set<const char *> paths;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&paths](const TransportRequest &request, std::string &body) {
+        REQUIRE(request.path == "/bot123/sendMessage");
+        paths.insert(request.path.data());
+        body = FakeData::SendMessageHiJson;
+        return 200;
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  client.SendMessage(104519755, "Hi!");
+  client.SendMessage(104519755, "Hi!");
+  client.SendKeyboard(104519755, "Hi!", {{{"yes", "vote:yes"}}});
+  REQUIRE(paths.size() == 1);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Deferred commit keeps the batch on the server") {
+  std::vector<std::string> paths;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&paths](const TransportRequest &request, std::string &body) {
+        paths.emplace_back(request.path);
+        body = FakeData::GetUpdatesFourMessagesJson;
+        return 200;
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  client.SetAutoCommitOffset(false);
+  int64_t next_offset = client.GetUpdateBatch()->NextOffset();
+  // батч ещё не обработан: offset из него подтвердил бы его telegram
+  client.GetUpdateBatch();
+  REQUIRE(paths[1] == "/bot123/getUpdates");
+  client.CommitOffset(next_offset);
+  client.GetUpdateBatch();
+  REQUIRE(paths[2] ==
+          "/bot123/getUpdates?offset=" + std::to_string(next_offset));
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Sampled tracing") {
+  REQUIRE(SampleTrace() == 0);
+  SetTraceSampleRate(1);
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [](const TransportRequest &request, std::string &body) {
+        body = request.path == "/bot123/getUpdates"
+                   ? FakeData::GetUpdatesFourMessagesJson
+                   : FakeData::SendMessageHiJson;
+        return 200;
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  auto batch = client.GetUpdateBatch();
+  const auto &message = std::get<NewMessage>(*batch->begin());
+  REQUIRE(message.Trace() != 0);
+  {
+    // как в воркере бота: SendMessage подхватывает trace потока
+    ScopedTrace trace(message.Trace());
+    client.SendMessage(message.GetChatId(), "Hi!");
+  }
+  SetTraceSampleRate(0);
+
+  std::ostringstream out;
+  WriteChromeTrace(out);
+  std::ostringstream trace_id;
+  trace_id << std::hex << std::setw(16) << std::setfill('0')
+           << message.Trace();
+  std::string events = out.str();
+  for (std::string name : {"decode", "rate_limit", "sendMessage"}) {
+    std::string span = "\"name\":\"" + name + "\"";
+    REQUIRE(events.find(span) != std::string::npos);
+  }
+  REQUIRE(events.find(trace_id.str()) != std::string::npos);
+
+  // короткие потоки по очереди пишут в один и тот же буфер
+  for (int idx = 0; idx < 8; ++idx) {
+    std::thread([] {
+      auto now = std::chrono::steady_clock::now();
+      RecordSpan(1, "short_thread", now, now);
+    }).join();
+  }
+  std::ostringstream recycled;
+  WriteChromeTrace(recycled);
+  std::string spans = recycled.str();
+  std::set<std::string> lanes;
+  size_t count = 0;
+  for (size_t at = spans.find("\"short_thread\""); at != std::string::npos;
+       at = spans.find("\"short_thread\"", at + 1)) {
+    size_t tid = spans.find("\"tid\":", at);
+    lanes.insert(spans.substr(tid, spans.find(',', tid) - tid));
+    ++count;
+  }
+  REQUIRE(count == 8);
+  REQUIRE(lanes.size() == 1);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Bot restarts after Stop") {
+  std::atomic<int64_t> served{1};
+  // номер последнего апдейта, который можно отдать в getUpdates
+  auto transport = std::make_shared<LoopbackTransport>(
+      [&served](const TransportRequest &request, std::string &body) {
+        if (request.path.find("/getUpdates") == std::string::npos) {
+          body = "{\"ok\":true,\"result\":{}}";
+          return 200;
+        }
+        int64_t offset = 1;
+        size_t at = request.path.find("offset=");
+        if (at != std::string::npos) {
+          offset = std::stoll(std::string(request.path.substr(at + 7)));
+        }
+        if (offset > served.load()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+          body = "{\"ok\":true,\"result\":[]}";
+          return 200;
+        }
+        std::string id = std::to_string(offset);
+        body = "{\"ok\":true,\"result\":[{\"update_id\":" + id +
+               ",\"message\":{\"message_id\":" + id +
+               ",\"chat\":{\"id\":1},\"text\":\"/ping\","
+               "\"entities\":[{\"type\":\"bot_command\",\"offset\":0,"
+               "\"length\":5}]}}]}";
+        return 200;
+      });
+  TelegramBot::Options options;
+  options.transport = transport;
+  options.workers = 1;
+  TelegramBot bot("123", "http://loopback/", options);
+  std::atomic<int> pings{0};
+  bot.Router().Register("/ping",
+                        [&pings](const CommandContext &) { ++pings; });
+
+  auto run_until = [&bot, &pings](int expected) {
+    std::thread poller([&bot] { bot.Start(); });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (pings.load() < expected &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    bot.Stop();
+    poller.join();
+  };
+  run_until(1);
+  REQUIRE(pings.load() == 1);
+  // второй запуск снова поллит и обрабатывает новые апдейты
+  served = 2;
+  run_until(2);
+  REQUIRE(pings.load() == 2);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Stop interrupts the long poll") {
+  std::atomic<bool> polling{false};
+  std::atomic<bool> aborted{false};
+  auto transport = std::make_shared<LoopbackTransport>(
+      [&](const TransportRequest &request, std::string &body) {
+        body = "{\"ok\":true,\"result\":[]}";
+        if (request.path.find("/getUpdates") == std::string::npos) {
+          return 200;
+        }
+        // long-poll, на который сервер не ответит до конца теста
+        polling = true;
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < deadline) {
+          if (request.abort != nullptr && request.abort->Aborted()) {
+            aborted = true;
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return 200;
+      });
+  TelegramBot::Options options;
+  options.transport = transport;
+  options.workers = 1;
+  options.warm_connections = 0;
+  TelegramBot bot("123", "http://loopback/", options);
+
+  std::thread poller([&bot] { bot.Start(); });
+  while (!polling.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto stopped = std::chrono::steady_clock::now();
+  bot.Stop();
+  poller.join();
+  REQUIRE(aborted.load());
+  REQUIRE(std::chrono::steady_clock::now() - stopped <
+          std::chrono::seconds(2));
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Callback queries and edited messages") {
+  std::vector<std::string> bodies;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&bodies](const TransportRequest &request, std::string &body) {
+        if (request.path == "/bot123/getUpdates") {
+          body = "{\"ok\":true,\"result\":["
+                 "{\"update_id\":10,\"edited_message\":{\"message_id\":5,"
+                 "\"chat\":{\"id\":42},\"text\":\"/start fixed\"}},"
+                 "{\"update_id\":11,\"callback_query\":{\"id\":\"q1\","
+                 "\"from\":{\"id\":7},\"message\":{\"message_id\":6,"
+                 "\"chat\":{\"id\":42}},\"data\":\"vote:yes\"}}]}";
+        } else {
+          bodies.emplace_back(request.body);
+          body = "{\"ok\":true,\"result\":true}";
+        }
+        return 200;
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  auto batch = client.GetUpdateBatch();
+  REQUIRE(batch->Size() == 2);
+  REQUIRE(batch->NextOffset() == 12);
+
+  const auto &edited = std::get<EditedMessage>(batch->Updates()[0]);
+  REQUIRE(edited.GetChatId() == 42);
+  REQUIRE(edited.AreCommandsInText());
+
+  const Update &update = batch->Updates()[1];
+  const auto &query = std::get<CallbackQuery>(update);
+  REQUIRE(query.GetId() == "q1");
+  REQUIRE(query.GetData() == "vote:yes");
+  REQUIRE(query.GetFromId() == 7);
+  REQUIRE(query.GetMessageId() == 6);
+  REQUIRE(UpdateChatId(update) == 42);
+  REQUIRE(UpdateId(update) == 11);
+
+  CommandRouter router;
+  std::string payload;
+  router.RegisterCallback("vote", [&payload](const CallbackContext &context) {
+    payload = context.payload;
+    context.client.AnswerCallbackQuery(context.query.GetId(), "ok");
+    context.client.EditMessageText(context.query.GetChatId(),
+                                   context.query.GetMessageId(), "voted",
+                                   {{{"undo", "vote:undo"}}});
+  });
+  CallbackContext context{client, query, {}};
+  REQUIRE(router.DispatchCallback(context));
+  REQUIRE(payload == "yes");
+  REQUIRE(bodies.size() == 2);
+  REQUIRE(bodies[0] == "{\"callback_query_id\":\"q1\",\"text\":\"ok\"}");
+  REQUIRE(bodies[1] ==
+          "{\"chat_id\":42,\"message_id\":6,\"text\":\"voted\","
+          "\"reply_markup\":{\"inline_keyboard\":[[{\"text\":\"undo\","
+          "\"callback_data\":\"vote:undo\"}]]}}");
+
+  // старый GetUpdates не отдаёт правки, иначе они прошли бы как
+  // NewMessage
+  auto legacy = client.GetUpdates();
+  REQUIRE(legacy.size() == 1);
+  REQUIRE(!std::dynamic_pointer_cast<NewMessage>(legacy[0]));
+  REQUIRE(std::dynamic_pointer_cast<CallbackQuery>(legacy[0]));
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Response cache") {
+  ResponseCache cache(ResponseCache::Options{1024});
+  std::atomic<int> calls{0};
+  auto slow_backend = [&calls] {
+    ++calls;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    return std::string("-30");
+  };
+  std::vector<std::string> replies(8);
+  std::vector<std::thread> threads;
+  for (auto &reply : replies) {
+    threads.emplace_back([&cache, &slow_backend, &reply] {
+      reply = cache.GetOrCompute("/weather", std::chrono::seconds(60),
+                                 slow_backend);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // одновременные промахи склеились, дальше ответ из кэша
+  REQUIRE(calls == 1);
+  for (const auto &reply : replies) {
+    REQUIRE(reply == "-30");
+  }
+  REQUIRE(cache.GetOrCompute("/weather", std::chrono::seconds(60),
+                             slow_backend) == "-30");
+  REQUIRE(calls == 1);
+
+  auto failing = []() -> std::string { throw std::runtime_error("down"); };
+  REQUIRE_THROWS_AS(
+      cache.GetOrCompute("/rates", std::chrono::seconds(60), failing),
+      std::runtime_error);
+  REQUIRE(cache.GetOrCompute("/rates", std::chrono::seconds(60), [] {
+    return std::string("1.0");
+  }) == "1.0");
+
+  for (int idx = 0; idx < 32; ++idx) {
+    cache.GetOrCompute("/faq " + std::to_string(idx), std::chrono::seconds(60),
+                       [] { return std::string(100, 'a'); });
+  }
+  REQUIRE(cache.Bytes() <= 1024);
+  REQUIRE(cache.Evictions() > 0);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Adaptive poll controller") {
+  PollController::Options options;
+  options.idle_timeout = 25;
+  options.max_limit = 100;
+  options.max_in_flight = 150;
+  PollController poller(options);
+
+  // простой: длинный long-poll
+  PollController::Poll poll = poller.Next(0);
+  REQUIRE(poll.timeout == 25);
+  REQUIRE(poll.limit == 100);
+  poller.Observe(poll, 0);
+  REQUIRE(!poller.Backlog());
+
+  // полный батч: сразу следующий, без ожидания на сервере
+  poller.Observe(poll, 100);
+  REQUIRE(poller.Backlog());
+  poll = poller.Next(0);
+  REQUIRE(poll.timeout == 0);
+  REQUIRE(poll.limit == 100);
+
+  // воркеры не успевают: берём только то, что влезет
+  poll = poller.Next(120);
+  REQUIRE(poll.limit == 30);
+  REQUIRE(poller.Next(500).limit == 1);
+
+  poller.Observe(poll, 10);
+  REQUIRE(poller.Next(0).timeout == 25);
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Update journal replay") {
+  std::string directory = "journal_test";
+  std::filesystem::remove_all(directory);
+  {
+    ClientTelegramBotAPI::Options options;
+    UpdateJournal::Options journal_options;
+    journal_options.directory = directory;
+    options.journal = std::make_shared<UpdateJournal>(journal_options);
+    options.transport = std::make_shared<LoopbackTransport>(
+        [](const TransportRequest &, std::string &body) {
+          body = FakeData::GetUpdatesFourMessagesJson;
+          return 200;
+        });
+    ClientTelegramBotAPI client("123", "http://loopback/", options);
+    REQUIRE(!client.GetUpdateBatch()->Empty());
+    REQUIRE(options.journal->Records() == 1);
+  }
+  ClearOffsetBetweenTests();
+
+  // запись из журнала приходит тем же ответом getUpdates
+  JournalReplay::Options replay_options;
+  replay_options.directory = directory;
+  auto replay = std::make_shared<JournalReplay>(replay_options);
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [replay](const TransportRequest &request, std::string &body) {
+        return replay->Handle(request, body);
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+  auto batch = client.GetUpdateBatch();
+  REQUIRE(batch->Size() >= 3);
+  const auto &message = std::get<NewMessage>(*batch->begin());
+  client.SendMessage(message.GetChatId(), "Hi!");
+  REQUIRE(replay->Batches() == 1);
+  REQUIRE(replay->Calls() == 1);
+  REQUIRE(!replay->Done());
+  REQUIRE(client.GetUpdateBatch()->Empty());
+  REQUIRE(replay->Done());
+  std::filesystem::remove_all(directory);
+  ClearOffsetBetweenTests();
+
+  // в журнал идут только апдейты, принятые в батч: не влезшие в бюджет
+  // придут следующим getUpdates и запишутся тогда
+  {
+    ClientTelegramBotAPI::Options budget_options;
+    UpdateJournal::Options journal_options;
+    journal_options.directory = directory;
+    budget_options.journal = std::make_shared<UpdateJournal>(journal_options);
+    budget_options.batch_bytes = 1;
+    budget_options.transport = std::make_shared<LoopbackTransport>(
+        [](const TransportRequest &, std::string &body) {
+          body = FakeData::GetUpdatesFourMessagesJson;
+          return 200;
+        });
+    ClientTelegramBotAPI budget_client("123", "http://loopback/",
+                                       budget_options);
+    REQUIRE(budget_client.GetUpdateBatch()->Size() == 1);
+  }
+  JournalReader reader(directory);
+  JournalRecord record;
+  REQUIRE(reader.Next(record));
+  std::istringstream journaled{std::string(record.body)};
+  UpdateDecoder decoder;
+  size_t journaled_updates = 0;
+  REQUIRE(decoder
+              .Decode(journaled,
+                      [&](const DecodedUpdate &) { ++journaled_updates; })
+              .ok);
+  REQUIRE(journaled_updates == 1);
+  REQUIRE(!reader.Next(record));
+
+  std::filesystem::remove_all(directory);
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Webhook server") {
+  REQUIRE(WebhookServer::PathFor("https://example.com/hook/123") ==
+          "/hook/123");
+  REQUIRE(WebhookServer::PathFor("https://example.com") == "/");
+
+  WebhookServer::Options options;
+  options.port = 0;
+  options.path = WebhookServer::PathFor("https://example.com/hook");
+  options.secret_token = "secret";
+  std::vector<int64_t> received;
+  WebhookServer server(options,
+                       [&received](std::shared_ptr<UpdateBatch> batch) {
+                         for (const Update &update : *batch) {
+                           received.push_back(UpdateId(update));
+                         }
+                       });
+  server.Start();
+
+  auto post = [&server](const std::string &secret) {
+    Poco::Net::HTTPClientSession session("127.0.0.1", server.Port());
+    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST,
+                                   "/hook", Poco::Net::HTTPMessage::HTTP_1_1);
+    std::string body = "{\"update_id\":7,\"message\":{\"message_id\":1,"
+                       "\"chat\":{\"id\":42},\"text\":\"/start\"}}";
+    request.setContentType("application/json");
+    request.setContentLength(body.size());
+    request.set("X-Telegram-Bot-Api-Secret-Token", secret);
+    session.sendRequest(request) << body;
+    Poco::Net::HTTPResponse response;
+    session.receiveResponse(response);
+    return static_cast<int>(response.getStatus());
+  };
+  REQUIRE(post("wrong") == 401);
+  REQUIRE(received.empty());
+  // ответ уходит после handler, так что апдейт к этому моменту уже у нас
+  REQUIRE(post("secret") == 200);
+  REQUIRE(received == std::vector<int64_t>{7});
+  server.Stop();
+
+  ClearOffsetBetweenTests();
+}
+
+TEST_CASE("Retries do not duplicate sends") {
+  int sends = 0;
+  int get_me = 0;
+  bool not_sent_once = false;
+  ClientTelegramBotAPI::Options options;
+  options.transport = std::make_shared<LoopbackTransport>(
+      [&](const TransportRequest &request, std::string &body) {
+        if (request.path == "/bot123/getMe") {
+          if (++get_me == 1) {
+            throw Poco::TimeoutException("read timeout");
+          }
+          body = FakeData::GetMeJson;
+          return 200;
+        }
+        ++sends;
+        if (not_sent_once) {
+          not_sent_once = false;
+          throw RequestNotSent("connection refused");
+        }
+        // ответ потерян, но сообщение уже могло уйти пользователю
+        throw Poco::TimeoutException("read timeout");
+      });
+  ClientTelegramBotAPI client("123", "http://loopback/", options);
+
+  REQUIRE_THROWS_AS(client.SendMessage(1, "Hi!"), Poco::TimeoutException);
+  REQUIRE(sends == 1);
+
+  not_sent_once = true;
+  REQUIRE_THROWS_AS(client.SendMessage(1, "Hi!"), Poco::TimeoutException);
+  // неотправленный запрос повторили, отправленный - нет
+  REQUIRE(sends == 3);
+
+  // getMe идемпотентен: таймаут ретраится
+  client.Warmup(1);
+  REQUIRE(get_me == 2);
+
+  ClearOffsetBetweenTests();
+}